@@ -0,0 +1,24 @@
+//
+// Example plugin: 'mvm -p libmvm-fnv1a.so -i fnv1a.msm'
+//
+
+#include "../../src/shared.h"
+
+static ExceptionState fnv1a(Mvm* mvm, MvmSpan bytes, uint64_t* hash)
+{
+    (void)mvm;
+    *hash = MASM_HASH_SEED;
+    for (uint64_t i = 0; i < bytes.size; ++i) {
+        *hash ^= bytes.data[i];
+        *hash *= MASM_HASH_PRIME;
+    }
+    return EXCEPTION_SATE_OK;
+}
+
+// Replaces `addr` and `size` with the FNV-1a hash of the bytes at addr.
+static MVM_BIND1(interrupt_FNV1A, u64, fnv1a, span)
+
+bool mvm_plugin(void* registry, MvmPlugin_Claim claim)
+{
+    return claim(registry, "fnv1a", interrupt_FNV1A);
+}
@@ -19,6 +19,11 @@ int main(int argc, char** argv)
 
     mvm_loadProgramFromFile(&mvm, inputFilePath);
 
+    // Declared in order, so the imports get the same interrupt numbers when assembled again.
+    for (size_t i = 0; i < mvm.imports_size; ++i) {
+        printf("%%interrupt %s\n", mvm.imports[i]);
+    }
+
     for (InstAddr i = 0; i < mvm.program_size; ++i) {
         printf(InstName(mvm.program[i].type));
         if (InstHasOperand(mvm.program[i].type)) {
@@ -12,7 +12,10 @@ static void usage(FILE* stream)
     fprintf(stream, "Usage: masm -i <input.msm> -o <output.mbc> [options]\n");
     fprintf(stream, "  -h          Provides a help list.\n");
     fprintf(stream, "  -d          Print debug information.\n");
+    fprintf(stream, "  -O          Enables the optimizer.\n");
     fprintf(stream, "  -c          Enables Compatibility Warnings.\n");
+    fprintf(stream, "  -g          Writes the code labels as symbols for the debugger.\n");
+    fprintf(stream, "  -P <file>   Lays out the code by a profile written with 'mvm -P'.\n");
 }
 
 int main(int argc, char** argv)
@@ -20,9 +23,12 @@ int main(int argc, char** argv)
     shift(&argc, &argv); // Skip program name.
     const char* inputFilePath = NULL;
     const char* outputFilePath = NULL;
+    const char* profileFilePath = NULL;
     int debug = 0;
+    int optimize = 0;
     int error = 0;
     bool wos = false;
+    bool symbols = false;
     const char* errorFlag = NULL;
 
     while (argc > 0) {
@@ -41,13 +47,24 @@ int main(int argc, char** argv)
                 exit(1);
             }
             outputFilePath = shift(&argc, &argv);
+        } else if (strcmp(flag, "-P") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            profileFilePath = shift(&argc, &argv);
         } else if (strcmp(flag, "-h") == 0) {
             usage(stdout);
             exit(0);
         } else if (strcmp(flag, "-d") == 0) {
             debug = 1;
+        } else if (strcmp(flag, "-O") == 0) {
+            optimize = 1;
         } else if (strcmp(flag, "-c") == 0) {
             wos = true;
+        } else if (strcmp(flag, "-g") == 0) {
+            symbols = true;
         } else {
             error = 1;
             errorFlag = flag;
@@ -72,11 +89,45 @@ int main(int argc, char** argv)
         exit(1);
     }
 
+    masm.share_literals = optimize;
     mvm_translateSourceFile(&masm, cstr_as_sv(inputFilePath), 0);
-    masm_saveToFile(&masm, outputFilePath, wos);
+    // The profile refers to the program as it was assembled, so the layout comes before the optimizer.
+    size_t moved = 0;
+    if (profileFilePath != NULL) {
+        static uint64_t counts[MVM_PROGRAM_CAPACITY];
+        static uint64_t taken[MVM_PROGRAM_CAPACITY];
+        masm_loadProfile(&masm, profileFilePath, counts, taken);
+        moved = masm_layoutByProfile(&masm, counts, taken);
+    }
+    size_t removed = 0;
+    if (optimize) {
+        removed = masm_optimize(&masm);
+    }
+    masm_saveToFile(&masm, outputFilePath, wos, symbols);
 
     if (debug) {
-        printf("[DEBUG]: Consumed %d bytes of memory.\n", masm.memarena_size);
+        if (profileFilePath != NULL) {
+            printf("[DEBUG]: Profile moved %zu blocks.\n", moved);
+        }
+        if (optimize) {
+            printf("[DEBUG]: Optimizer removed %zu instructions.\n", removed);
+            printf("[DEBUG]: Tree shaking removed %zu unreachable instructions and %" PRIu64 " bytes of data.\n",
+                   masm.shaken_insts, masm.shaken_bytes);
+            for (size_t i = 0; i < masm.labels_size; ++i) {
+                if (masm.labels[i].removed) {
+                    printf("[DEBUG]:   code '%" PRIsv "'\n", SV_FORMAT(masm.labels[i].name));
+                }
+            }
+            for (size_t i = 0; i < masm.data_size; ++i) {
+                const MasmData* data = &masm.data[i];
+                if (data->removed) {
+                    printf("[DEBUG]:   data '%" PRIsv "' (%" PRIu64 " bytes at %" PRIu64 ")\n",
+                           SV_FORMAT(data->name.count > 0 ? data->name : cstr_as_sv("<literal>")), data->size, data->addr);
+                }
+            }
+        }
+        printf("[DEBUG]: Consumed %zu bytes of memory.\n", masm.memarena_size);
+        printf("[DEBUG]: Memory section has %zu bytes of data and %zu bytes in total.\n", masm.memory_size, masm.memory_capacity);
     }
 
     return  0;
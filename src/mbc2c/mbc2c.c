@@ -0,0 +1,481 @@
+//
+// Ahead-of-time compiler from mvm bytecode to C.
+//
+
+#define MVM_SHARED_IMPLEMENTATION
+#include "../shared.h"
+
+Mvm mvm = {0};
+
+// Addresses that need a C label: jump targets and everything `ret` can return to.
+bool isTarget[MVM_PROGRAM_CAPACITY + 1] = {0};
+// Addresses reachable through the runtime dispatch table (entry point and return addresses).
+bool isDispatched[MVM_PROGRAM_CAPACITY + 1] = {0};
+
+static void usage(FILE* stream)
+{
+    fprintf(stream, "Usage: mbc2c -i <input.mbc> -o <output.c> [options]\n");
+    fprintf(stream, "  -h          Provides a help list.\n");
+    fprintf(stream, "\nCompile the output with: cc -O2 -fno-strict-aliasing -I <mvm/src> <output.c> -o <program> -lm\n");
+    fprintf(stream, "Programs with %%interrupt imports also need the source of their plugin: ... <output.c> <plugin.c> ...\n");
+}
+
+static void findTargets(void)
+{
+    isTarget[0] = true;
+    isDispatched[0] = true;
+    for (InstAddr i = 0; i < mvm.program_size; ++i) {
+        const Inst inst = mvm.program[i];
+        if (InstIsJump(inst.type) && inst.operand.as_u64 < mvm.program_size) {
+            isTarget[inst.operand.as_u64] = true;
+        }
+        if (inst.type == INST_CALL && i + 1 < mvm.program_size) {
+            isTarget[i + 1] = true;
+            isDispatched[i + 1] = true;
+        }
+        // Spawned threads enter mbc_run at their entry point, coroutines are entered through the dispatch table.
+        if ((inst.type == INST_SPAWN || inst.type == INST_COCREATE) && inst.operand.as_u64 < mvm.program_size) {
+            isDispatched[inst.operand.as_u64] = true;
+        }
+        if ((inst.type == INST_CORESUME || inst.type == INST_YIELD) && i + 1 < mvm.program_size) {
+            isTarget[i + 1] = true;
+            isDispatched[i + 1] = true;
+        }
+        // Any pushed value that looks like an address might be used with `ret`.
+        if (inst.type == INST_PUSH && inst.operand.as_u64 < mvm.program_size) {
+            isTarget[inst.operand.as_u64] = true;
+            isDispatched[inst.operand.as_u64] = true;
+        }
+    }
+}
+
+static void emitJump(FILE* out, InstAddr target)
+{
+    if (target < mvm.program_size) {
+        fprintf(out, "goto L%" PRIu64 ";\n", target);
+    } else {
+        fprintf(out, "FAIL(%" PRIu64 ", EXCEPTION_ILLEGAL_INST_ACCESS);\n", target);
+    }
+}
+
+static void emitBinary(FILE* out, InstAddr ip, const char* expr)
+{
+    fprintf(out, "    NEED(%" PRIu64 ", 2); %s; mvm->stack_size -= 1;\n", ip, expr);
+}
+
+static void emitUnary(FILE* out, InstAddr ip, const char* expr)
+{
+    fprintf(out, "    NEED(%" PRIu64 ", 1); %s;\n", ip, expr);
+}
+
+static void emitBranch(FILE* out, InstAddr ip, InstAddr target, const char* field, const char* op)
+{
+    fprintf(out, "    NEED(%" PRIu64 ", 2); mvm->stack_size -= 2;\n", ip);
+    fprintf(out, "    if (mvm->stack[mvm->stack_size].%s %s mvm->stack[mvm->stack_size + 1].%s) ", field, op, field);
+    emitJump(out, target);
+}
+
+static void emitRead(FILE* out, InstAddr ip, const char* type, int width)
+{
+    fprintf(out, "    NEED(%" PRIu64 ", 1);\n", ip);
+    fprintf(out, "    if (TOP(1).as_u64 >= MVM_MEMORY_CAPACITY - %d) FAIL(%" PRIu64 ", EXCEPTION_MEMORY_ACCESS_VIOLATION);\n", width - 1, ip);
+    fprintf(out, "    TOP(1) = word_u64(*(%s*)&mvm->memory[TOP(1).as_u64]);\n", type);
+}
+
+static void emitWrite(FILE* out, InstAddr ip, const char* type, int width)
+{
+    fprintf(out, "    NEED(%" PRIu64 ", 2);\n", ip);
+    fprintf(out, "    if (TOP(2).as_u64 >= MVM_MEMORY_CAPACITY - %d) FAIL(%" PRIu64 ", EXCEPTION_MEMORY_ACCESS_VIOLATION);\n", width - 1, ip);
+    fprintf(out, "    *(%s*)&mvm->memory[TOP(2).as_u64] = (%s)TOP(1).as_u64; mvm->stack_size -= 2;\n", type, type);
+}
+
+// Emits C code with the same semantics as mvm_execInst for the instruction at `ip`.
+static void emitInst(FILE* out, InstAddr ip)
+{
+    const Inst inst = mvm.program[ip];
+    const uint64_t operand = inst.operand.as_u64;
+
+    if (isTarget[ip]) {
+        fprintf(out, "L%" PRIu64 ":\n", ip);
+    }
+    if (InstHasOperand(inst.type)) {
+        fprintf(out, "    // %s %" PRIu64 "\n", InstName(inst.type), operand);
+    } else {
+        fprintf(out, "    // %s\n", InstName(inst.type));
+    }
+
+    switch (inst.type) {
+        case INST_NOP:
+            break;
+        case INST_PUSH:
+            fprintf(out, "    ROOM(%" PRIu64 ", 1); mvm->stack[mvm->stack_size++] = word_u64(0x%" PRIx64 "ULL);\n", ip, operand);
+            break;
+        case INST_DUP:
+            fprintf(out, "    ROOM(%" PRIu64 ", 1); NEED(%" PRIu64 ", %" PRIu64 ");\n", ip, ip, operand + 1);
+            fprintf(out, "    mvm->stack[mvm->stack_size] = TOP(%" PRIu64 "); mvm->stack_size += 1;\n", operand + 1);
+            break;
+        case INST_SWAP:
+            fprintf(out, "    NEED(%" PRIu64 ", %" PRIu64 ");\n", ip, operand + 1);
+            fprintf(out, "    { Word tmp = TOP(1); TOP(1) = TOP(%" PRIu64 "); TOP(%" PRIu64 ") = tmp; }\n", operand + 1, operand + 1);
+            break;
+        case INST_DROP:
+            fprintf(out, "    NEED(%" PRIu64 ", 1); mvm->stack_size -= 1;\n", ip);
+            break;
+        case INST_PLUSI:  emitBinary(out, ip, "TOP(2).as_u64 += TOP(1).as_u64"); break;
+        case INST_MINUSI: emitBinary(out, ip, "TOP(2).as_u64 -= TOP(1).as_u64"); break;
+        case INST_MULTI:  emitBinary(out, ip, "TOP(2).as_u64 *= TOP(1).as_u64"); break;
+        case INST_DIVI:
+        case INST_MODI:
+            fprintf(out, "    NEED(%" PRIu64 ", 2);\n", ip);
+            fprintf(out, "    if (TOP(1).as_u64 == 0) FAIL(%" PRIu64 ", EXCEPTION_DIV_BY_ZERO);\n", ip);
+            fprintf(out, "    TOP(2).as_u64 %s= TOP(1).as_u64; mvm->stack_size -= 1;\n", inst.type == INST_DIVI ? "/" : "%");
+            break;
+        case INST_PLUSF:  emitBinary(out, ip, "TOP(2).as_f64 += TOP(1).as_f64"); break;
+        case INST_MINUSF: emitBinary(out, ip, "TOP(2).as_f64 -= TOP(1).as_f64"); break;
+        case INST_MULTF:  emitBinary(out, ip, "TOP(2).as_f64 *= TOP(1).as_f64"); break;
+        case INST_DIVF:   emitBinary(out, ip, "TOP(2).as_f64 /= TOP(1).as_f64"); break;
+        case INST_ANDB:   emitBinary(out, ip, "TOP(2).as_u64 &= TOP(1).as_u64"); break;
+        case INST_ORB:    emitBinary(out, ip, "TOP(2).as_u64 |= TOP(1).as_u64"); break;
+        case INST_XOR:    emitBinary(out, ip, "TOP(2).as_u64 ^= TOP(1).as_u64"); break;
+        case INST_NOTB:
+            // Mirrors the interpreter, which drops the inverted value.
+            fprintf(out, "    NEED(%" PRIu64 ", 1); mvm->stack_size -= 1;\n", ip);
+            break;
+        case INST_SHR:    emitBinary(out, ip, "TOP(2).as_u64 >>= TOP(1).as_u64"); break;
+        case INST_SHL:    emitBinary(out, ip, "TOP(2).as_u64 <<= TOP(1).as_u64"); break;
+        case INST_JMP:
+            fprintf(out, "    ");
+            emitJump(out, operand);
+            break;
+        case INST_JMPIF:
+            fprintf(out, "    NEED(%" PRIu64 ", 1); mvm->stack_size -= 1;\n", ip);
+            fprintf(out, "    if (mvm->stack[mvm->stack_size].as_u64) ");
+            emitJump(out, operand);
+            break;
+        case INST_CALL:
+            if (mvm.flags & MVM_FLAG_RSTACK) {
+                fprintf(out, "    if (mvm->rstack_size >= MVM_RSTACK_CAPACITY) FAIL(%" PRIu64 ", EXCEPTION_RSTACK_OVERFLOW);\n", ip);
+                fprintf(out, "    mvm->rstack[mvm->rstack_size++] = %" PRIu64 ";\n", ip + 1);
+            } else {
+                fprintf(out, "    ROOM(%" PRIu64 ", 1); mvm->stack[mvm->stack_size++] = word_u64(%" PRIu64 ");\n", ip, ip + 1);
+            }
+            fprintf(out, "    ");
+            emitJump(out, operand);
+            break;
+        case INST_INT:
+            if (operand >= MVM_IMPORT_VECTORS && operand < MVM_IMPORT_VECTORS + mvm.imports_size) {
+                // main links the imports right after the standard interrupts.
+                fprintf(out, "    { ExceptionState err = mvm->interrupts[MVM_STD_INTERRUPTS + %" PRIu64 "](mvm); if (err != EXCEPTION_SATE_OK) FAIL(%" PRIu64 ", err); }\n",
+                        operand - MVM_IMPORT_VECTORS, ip);
+                fprintf(out, "    if (mvm->stack_size > MVM_STACK_CAPACITY) FAIL(%" PRIu64 ", EXCEPTION_STACK_OVERFLOW);\n", ip);
+                break;
+            }
+            fprintf(out, "    if (%" PRIu64 " >= mvm->interrupts_size) FAIL(%" PRIu64 ", EXCEPTION_ILLEGAL_OPERAND);\n", operand, ip);
+            fprintf(out, "    { ExceptionState err = mvm->interrupts[%" PRIu64 "](mvm); if (err != EXCEPTION_SATE_OK) FAIL(%" PRIu64 ", err); }\n", operand, ip);
+            fprintf(out, "    if (mvm->stack_size > MVM_STACK_CAPACITY) FAIL(%" PRIu64 ", EXCEPTION_STACK_OVERFLOW);\n", ip);
+            break;
+        case INST_RET:
+            if (mvm.flags & MVM_FLAG_RSTACK) {
+                fprintf(out, "    if (mvm->rstack_size < 1) FAIL(%" PRIu64 ", EXCEPTION_RSTACK_UNDERFLOW);\n", ip);
+                fprintf(out, "    target = mvm->rstack[--mvm->rstack_size]; goto dispatch;\n");
+            } else {
+                fprintf(out, "    NEED(%" PRIu64 ", 1); target = mvm->stack[--mvm->stack_size].as_u64; goto dispatch;\n", ip);
+            }
+            break;
+        case INST_EQ:  emitBinary(out, ip, "TOP(2) = word_u64(TOP(1).as_u64 == TOP(2).as_u64)"); break;
+        case INST_NOT:
+            fprintf(out, "    NEED(%" PRIu64 ", 1); TOP(1) = word_u64(!TOP(1).as_u64);\n", ip);
+            break;
+        case INST_GEF: emitBinary(out, ip, "TOP(2) = word_f64(TOP(1).as_f64 >= TOP(2).as_f64)"); break;
+        case INST_GEI: emitBinary(out, ip, "TOP(2) = word_u64(TOP(1).as_u64 >= TOP(2).as_u64)"); break;
+        case INST_LEF: emitBinary(out, ip, "TOP(2) = word_f64(TOP(1).as_f64 <= TOP(2).as_f64)"); break;
+        case INST_LEI: emitBinary(out, ip, "TOP(2) = word_u64(TOP(1).as_u64 <= TOP(2).as_u64)"); break;
+        case INST_HALT:
+            fprintf(out, "    mvm->ip = %" PRIu64 "; mvm->halt = true; return EXCEPTION_SATE_OK;\n", ip);
+            break;
+        case INST_READ8:   emitRead(out, ip, "uint8_t", 1); break;
+        case INST_READ16:  emitRead(out, ip, "uint16_t", 2); break;
+        case INST_READ32:  emitRead(out, ip, "uint32_t", 4); break;
+        case INST_READ64:  emitRead(out, ip, "uint64_t", 8); break;
+        case INST_WRITE8:  emitWrite(out, ip, "uint8_t", 1); break;
+        case INST_WRITE16: emitWrite(out, ip, "uint16_t", 2); break;
+        case INST_WRITE32: emitWrite(out, ip, "uint32_t", 4); break;
+        case INST_WRITE64: emitWrite(out, ip, "uint64_t", 8); break;
+        case INST_BREAK:
+            fprintf(out, "    FAIL(%" PRIu64 ", EXCEPTION_BREAKPOINT);\n", ip);
+            break;
+        case INST_SPAWN:
+            fprintf(out, "    { ExceptionState err = mvm_spawn(mvm, %" PRIu64 "); if (err != EXCEPTION_SATE_OK) FAIL(%" PRIu64 ", err); }\n", operand, ip);
+            break;
+        case INST_JOIN:
+            fprintf(out, "    { ExceptionState err = mvm_join(mvm); if (err != EXCEPTION_SATE_OK) FAIL(%" PRIu64 ", err); }\n", ip);
+            break;
+        case INST_ATOMADD:
+        case INST_ATOMXCHG:
+            fprintf(out, "    NEED(%" PRIu64 ", 2);\n", ip);
+            fprintf(out, "    if (TOP(2).as_u64 >= MVM_MEMORY_CAPACITY - 7 || TOP(2).as_u64 %% 8 != 0) FAIL(%" PRIu64 ", EXCEPTION_MEMORY_ACCESS_VIOLATION);\n", ip);
+            fprintf(out, "    TOP(2) = word_u64(%s((_Atomic uint64_t*)&mvm->memory[TOP(2).as_u64], TOP(1).as_u64)); mvm->stack_size -= 1;\n",
+                    inst.type == INST_ATOMADD ? "atomic_fetch_add" : "atomic_exchange");
+            break;
+        case INST_ATOMCAS:
+            fprintf(out, "    NEED(%" PRIu64 ", 3);\n", ip);
+            fprintf(out, "    if (TOP(3).as_u64 >= MVM_MEMORY_CAPACITY - 7 || TOP(3).as_u64 %% 8 != 0) FAIL(%" PRIu64 ", EXCEPTION_MEMORY_ACCESS_VIOLATION);\n", ip);
+            fprintf(out, "    { uint64_t expected = TOP(2).as_u64; atomic_compare_exchange_strong((_Atomic uint64_t*)&mvm->memory[TOP(3).as_u64], &expected, TOP(1).as_u64);\n");
+            fprintf(out, "      TOP(3) = word_u64(expected); mvm->stack_size -= 2; }\n");
+            break;
+        case INST_FENCE:
+            fprintf(out, "    atomic_thread_fence(memory_order_seq_cst);\n");
+            break;
+        case INST_JEQ:  emitBranch(out, ip, operand, "as_u64", "=="); break;
+        case INST_JNE:  emitBranch(out, ip, operand, "as_u64", "!="); break;
+        case INST_JLTI: emitBranch(out, ip, operand, "as_u64", "<"); break;
+        case INST_JLEI: emitBranch(out, ip, operand, "as_u64", "<="); break;
+        case INST_JGTI: emitBranch(out, ip, operand, "as_u64", ">"); break;
+        case INST_JGEI: emitBranch(out, ip, operand, "as_u64", ">="); break;
+        case INST_JLTF: emitBranch(out, ip, operand, "as_f64", "<"); break;
+        case INST_JLEF: emitBranch(out, ip, operand, "as_f64", "<="); break;
+        case INST_JGTF: emitBranch(out, ip, operand, "as_f64", ">"); break;
+        case INST_JGEF: emitBranch(out, ip, operand, "as_f64", ">="); break;
+        case INST_JZ:
+            fprintf(out, "    NEED(%" PRIu64 ", 1); mvm->stack_size -= 1;\n", ip);
+            fprintf(out, "    if (mvm->stack[mvm->stack_size].as_u64 == 0) ");
+            emitJump(out, operand);
+            break;
+        case INST_ENTER:
+        case INST_LEAVE:
+            fprintf(out, "    { ExceptionState err = %s(mvm, 0x%" PRIx64 "ULL); if (err != EXCEPTION_SATE_OK) FAIL(%" PRIu64 ", err); }\n",
+                    inst.type == INST_ENTER ? "mvm_enterFrame" : "mvm_leaveFrame", operand, ip);
+            break;
+        case INST_LOADL:
+            fprintf(out, "    { uint64_t slot = mvm->fp + 0x%" PRIx64 "ULL; if (slot >= mvm->stack_size) FAIL(%" PRIu64 ", EXCEPTION_STACK_UNDERFLOW);\n", operand, ip);
+            fprintf(out, "      ROOM(%" PRIu64 ", 1); mvm->stack[mvm->stack_size] = mvm->stack[slot]; mvm->stack_size += 1; }\n", ip);
+            break;
+        case INST_STOREL:
+            fprintf(out, "    { uint64_t slot = mvm->fp + 0x%" PRIx64 "ULL; NEED(%" PRIu64 ", 1); if (slot >= mvm->stack_size - 1) FAIL(%" PRIu64 ", EXCEPTION_STACK_UNDERFLOW);\n", operand, ip, ip);
+            fprintf(out, "      mvm->stack[slot] = TOP(1); mvm->stack_size -= 1; }\n");
+            break;
+        case INST_SQRTF:  emitUnary(out, ip, "TOP(1).as_f64 = sqrt(TOP(1).as_f64)"); break;
+        case INST_ABSF:   emitUnary(out, ip, "TOP(1).as_f64 = fabs(TOP(1).as_f64)"); break;
+        case INST_FLOORF: emitUnary(out, ip, "TOP(1).as_f64 = floor(TOP(1).as_f64)"); break;
+        case INST_CEILF:  emitUnary(out, ip, "TOP(1).as_f64 = ceil(TOP(1).as_f64)"); break;
+        case INST_SINF:   emitUnary(out, ip, "TOP(1).as_f64 = sin(TOP(1).as_f64)"); break;
+        case INST_COSF:   emitUnary(out, ip, "TOP(1).as_f64 = cos(TOP(1).as_f64)"); break;
+        case INST_EXPF:   emitUnary(out, ip, "TOP(1).as_f64 = exp(TOP(1).as_f64)"); break;
+        case INST_LOGF:   emitUnary(out, ip, "TOP(1).as_f64 = log(TOP(1).as_f64)"); break;
+        case INST_MINF:   emitBinary(out, ip, "TOP(2).as_f64 = fmin(TOP(2).as_f64, TOP(1).as_f64)"); break;
+        case INST_MAXF:   emitBinary(out, ip, "TOP(2).as_f64 = fmax(TOP(2).as_f64, TOP(1).as_f64)"); break;
+        case INST_FMAF:
+            fprintf(out, "    NEED(%" PRIu64 ", 3); TOP(3).as_f64 = fma(TOP(3).as_f64, TOP(2).as_f64, TOP(1).as_f64); mvm->stack_size -= 2;\n", ip);
+            break;
+        case INST_I2F:    emitUnary(out, ip, "TOP(1) = word_f64((double)TOP(1).as_i64)"); break;
+        case INST_F2I:    emitUnary(out, ip, "TOP(1) = word_i64(mvm_f64ToI64(TOP(1).as_f64))"); break;
+        case INST_DIVS:
+        case INST_MODS:
+            fprintf(out, "    NEED(%" PRIu64 ", 2);\n", ip);
+            fprintf(out, "    if (TOP(1).as_u64 == 0) FAIL(%" PRIu64 ", EXCEPTION_DIV_BY_ZERO);\n", ip);
+            fprintf(out, "    TOP(2) = %s(TOP(2), TOP(1)); mvm->stack_size -= 1;\n", inst.type == INST_DIVS ? "mvm_divS" : "mvm_modS");
+            break;
+        case INST_GES:    emitBinary(out, ip, "TOP(2) = word_u64(TOP(1).as_i64 >= TOP(2).as_i64)"); break;
+        case INST_LES:    emitBinary(out, ip, "TOP(2) = word_u64(TOP(1).as_i64 <= TOP(2).as_i64)"); break;
+        case INST_SAR:    emitBinary(out, ip, "TOP(2) = mvm_sar(TOP(2), TOP(1))"); break;
+        case INST_ABSI:   emitUnary(out, ip, "if (TOP(1).as_i64 < 0) TOP(1).as_u64 = 0 - TOP(1).as_u64"); break;
+        case INST_MINS:   emitBinary(out, ip, "if (TOP(1).as_i64 < TOP(2).as_i64) TOP(2) = TOP(1)"); break;
+        case INST_MAXS:   emitBinary(out, ip, "if (TOP(1).as_i64 > TOP(2).as_i64) TOP(2) = TOP(1)"); break;
+        case INST_COCREATE:
+            fprintf(out, "    { ExceptionState err = mvm_coCreate(mvm, %" PRIu64 "); if (err != EXCEPTION_SATE_OK) FAIL(%" PRIu64 ", err); }\n", operand, ip);
+            break;
+        case INST_CORESUME:
+        case INST_YIELD:
+            // The switch saves the ip of the instruction, the C code only keeps it on failures.
+            fprintf(out, "    mvm->ip = %" PRIu64 ";\n", ip);
+            fprintf(out, "    { ExceptionState err = %s(mvm); if (err != EXCEPTION_SATE_OK) FAIL(%" PRIu64 ", err); }\n",
+                    inst.type == INST_CORESUME ? "mvm_coResume" : "mvm_coYield", ip);
+            fprintf(out, "    target = mvm->ip; goto dispatch;\n");
+            break;
+        case NUMBER_OF_INSTS:
+        default:
+            fprintf(out, "    FAIL(%" PRIu64 ", EXCEPTION_ILLEGAL_INST);\n", ip);
+            break;
+    }
+}
+
+static void emitProgram(FILE* out, const char* inputFilePath)
+{
+    fprintf(out, "// Generated by mbc2c from '%s'.\n", inputFilePath);
+    fprintf(out, "#define MVM_SHARED_IMPLEMENTATION\n");
+    fprintf(out, "#include \"shared.h\"\n\n");
+    fprintf(out, "#define TOP(n) mvm->stack[mvm->stack_size - (n)]\n");
+    fprintf(out, "#define FAIL(addr, exception) do { mvm->ip = (addr); return (exception); } while (0)\n");
+    fprintf(out, "#define NEED(addr, n) if (mvm->stack_size < (n)) FAIL(addr, EXCEPTION_STACK_UNDERFLOW)\n");
+    fprintf(out, "#define ROOM(addr, n) if (mvm->stack_size + (n) > MVM_STACK_CAPACITY) FAIL(addr, EXCEPTION_STACK_OVERFLOW)\n\n");
+
+    // Only the initialized part of the memory is embedded.
+    size_t memorySize = MVM_MEMORY_CAPACITY;
+    while (memorySize > 0 && mvm.memory[memorySize - 1] == 0) {
+        memorySize -= 1;
+    }
+    fprintf(out, "static const uint8_t memoryImage[%zu] = {", memorySize > 0 ? memorySize : 1);
+    for (size_t i = 0; i < memorySize; ++i) {
+        fprintf(out, "%s0x%02X,", i % 16 == 0 ? "\n    " : " ", mvm.memory[i]);
+    }
+    fprintf(out, "%s};\n\n", memorySize > 0 ? "\n" : "0");
+
+    fprintf(out, "static ExceptionState mbc_run(Mvm* mvm, InstAddr entry)\n{\n");
+    bool hasRet = false;
+    bool hasCoroutines = false;
+    for (InstAddr i = 0; i < mvm.program_size; ++i) {
+        const InstType type = mvm.program[i].type;
+        if (type == INST_RET || type == INST_CORESUME || type == INST_YIELD) {
+            hasRet = true;
+        }
+        if (type == INST_COCREATE) {
+            hasCoroutines = true;
+        }
+    }
+    fprintf(out, "    InstAddr target = entry;\n");
+    if (hasRet) {
+        fprintf(out, "dispatch:\n");
+    }
+    fprintf(out, "    switch (target) {\n");
+    for (InstAddr i = 0; i < mvm.program_size; ++i) {
+        if (isDispatched[i]) {
+            fprintf(out, "        case %" PRIu64 ": goto L%" PRIu64 ";\n", i, i);
+        }
+    }
+    if (hasCoroutines && hasRet) {
+        fprintf(out, "        case MVM_COROUTINE_RETURN: {\n");
+        fprintf(out, "            ExceptionState err = mvm_coReturn(mvm); if (err != EXCEPTION_SATE_OK) return err;\n");
+        fprintf(out, "            target = mvm->ip; goto dispatch;\n");
+        fprintf(out, "        }\n");
+    }
+    fprintf(out, "        default: FAIL(target, EXCEPTION_ILLEGAL_INST_ACCESS);\n");
+    fprintf(out, "    }\n\n");
+
+    for (InstAddr i = 0; i < mvm.program_size; ++i) {
+        emitInst(out, i);
+    }
+    fprintf(out, "    FAIL(%" PRIu64 ", EXCEPTION_ILLEGAL_INST_ACCESS);\n", mvm.program_size);
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "static ExceptionState mbc_threadMain(Mvm* mvm)\n{\n");
+    fprintf(out, "    return mbc_run(mvm, mvm->ip);\n");
+    fprintf(out, "}\n\n");
+
+    // Imports are provided by a plugin that is linked into the program instead of loaded with dlopen.
+    if (mvm.imports_size > 0) {
+        fprintf(out, "static MvmNative natives[MVM_NATIVES_CAPACITY];\n");
+        fprintf(out, "static size_t natives_size = 0;\n\n");
+        fprintf(out, "static bool mbc_claim(void* registry, const char* name, MvmInterrupt interrupt)\n{\n");
+        fprintf(out, "    (void)registry;\n");
+        fprintf(out, "    if (natives_size >= MVM_NATIVES_CAPACITY) return false;\n");
+        fprintf(out, "    natives[natives_size++] = (MvmNative) {.name = name, .interrupt = interrupt};\n");
+        fprintf(out, "    return true;\n");
+        fprintf(out, "}\n\n");
+    }
+
+    fprintf(out, "static Mvm mvm = {0};\n\n");
+    fprintf(out, "int main(int argc, char** argv)\n{\n");
+    fprintf(out, "    // Like 'mvm -fs <dir>', the only flag of a compiled program.\n");
+    fprintf(out, "    if (argc == 3 && strcmp(argv[1], \"-fs\") == 0) {\n");
+    fprintf(out, "        if (!mvm_setFileRoot(argv[2])) {\n");
+    fprintf(out, "            fprintf(stderr, \"ERROR: Could not open the file root '%%s'!\\n\", argv[2]);\n");
+    fprintf(out, "            return 1;\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "    } else if (argc != 1) {\n");
+    fprintf(out, "        fprintf(stderr, \"Usage: %%s [-fs <dir>]\\n\", argv[0]);\n");
+    fprintf(out, "        return 1;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    mvm_threadMain = mbc_threadMain;\n");
+    fprintf(out, "    mvm_initMemory(&mvm);\n");
+    fprintf(out, "    mvm_pushStdInterrupts(&mvm);\n");
+    if (mvm.imports_size > 0) {
+        fprintf(out, "    if (!mvm_plugin(NULL, mbc_claim)) {\n");
+        fprintf(out, "        fprintf(stderr, \"ERROR: Failed to register the plugin!\\n\");\n");
+        fprintf(out, "        return 1;\n");
+        fprintf(out, "    }\n");
+        for (size_t i = 0; i < mvm.imports_size; ++i) {
+            fprintf(out, "    mvm_pushImport(&mvm, cstr_as_sv(\"%s\"));\n", mvm.imports[i]);
+        }
+        fprintf(out, "    mvm_linkImports(&mvm, natives, natives_size);\n");
+    }
+    fprintf(out, "    memcpy(mvm.memory, memoryImage, %zu);\n", memorySize);
+    fprintf(out, "    mvm.flags = %u;\n", mvm.flags);
+    fprintf(out, "    ExceptionState state = mbc_run(&mvm, 0);\n");
+    fprintf(out, "    if (state != EXCEPTION_SATE_OK) {\n");
+    fprintf(out, "        fprintf(stderr, \"ERROR: Failed to execute program! : %%s\\n\", exception_as_cstr(state));\n");
+    fprintf(out, "        return 1;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char** argv)
+{
+    shift(&argc, &argv); // Skip program name.
+    const char* inputFilePath = NULL;
+    const char* outputFilePath = NULL;
+    int error = 0;
+    const char* errorFlag = NULL;
+
+    while (argc > 0) {
+        const char* flag = shift(&argc, &argv);
+        if (strcmp(flag, "-i") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            inputFilePath = shift(&argc, &argv);
+        } else if (strcmp(flag, "-o") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            outputFilePath = shift(&argc, &argv);
+        } else if (strcmp(flag, "-h") == 0) {
+            usage(stdout);
+            exit(0);
+        } else {
+            error = 1;
+            errorFlag = flag;
+        }
+    }
+
+    if (inputFilePath == NULL) {
+        fprintf(stderr, "ERROR: Expected input file!\n");
+        usage(stderr);
+        exit(1);
+    }
+
+    if (outputFilePath == NULL) {
+        fprintf(stderr, "ERROR: Expected output file!\n");
+        usage(stderr);
+        exit(1);
+    }
+
+    if (error) {
+        fprintf(stderr, "ERROR: Unknown flag '%s'!\n", errorFlag);
+        usage(stderr);
+        exit(1);
+    }
+
+    mvm_loadProgramFromFile(&mvm, inputFilePath);
+    findTargets();
+
+    FILE* out = fopen(outputFilePath, "w");
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s'! : %s\n", outputFilePath, strerror(errno));
+        exit(1);
+    }
+
+    emitProgram(out, inputFilePath);
+
+    if (ferror(out)) {
+        fprintf(stderr, "ERROR: Could not write to file '%s'! : %s\n", outputFilePath, strerror(errno));
+        exit(1);
+    }
+    fclose(out);
+
+    return 0;
+}
@@ -0,0 +1,306 @@
+//
+// Offline viewer for execution traces recorded with 'mvm -t'.
+//
+
+#define MVM_SHARED_IMPLEMENTATION
+#include "../shared.h"
+
+Mvm mvm = {0};
+Word payload[MVM_STACK_CAPACITY + 1];
+
+static void usage(FILE* stream)
+{
+    fprintf(stream, "Usage: mvm-replay -i <input.trace> [options]\n");
+    fprintf(stream, "  -h                Provides a help list.\n");
+    fprintf(stream, "  -s <step>         Prints the reconstructed state after the given step.\n");
+    fprintf(stream, "  -m <addr> <size>  Also dumps the given memory range with '-s'.\n");
+    fprintf(stream, "  -a <addr>         Lists only the steps executing the instruction at <addr>.\n");
+    fprintf(stream, "  -op <name>        Lists only the steps executing the instruction <name>.\n");
+    fprintf(stream, "  -w <addr>         Lists only the steps writing to the memory address <addr>.\n");
+}
+
+static uint64_t writeWidth(InstType type)
+{
+    if (type == INST_WRITE8)  return 1;
+    if (type == INST_WRITE16) return 2;
+    if (type == INST_WRITE32) return 4;
+    if (type == INST_WRITE64) return 8;
+    return 0;
+}
+
+static void readOrDie(void* data, size_t size, FILE* f, const char* filePath)
+{
+    if (size > 0 && fread(data, size, 1, f) != 1) {
+        fprintf(stderr, "ERROR: Could not read trace from file '%s'! : Unexpected end of file\n", filePath);
+        exit(1);
+    }
+}
+
+static void loadTraceHeader(FILE* f, const char* filePath)
+{
+    MvmTrace_Header header = {0};
+    readOrDie(&header, sizeof(header), f, filePath);
+
+    if (header.magic != MVM_TRACE_MAGIC) {
+        fprintf(stderr, "ERROR: '%s' is not a valid mvm trace file! : "
+                        "Unexpected magic '%04X' : "
+                        "Expected '%04X'\n", filePath, header.magic, MVM_TRACE_MAGIC);
+        exit(1);
+    }
+
+    if (header.version != MVM_TRACE_VERSION) {
+        fprintf(stderr, "ERROR: Unsupported trace version %d in file '%s'! : "
+                        "Expected version %d\n", header.version, filePath, MVM_TRACE_VERSION);
+        exit(1);
+    }
+
+    if (header.program_size > MVM_PROGRAM_CAPACITY || header.memory_size > MVM_MEMORY_CAPACITY) {
+        fprintf(stderr, "ERROR: Corrupted trace file '%s'! : The program or memory section is too large.\n", filePath);
+        exit(1);
+    }
+
+    mvm_initMemory(&mvm);
+    readOrDie(mvm.program, sizeof(mvm.program[0]) * (size_t)header.program_size, f, filePath);
+    readOrDie(mvm.memory, (size_t)header.memory_size, f, filePath);
+    mvm.program_size = header.program_size;
+    mvm.memory_size = header.memory_size;
+    mvm.flags = header.flags;
+}
+
+// Applies one record to the reconstructed state. Interrupts, spawns and joins are not
+// executed again, their effect on the stack is taken from the trace. The failed instruction
+// of a program is not executed either, the state is the one it failed on.
+static void replayRecord(const MvmTrace_Record* record, uint64_t step)
+{
+    if (record->state != EXCEPTION_SATE_OK) {
+        return;
+    }
+    if (record->type == INST_SPAWN) {
+        fprintf(stderr, "ERROR: Can't reconstruct the state after step %" PRIu64 "! : "
+                        "Spawned threads write to the memory without being traced.\n", step);
+        exit(1);
+    }
+    if (mvm.ip != record->ip) {
+        fprintf(stderr, "ERROR: Trace diverges from the program at step %" PRIu64 "! : "
+                        "Expected ip %" PRIu64 " but the trace has ip %u.\n", step, mvm.ip, record->ip);
+        exit(1);
+    }
+
+    if (record->type == INST_INT || record->type == INST_SPAWN || record->type == INST_JOIN) {
+        int64_t stackSize = (int64_t)mvm.stack_size + record->stack_delta;
+        if (stackSize < 0 || stackSize > MVM_STACK_CAPACITY || (uint64_t)stackSize < record->words) {
+            fprintf(stderr, "ERROR: Corrupted trace record at step %" PRIu64 "!\n", step);
+            exit(1);
+        }
+        mvm.stack_size = (uint64_t)stackSize;
+        memcpy(&mvm.stack[mvm.stack_size - record->words], payload, sizeof(Word) * record->words);
+        if (mvm.stack_size > 0) {
+            mvm.stack[mvm.stack_size - 1].as_u64 = record->top;
+        }
+        mvm.ip += 1;
+        return;
+    }
+
+    ExceptionState err = mvm_execInst(&mvm);
+    if (err != EXCEPTION_SATE_OK) {
+        fprintf(stderr, "ERROR: Failed to replay step %" PRIu64 "! : %s\n", step, exception_as_cstr(err));
+        exit(1);
+    }
+}
+
+static void printRecord(const MvmTrace_Record* record, uint64_t step)
+{
+    const InstType type = (InstType)record->type;
+    printf("%10" PRIu64 " | %5u | ", step, record->ip);
+    if (InstHasOperand(type) && record->ip < mvm.program_size) {
+        printf("%-8s %-20" PRIu64, InstName(type), mvm.program[record->ip].operand.as_u64);
+    } else {
+        printf("%-29s", InstName(type));
+    }
+    printf(" | stack %+4d | top %" PRIu64, record->stack_delta, record->top);
+    if (writeWidth(type) > 0) {
+        printf(" | mem[%" PRIu64 "] = %" PRIu64, payload[0].as_u64, payload[1].as_u64);
+    }
+    if (record->state != EXCEPTION_SATE_OK) {
+        printf(" | %s", exception_as_cstr((ExceptionState)record->state));
+    }
+    printf("\n");
+}
+
+// Memory written by an interrupt is listed below the interrupt.
+static void printMemoryRecord(const MvmTrace_Record* record)
+{
+    printf("%10s | %5u | mem[%" PRIu64 "..%" PRIu64 "] written by the interrupt\n",
+           "", record->ip, payload[0].as_u64, payload[0].as_u64 + record->top);
+}
+
+static void printState(uint64_t step, ExceptionState state, MemoryAddr memAddr, uint64_t memSize)
+{
+    printf("STEP %" PRIu64 ": ip = %" PRIu64 "\n", step, mvm.ip);
+    if (state != EXCEPTION_SATE_OK) {
+        printf("FAILED: %s\n", exception_as_cstr(state));
+    }
+    mvm_dumpStack(stdout, &mvm);
+    if (mvm.flags & MVM_FLAG_RSTACK) {
+        mvm_dumpCallStack(stdout, &mvm);
+    }
+    if (memSize > 0) {
+        mvm_dumpMemory(stdout, &mvm, memAddr, memSize);
+    }
+}
+
+static uint64_t parseNumber(const char* flag, const char* value)
+{
+    char* endptr = NULL;
+    uint64_t result = strtoull(value, &endptr, 0);
+    if (*value == '\0' || *endptr != '\0') {
+        fprintf(stderr, "ERROR: '%s' is not a valid number for flag '%s'!\n", value, flag);
+        usage(stderr);
+        exit(1);
+    }
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    shift(&argc, &argv); // Skip program name.
+    const char* inputFilePath = NULL;
+    bool hasState = false;
+    uint64_t stateStep = 0;
+    MemoryAddr memAddr = 0;
+    uint64_t memSize = 0;
+    bool hasAddr = false;
+    InstAddr addrFilter = 0;
+    bool hasType = false;
+    InstType typeFilter = INST_NOP;
+    bool hasWrite = false;
+    MemoryAddr writeFilter = 0;
+    int error = 0;
+    const char* errorFlag = NULL;
+
+    while (argc > 0) {
+        const char* flag = shift(&argc, &argv);
+        int expected = strcmp(flag, "-m") == 0 ? 2 : 1;
+        if (strcmp(flag, "-h") == 0) {
+            usage(stdout);
+            exit(0);
+        } else if (strcmp(flag, "-i") != 0 && strcmp(flag, "-s") != 0 && strcmp(flag, "-m") != 0
+                   && strcmp(flag, "-a") != 0 && strcmp(flag, "-op") != 0 && strcmp(flag, "-w") != 0) {
+            error = 1;
+            errorFlag = flag;
+            continue;
+        }
+
+        if (argc < expected) {
+            fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+            usage(stderr);
+            exit(1);
+        }
+
+        if (strcmp(flag, "-i") == 0) {
+            inputFilePath = shift(&argc, &argv);
+        } else if (strcmp(flag, "-s") == 0) {
+            hasState = true;
+            stateStep = parseNumber(flag, shift(&argc, &argv));
+        } else if (strcmp(flag, "-m") == 0) {
+            memAddr = parseNumber(flag, shift(&argc, &argv));
+            memSize = parseNumber(flag, shift(&argc, &argv));
+        } else if (strcmp(flag, "-a") == 0) {
+            hasAddr = true;
+            addrFilter = parseNumber(flag, shift(&argc, &argv));
+        } else if (strcmp(flag, "-w") == 0) {
+            hasWrite = true;
+            writeFilter = parseNumber(flag, shift(&argc, &argv));
+        } else {
+            const char* name = shift(&argc, &argv);
+            if (!GetInstName(cstr_as_sv(name), &typeFilter)) {
+                fprintf(stderr, "ERROR: Unknown instruction '%s'!\n", name);
+                exit(1);
+            }
+            hasType = true;
+        }
+    }
+
+    if (inputFilePath == NULL) {
+        fprintf(stderr, "ERROR: Expected input file!\n");
+        usage(stderr);
+        exit(1);
+    }
+
+    if (error) {
+        fprintf(stderr, "ERROR: Unknown flag '%s'!\n", errorFlag);
+        usage(stderr);
+        exit(1);
+    }
+
+    FILE* f = fopen(inputFilePath, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s'! : %s\n", inputFilePath, strerror(errno));
+        exit(1);
+    }
+
+    loadTraceHeader(f, inputFilePath);
+
+    if (hasState && stateStep == 0) {
+        printState(0, EXCEPTION_SATE_OK, memAddr, memSize);
+        fclose(f);
+        return 0;
+    }
+
+    MvmTrace_Record record = {0};
+    uint64_t step = 0;
+    ExceptionState state = EXCEPTION_SATE_OK;
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+        const bool memory = record.type == MVM_TRACE_MEMORY;
+        if (hasState && !memory && step == stateStep) {
+            break; // The memory records of the step have been applied as well.
+        }
+        step += memory ? 0 : 1;
+        if ((record.type >= NUMBER_OF_INSTS && !memory) || record.words > MVM_STACK_CAPACITY) {
+            fprintf(stderr, "ERROR: Corrupted trace record at step %" PRIu64 "!\n", step);
+            exit(1);
+        }
+        readOrDie(payload, sizeof(Word) * record.words, f, inputFilePath);
+
+        if (memory) {
+            if (record.words == 0 || record.top > sizeof(Word) * (record.words - 1u)
+                || payload[0].as_u64 > MVM_MEMORY_CAPACITY || record.top > MVM_MEMORY_CAPACITY - payload[0].as_u64) {
+                fprintf(stderr, "ERROR: Corrupted trace record at step %" PRIu64 "!\n", step);
+                exit(1);
+            }
+            if (hasState) {
+                memcpy(&mvm.memory[payload[0].as_u64], &payload[1], (size_t)record.top);
+            } else if (!hasType && (!hasAddr || record.ip == addrFilter)
+                       && (!hasWrite || (writeFilter >= payload[0].as_u64 && writeFilter < payload[0].as_u64 + record.top))) {
+                printMemoryRecord(&record);
+            }
+            continue;
+        }
+
+        if (hasState) {
+            replayRecord(&record, step);
+            state = (ExceptionState)record.state;
+            continue;
+        }
+
+        const InstType type = (InstType)record.type;
+        const uint64_t width = writeWidth(type);
+        if ((hasAddr && record.ip != addrFilter)
+            || (hasType && type != typeFilter)
+            || (hasWrite && (width == 0 || writeFilter < payload[0].as_u64 || writeFilter >= payload[0].as_u64 + width))) {
+            continue;
+        }
+        printRecord(&record, step);
+    }
+
+    if (hasState) {
+        if (step < stateStep) {
+            fprintf(stderr, "ERROR: The trace only contains %" PRIu64 " steps!\n", step);
+            exit(1);
+        }
+        printState(step, state, memAddr, memSize);
+    }
+
+    fclose(f);
+    return 0;
+}
@@ -2,28 +2,1204 @@
 // Created by iinsert on 29.12.2021.
 //
 
+#define _XOPEN_SOURCE 700 // sigaction, sysconf, mmap
+#define _DEFAULT_SOURCE // MAP_ANON, MAP_NORESERVE
 #define MVM_SHARED_IMPLEMENTATION
 #include "../shared.h"
+#include <sys/stat.h>
+#include <threads.h>
+#if defined(_WIN32)
+#   include <direct.h>
+#   include <process.h>
+#   define mkdir(path, mode) _mkdir(path)
+#   define getpid _getpid
+#else
+#   include <unistd.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#   include <setjmp.h>
+#   include <signal.h>
+#   include <sys/mman.h>
+#   include <fcntl.h>
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#   include <dlfcn.h>
+#   define MVM_POSIX
+#endif
+#if defined(__linux__)
+#   include <linux/perf_event.h>
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#   define MVM_PERF
+#endif
+#if defined(MVM_POSIX) && !defined(MAP_NORESERVE)
+#   define MAP_NORESERVE 0
+#endif
+
+#define MVM_CACHE_PATH_CAPACITY 4096
+#define MVM_BREAKPOINTS_CAPACITY 64
+#define MVM_WATCHPOINTS_CAPACITY 16
+#define MVM_DEBUG_LINE_CAPACITY 256
+#define MVM_SERVER_BUFFER_CAPACITY (64 * 1024)
+#define MVM_PLUGINS_CAPACITY 16
+#define MVM_PERF_EVENTS 5
+// The memory followed by a guard page, large enough for any page size.
+#define MVM_GUARD_RESERVATION (MVM_MEMORY_CAPACITY + 64 * 1024)
+
+typedef struct _BREAKPOINT_ {
+    InstAddr addr;
+    Inst inst; // The instruction replaced by the trap.
+} Breakpoint;
+
+typedef struct _DEADLINE_ {
+    struct timespec at;
+    thrd_t thread;
+    mtx_t lock;
+    cnd_t cancel;
+    bool cancelled;
+} Deadline;
+
+typedef struct _SERVER_ {
+    uint8_t* pristine;       // Memory before the first job.
+    volatile uint8_t* dirty; // One flag per page of memory written by the current job.
+    size_t pages;
+    bool tracked;            // False if the memory pages can't be protected, then all of it is restored.
+    uint64_t fuel;
+    uint64_t timeLimit;
+} Server;
+
+// Counts of one label, the last entry collects the instructions before the first label.
+typedef struct _PERF_LABEL_ {
+    uint64_t insts;
+    uint64_t counts[MVM_PERF_EVENTS];
+} PerfLabel;
+
+typedef struct _PERF_ {
+    int fds[MVM_PERF_EVENTS]; // -1 if the event is not available.
+    int errors[MVM_PERF_EVENTS];
+    int leader;
+    uint64_t last[MVM_PERF_EVENTS]; // Counts at the last label change.
+    uint64_t totals[MVM_PERF_EVENTS];
+    uint64_t running; // Nanoseconds the counters were scheduled.
+    uint64_t retired;
+    uint16_t labelOf[MVM_PROGRAM_CAPACITY];
+    PerfLabel labels[MVM_SYMBOLS_CAPACITY + 1];
+} Perf;
+
+typedef struct _WATCHPOINT_ {
+    MemoryAddr addr;
+    uint64_t size;
+    uint8_t* shadow; // Last seen contents of the range.
+} Watchpoint;
 
 // Slick VM
 Mvm mvm = {0};
+// Used to assemble .msm input files in memory.
+Masm masm = {0};
+MvmTrace trace = {0};
+
+Deadline deadline = {0};
+Server server = {0};
+uint8_t serverBuffer[MVM_SERVER_BUFFER_CAPACITY];
+
+Perf perf = {0};
+
+Breakpoint breakpoints[MVM_BREAKPOINTS_CAPACITY];
+size_t breakpoints_size = 0;
+Watchpoint watchpoints[MVM_WATCHPOINTS_CAPACITY];
+size_t watchpoints_size = 0;
+
+// Interrupts claimed by plugins, linked to the imports of the program after loading it.
+MvmNative natives[MVM_NATIVES_CAPACITY];
+size_t natives_size = 0;
 
 static void usage(FILE* stream)
 {
-    fprintf(stream, "Usage: mvm -i <input.mbc> [options]\n");
+    fprintf(stream, "Usage: mvm -i <input.mbc|input.msm> [options]\n");
     fprintf(stream, "  -h          Provides a help list.\n");
-    fprintf(stream, "  -l <limit>  Sets a execution limit.\n");
+    fprintf(stream, "  -c <dir>    Sets the bytecode cache directory for .msm input.\n");
+    fprintf(stream, "  -nc         Disables the bytecode cache for .msm input.\n");
+    fprintf(stream, "  -l <fuel>   Limits the number of executed instructions.\n");
+    fprintf(stream, "  -tl <ms>    Limits the run time in milliseconds.\n");
     fprintf(stream, "  -d          Enables step-debug mode.\n");
     fprintf(stream, "  -ds         Enables debug-print-stack mode.\n");
+    fprintf(stream, "  -t <file>   Records a binary execution trace (see mvm-replay).\n");
+    fprintf(stream, "  -m <file>   Publishes live stats in a memory mapped file (see mvmtop).\n");
+    fprintf(stream, "  -g          Runs the program in the debugger, stopping at breakpoints.\n");
+    fprintf(stream, "  -b <loc>    Sets a breakpoint at an address or label (implies -g).\n");
+    fprintf(stream, "  -w <a>:<n>  Watches n bytes of memory at address a for writes (implies -g).\n");
+    fprintf(stream, "  -gm         Uses guard pages instead of bounds checks for memory instructions.\n");
+    fprintf(stream, "  -S          Runs a job for every request on stdin and answers on stdout (server mode).\n");
+    fprintf(stream, "  -sock <path> Like -S, but serves the clients of a Unix socket.\n");
+    fprintf(stream, "  -p <lib>    Loads a plugin that provides interrupts for %%interrupt imports.\n");
+    fprintf(stream, "  -fs <dir>   Lets the file interrupts open files below the directory, they fail otherwise.\n");
+    fprintf(stream, "  -pc         Reports hardware performance counters per executed instruction.\n");
+    fprintf(stream, "  -pcl        Like -pc, but also per label.\n");
+    fprintf(stream, "  -P <file>   Writes a profile of the executed blocks for 'masm -P'.\n");
+}
+
+static bool hasExtension(const char* path, const char* ext)
+{
+    size_t pathLen = strlen(path);
+    size_t extLen = strlen(ext);
+    return pathLen >= extLen && strcmp(path + pathLen - extLen, ext) == 0;
+}
+
+// Creates the directory and all its missing parents. Returns false if it still doesn't exist afterwards.
+static bool makeDirs(const char* dir)
+{
+    char path[MVM_CACHE_PATH_CAPACITY];
+    size_t len = strlen(dir);
+    if (len == 0 || len >= sizeof(path)) {
+        return false;
+    }
+    memcpy(path, dir, len + 1);
+
+    for (size_t i = 1; i <= len; ++i) {
+        if (path[i] == '/' || path[i] == '\\' || path[i] == '\0') {
+            char c = path[i];
+            path[i] = '\0';
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+                return false;
+            }
+            path[i] = c;
+        }
+    }
+
+    struct stat st;
+    return stat(dir, &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+}
+
+// $MVM_CACHE_DIR, else $XDG_CACHE_HOME/mvm, else ~/.cache/mvm (%LOCALAPPDATA%\mvm on Windows).
+static bool defaultCacheDir(char* out, size_t size)
+{
+    const char* env = getenv("MVM_CACHE_DIR");
+    if (env != NULL && *env != '\0') {
+        return snprintf(out, size, "%s", env) < (int)size;
+    }
+    env = getenv("XDG_CACHE_HOME");
+    if (env != NULL && *env != '\0') {
+        return snprintf(out, size, "%s/mvm", env) < (int)size;
+    }
+#if defined(_WIN32)
+    env = getenv("LOCALAPPDATA");
+    if (env != NULL && *env != '\0') {
+        return snprintf(out, size, "%s\\mvm", env) < (int)size;
+    }
+#else
+    env = getenv("HOME");
+    if (env != NULL && *env != '\0') {
+        return snprintf(out, size, "%s/.cache/mvm", env) < (int)size;
+    }
+#endif
+    return false;
+}
+
+// Assembles a .msm file, reusing a previously compiled image from the cache directory
+// if neither the source nor any file it includes has changed.
+static void loadSourceFile(const char* inputFilePath, const char* cacheDir)
+{
+    char cachePath[MVM_CACHE_PATH_CAPACITY];
+    bool cached = false;
+
+    if (cacheDir != NULL) {
+        // The image depends on the assembler as much as on the sources, the build stamp also covers
+        // changes made without bumping MASM_VERSION.
+        static const char build[] = __DATE__ " " __TIME__;
+        uint64_t hash = masm_hashBytes(MASM_HASH_SEED, &(uint16_t){MVM_FILE_VERSION}, sizeof(uint16_t));
+        hash = masm_hashBytes(hash, &(uint16_t){MASM_VERSION}, sizeof(uint16_t));
+        hash = masm_hashBytes(hash, build, sizeof(build));
+        hash = masm_hashSourceFile(&masm, cstr_as_sv(inputFilePath), hash, 0);
+        int n = snprintf(cachePath, sizeof(cachePath), "%s/%016" PRIx64 ".mbc", cacheDir, hash);
+        if (n > 0 && (size_t)n < sizeof(cachePath)) {
+            cached = true;
+            // A broken entry (e.g. cut short by a full disk) is assembled again and replaced.
+            char error[MVM_CACHE_PATH_CAPACITY + 256];
+            struct stat st;
+            if (stat(cachePath, &st) == 0 && mvm_readProgramFile(&mvm, cachePath, error, sizeof(error))) {
+                return;
+            }
+        }
+    }
+
+    mvm_translateSourceFile(&masm, cstr_as_sv(inputFilePath), 0);
+    mvm_loadProgramFromMasm(&mvm, &masm);
+
+    if (cached && makeDirs(cacheDir)) {
+        // Write to a private file first so concurrent runs never observe a partial image.
+        char tmpPath[MVM_CACHE_PATH_CAPACITY + 32];
+        snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", cachePath, (int)getpid());
+        masm_saveToFile(&masm, tmpPath, false, true);
+        if (rename(tmpPath, cachePath) < 0) {
+            remove(tmpPath);
+        }
+    }
+}
+
+static bool parseNumber(StringView sv, uint64_t* out)
+{
+    char buffer[32];
+    if (sv.count == 0 || sv.count >= sizeof(buffer)) {
+        return false;
+    }
+    memcpy(buffer, sv.data, sv.count);
+    buffer[sv.count] = '\0';
+    char* end = NULL;
+    *out = strtoull(buffer, &end, 0);
+    return *end == '\0';
+}
+
+// A location is either an instruction address or the name of a code label.
+static bool parseLocation(StringView sv, InstAddr* out)
+{
+    if (parseNumber(sv, out) || mvm_resolveSymbol(&mvm, sv, out)) {
+        return true;
+    }
+    fprintf(stderr, "ERROR: Unknown location '%" PRIsv "'! : "
+                    "Labels are only known for .msm input or programs assembled with 'masm -g'.\n", SV_FORMAT(sv));
+    return false;
+}
+
+static Breakpoint* findBreakpoint(InstAddr addr)
+{
+    for (size_t i = 0; i < breakpoints_size; ++i) {
+        if (breakpoints[i].addr == addr) {
+            return &breakpoints[i];
+        }
+    }
+    return NULL;
+}
+
+static void printLocation(FILE* stream, InstAddr addr)
+{
+    fprintf(stream, "%" PRIu64, addr);
+    const MvmSymbol* symbol = mvm_findSymbol(&mvm, addr);
+    if (symbol != NULL) {
+        fprintf(stream, " <%" PRIsv "+%" PRIu64 ">", SV_FORMAT(symbol->name), addr - symbol->addr);
+    }
+    if (addr >= mvm.program_size) {
+        return;
+    }
+    const Breakpoint* breakpoint = findBreakpoint(addr);
+    const Inst inst = breakpoint != NULL ? breakpoint->inst : mvm.program[addr];
+    if (InstHasOperand(inst.type)) {
+        fprintf(stream, " '%s %" PRIu64 "'", InstName(inst.type), inst.operand.as_u64);
+    } else {
+        fprintf(stream, " '%s'", InstName(inst.type));
+    }
+}
+
+// Patches a trap into the program, execution runs at full speed until it is hit.
+static bool addBreakpoint(InstAddr addr)
+{
+    if (addr >= mvm.program_size) {
+        fprintf(stderr, "ERROR: Can't set a breakpoint at %" PRIu64 "! : The program has %" PRIu64 " instructions.\n",
+                addr, mvm.program_size);
+        return false;
+    }
+    if (findBreakpoint(addr) != NULL) {
+        return true;
+    }
+    if (breakpoints_size >= MVM_BREAKPOINTS_CAPACITY) {
+        fprintf(stderr, "ERROR: Too many breakpoints! : The max amount of breakpoints is %d.\n", MVM_BREAKPOINTS_CAPACITY);
+        return false;
+    }
+    breakpoints[breakpoints_size++] = (Breakpoint) {
+            .addr = addr,
+            .inst = mvm.program[addr]
+    };
+    mvm.program[addr] = (Inst) {.type = INST_BREAK};
+    return true;
+}
+
+static bool removeBreakpoint(InstAddr addr)
+{
+    Breakpoint* breakpoint = findBreakpoint(addr);
+    if (breakpoint == NULL) {
+        fprintf(stderr, "ERROR: There is no breakpoint at %" PRIu64 "!\n", addr);
+        return false;
+    }
+    mvm.program[addr] = breakpoint->inst;
+    *breakpoint = breakpoints[--breakpoints_size];
+    return true;
+}
+
+#ifdef MVM_POSIX
+// Watched pages are write protected while the program runs. The first write to such a page
+// unprotects it and sets `watchFaulted`, the debugger then compares the watched ranges
+// with their shadow copies after the instruction, so unwatched execution pays nothing.
+static uintptr_t pageSize = 0;
+static volatile sig_atomic_t watchFaulted = 0;
+
+static void watchPages(const Watchpoint* watchpoint, uintptr_t* begin, uintptr_t* end)
+{
+    *begin = (uintptr_t)&mvm.memory[watchpoint->addr] & ~(pageSize - 1);
+    *end = ((uintptr_t)&mvm.memory[watchpoint->addr + watchpoint->size - 1] | (pageSize - 1)) + 1;
+}
+
+static void watchArm(bool armed)
+{
+    for (size_t i = 0; i < watchpoints_size; ++i) {
+        uintptr_t begin, end;
+        watchPages(&watchpoints[i], &begin, &end);
+        mprotect((void*)begin, end - begin, armed ? PROT_READ : PROT_READ | PROT_WRITE);
+    }
+}
+
+static void onWatchFault(int sig, siginfo_t* info, void* context)
+{
+    (void)context;
+    const uintptr_t page = (uintptr_t)info->si_addr & ~(pageSize - 1);
+    for (size_t i = 0; i < watchpoints_size; ++i) {
+        uintptr_t begin, end;
+        watchPages(&watchpoints[i], &begin, &end);
+        if (page >= begin && page < end) {
+            mprotect((void*)page, pageSize, PROT_READ | PROT_WRITE);
+            watchFaulted = 1;
+            return;
+        }
+    }
+    // Not caused by a watchpoint, fault again without the handler.
+    signal(sig, SIG_DFL);
+}
+
+static bool addWatchpoint(MemoryAddr addr, uint64_t size)
+{
+    if (size == 0 || addr >= MVM_MEMORY_CAPACITY || size > MVM_MEMORY_CAPACITY - addr) {
+        fprintf(stderr, "ERROR: Can't watch %" PRIu64 " bytes at %" PRIu64 "! : The memory is %d bytes big.\n",
+                size, addr, MVM_MEMORY_CAPACITY);
+        return false;
+    }
+    if (watchpoints_size >= MVM_WATCHPOINTS_CAPACITY) {
+        fprintf(stderr, "ERROR: Too many watchpoints! : The max amount of watchpoints is %d.\n", MVM_WATCHPOINTS_CAPACITY);
+        return false;
+    }
+    if (pageSize == 0) {
+        pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+        struct sigaction action = {0};
+        action.sa_sigaction = onWatchFault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, NULL);
+    }
+    uint8_t* shadow = malloc(size);
+    if (shadow == NULL) {
+        fprintf(stderr, "ERROR: Could not allocate %" PRIu64 " bytes for a watchpoint!\n", size);
+        return false;
+    }
+    memcpy(shadow, &mvm.memory[addr], size);
+    watchpoints[watchpoints_size++] = (Watchpoint) {
+            .addr = addr,
+            .size = size,
+            .shadow = shadow
+    };
+    return true;
+}
+
+// Reports every watched range that changed since it was last seen. Returns true if any did.
+static bool checkWatchpoints(InstAddr ip)
+{
+    bool hit = false;
+    for (size_t i = 0; i < watchpoints_size; ++i) {
+        Watchpoint* watchpoint = &watchpoints[i];
+        const uint8_t* memory = &mvm.memory[watchpoint->addr];
+        if (memcmp(watchpoint->shadow, memory, watchpoint->size) == 0) {
+            continue;
+        }
+        printf("[DEBUG] Watchpoint %" PRIu64 ":%" PRIu64 " written by ", watchpoint->addr, watchpoint->size);
+        printLocation(stdout, ip);
+        printf("\n");
+        for (uint64_t j = 0; j < watchpoint->size; ++j) {
+            if (watchpoint->shadow[j] != memory[j]) {
+                printf("  [%" PRIu64 "]: %02X -> %02X\n", watchpoint->addr + j, watchpoint->shadow[j], memory[j]);
+            }
+        }
+        memcpy(watchpoint->shadow, memory, watchpoint->size);
+        hit = true;
+    }
+    return hit;
+}
+#else
+static const int watchFaulted = 0;
+
+static void watchArm(bool armed)
+{
+    (void)armed;
+}
+
+static bool addWatchpoint(MemoryAddr addr, uint64_t size)
+{
+    (void)addr;
+    (void)size;
+    fprintf(stderr, "ERROR: Watchpoints are not supported on this platform!\n");
+    return false;
+}
+
+static bool checkWatchpoints(InstAddr ip)
+{
+    (void)ip;
+    return false;
+}
+#endif
+
+// Executes the instruction at the ip, even if a breakpoint was set on it.
+static ExceptionState debugResume(void)
+{
+    const InstAddr ip = mvm.ip;
+    if (ip >= mvm.program_size) {
+        return mvm_execInst(&mvm);
+    }
+    Breakpoint* breakpoint = findBreakpoint(ip);
+    if (breakpoint != NULL) {
+        mvm.program[ip] = breakpoint->inst;
+    }
+    ExceptionState err = EXCEPTION_SATE_OK;
+    if (mvm.program[ip].type == INST_BREAK) {
+        // A 'brk' from the source, skip it.
+        mvm.ip += 1;
+    } else {
+        err = mvm_execInst(&mvm);
+    }
+    if (breakpoint != NULL) {
+        mvm.program[ip] = (Inst) {.type = INST_BREAK};
+    }
+    return err;
+}
+
+// Runs until a breakpoint or watchpoint is hit, the program ends or fails.
+// Executes a single instruction if `step` is set.
+static ExceptionState debugRun(bool step)
+{
+    ExceptionState err = EXCEPTION_SATE_OK;
+    bool resume = true;
+    bool armed = false;
+    while (!mvm.halt) {
+        // A file request writing to a protected page fails instead of faulting. While any are in flight,
+        // the watched ranges stay writable and are compared after every instruction instead.
+        if (!armed && !(watchpoints_size > 0 && mvm_filesPending())) {
+            watchArm(true);
+            armed = true;
+        }
+        const InstAddr ip = mvm.ip;
+        err = resume ? debugResume() : mvm_execInst(&mvm);
+        resume = false;
+        if (mvm.stack_size > MVM_STACK_CAPACITY) {
+            err = EXCEPTION_STACK_OVERFLOW;
+        }
+        if (watchFaulted || (!armed && watchpoints_size > 0)) {
+            watchFaulted = 0;
+            step = checkWatchpoints(ip) || step;
+            armed = false;
+        }
+        if (err != EXCEPTION_SATE_OK || step) {
+            break;
+        }
+    }
+    watchArm(false);
+    return err;
+}
+
+static void debugUsage(void)
+{
+    printf("  c                  Continues until the next breakpoint or watchpoint.\n");
+    printf("  s                  Executes the next instruction.\n");
+    printf("  b <loc>            Sets a breakpoint at an address or label.\n");
+    printf("  d <loc>            Deletes the breakpoint at an address or label.\n");
+    printf("  w <addr> <size>    Watches a memory range for writes.\n");
+    printf("  stack              Prints the stack.\n");
+    printf("  mem <addr> <size>  Prints a memory range.\n");
+    printf("  q                  Stops the program.\n");
+}
+
+// Interactive debugger, the program runs at full speed between stops.
+static int debugProgram(void)
+{
+    char line[MVM_DEBUG_LINE_CAPACITY];
+    ExceptionState err = mvm.metered ? mvm_chargeFuel(&mvm) : EXCEPTION_SATE_OK;
+    if (err == EXCEPTION_SATE_OK) {
+        err = debugRun(false);
+    }
+    for (;;) {
+        if (err != EXCEPTION_SATE_OK && err != EXCEPTION_BREAKPOINT) {
+            fprintf(stderr, "ERROR: Failed to execute program! : %s\n", exception_as_cstr(err));
+            fprintf(stderr, "[DEBUG] At ");
+            printLocation(stderr, mvm.ip);
+            fprintf(stderr, "\n");
+            if (mvm.flags & MVM_FLAG_RSTACK) {
+                mvm_dumpCallStack(stderr, &mvm);
+            }
+            return 1;
+        }
+        if (mvm.halt) {
+            return 0;
+        }
+
+        printf("[DEBUG] %s ", err == EXCEPTION_BREAKPOINT ? "Breakpoint at" : "Stopped at");
+        printLocation(stdout, mvm.ip);
+        printf("\n");
+
+        bool resume = false;
+        while (!resume) {
+            printf("(mdb) ");
+            fflush(stdout);
+            if (fgets(line, sizeof(line), stdin) == NULL) {
+                return 0;
+            }
+            StringView args = sv_trim(cstr_as_sv(line));
+            StringView cmd = sv_chopByDelim(&args, ' ');
+            StringView arg1 = sv_chopByDelim(&args, ' ');
+            StringView arg2 = sv_trim(args);
+            InstAddr addr;
+            uint64_t size;
+
+            if (sv_eq(cmd, cstr_as_sv("c"))) {
+                err = debugRun(false);
+                resume = true;
+            } else if (sv_eq(cmd, cstr_as_sv("s"))) {
+                err = debugRun(true);
+                resume = true;
+            } else if (sv_eq(cmd, cstr_as_sv("b"))) {
+                if (parseLocation(arg1, &addr)) {
+                    addBreakpoint(addr);
+                }
+            } else if (sv_eq(cmd, cstr_as_sv("d"))) {
+                if (parseLocation(arg1, &addr)) {
+                    removeBreakpoint(addr);
+                }
+            } else if (sv_eq(cmd, cstr_as_sv("w")) || sv_eq(cmd, cstr_as_sv("mem"))) {
+                if (!parseNumber(arg1, &addr) || !parseNumber(arg2, &size)) {
+                    fprintf(stderr, "ERROR: Expected '%" PRIsv " <addr> <size>'!\n", SV_FORMAT(cmd));
+                } else if (sv_eq(cmd, cstr_as_sv("w"))) {
+                    addWatchpoint(addr, size);
+                } else {
+                    mvm_dumpMemory(stdout, &mvm, addr, size);
+                }
+            } else if (sv_eq(cmd, cstr_as_sv("stack"))) {
+                mvm_dumpStack(stdout, &mvm);
+                if (mvm.flags & MVM_FLAG_RSTACK) {
+                    mvm_dumpCallStack(stdout, &mvm);
+                }
+            } else if (sv_eq(cmd, cstr_as_sv("q"))) {
+                return 0;
+            } else if (cmd.count > 0) {
+                debugUsage();
+            }
+        }
+    }
+}
+
+// Sets mvm.deadline_expired when the deadline passes, unless it is cancelled before.
+// The interpreter polls the flag whenever it charges fuel.
+static int deadlineMain(void* arg)
+{
+    (void)arg;
+    mtx_lock(&deadline.lock);
+    while (!deadline.cancelled) {
+        if (cnd_timedwait(&deadline.cancel, &deadline.lock, &deadline.at) == thrd_timedout) {
+            atomic_store_explicit(&mvm.deadline_expired, 1, memory_order_relaxed);
+            break;
+        }
+    }
+    mtx_unlock(&deadline.lock);
+    return 0;
+}
+
+static void startDeadline(uint64_t ms)
+{
+    deadline.cancelled = false;
+    timespec_get(&deadline.at, TIME_UTC);
+    deadline.at.tv_sec += (time_t)(ms / 1000);
+    deadline.at.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.at.tv_nsec >= 1000000000) {
+        deadline.at.tv_sec += 1;
+        deadline.at.tv_nsec -= 1000000000;
+    }
+    if (mtx_init(&deadline.lock, mtx_plain) != thrd_success
+        || cnd_init(&deadline.cancel) != thrd_success
+        || thrd_create(&deadline.thread, deadlineMain, NULL) != thrd_success) {
+        fprintf(stderr, "ERROR: Could not start the timer thread!\n");
+        exit(1);
+    }
+}
+
+static void stopDeadline(void)
+{
+    mtx_lock(&deadline.lock);
+    deadline.cancelled = true;
+    cnd_signal(&deadline.cancel);
+    mtx_unlock(&deadline.lock);
+    thrd_join(deadline.thread, NULL);
+    cnd_destroy(&deadline.cancel);
+    mtx_destroy(&deadline.lock);
+}
+
+// Maps a stats page backed by `filePath` into memory, so other processes can watch the program.
+static MvmStats* openStats(const char* filePath)
+{
+#ifdef MVM_POSIX
+    int fd = open(filePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(MvmStats)) < 0) {
+        fprintf(stderr, "ERROR: Could not create stats file '%s'! : %s\n", filePath, strerror(errno));
+        exit(1);
+    }
+    void* page = mmap(NULL, sizeof(MvmStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map stats file '%s'! : %s\n", filePath, strerror(errno));
+        exit(1);
+    }
+    mvm_statsInit(page, &mvm, (uint64_t)getpid());
+    return page;
+#else
+    fprintf(stderr, "ERROR: Could not create stats file '%s'! : Not supported on this platform\n", filePath);
+    exit(1);
+#endif
+}
+
+static bool claimInterrupt(void* registry, const char* name, MvmInterrupt interrupt)
+{
+    const char* pluginPath = registry;
+    for (size_t i = 0; i < natives_size; ++i) {
+        if (strcmp(natives[i].name, name) == 0) {
+            fprintf(stderr, "ERROR: Interrupt '%s' of plugin '%s' is already provided by another plugin!\n", name, pluginPath);
+            return false;
+        }
+    }
+    if (natives_size >= MVM_NATIVES_CAPACITY) {
+        fprintf(stderr, "ERROR: Too many plugin interrupts! : The max amount of interrupts is %d.\n", MVM_NATIVES_CAPACITY);
+        return false;
+    }
+    natives[natives_size++] = (MvmNative) {.name = name, .interrupt = interrupt};
+    return true;
+}
+
+// Plugins stay loaded until the process exits, the names they claimed point into them.
+static void loadPlugin(const char* filePath)
+{
+#ifdef MVM_POSIX
+    void* plugin = dlopen(filePath, RTLD_NOW | RTLD_LOCAL);
+    if (plugin == NULL) {
+        fprintf(stderr, "ERROR: Could not load plugin '%s'! : %s\n", filePath, dlerror());
+        exit(1);
+    }
+    MvmPlugin_Entry entry;
+    *(void**)&entry = dlsym(plugin, MVM_PLUGIN_ENTRY);
+    if (entry == NULL) {
+        fprintf(stderr, "ERROR: '%s' is not a mvm plugin! : Missing function '%s'\n", filePath, MVM_PLUGIN_ENTRY);
+        exit(1);
+    }
+    if (!entry((void*)filePath, claimInterrupt)) {
+        fprintf(stderr, "ERROR: Failed to register plugin '%s'!\n", filePath);
+        exit(1);
+    }
+#else
+    fprintf(stderr, "ERROR: Could not load plugin '%s'! : Not supported on this platform\n", filePath);
+    exit(1);
+#endif
+}
+
+static const char* const perfNames[MVM_PERF_EVENTS] = {
+        "cycles", "instructions", "branch-misses", "L1i-misses", "L1d-misses",
+};
+
+#ifdef MVM_PERF
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perfEvents[MVM_PERF_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+// The available events are opened as one group, so they are always counted over the same instructions.
+// Only user space of the calling thread is counted, which perf_event_paranoid <= 2 allows.
+static void perfOpen(void)
+{
+    perf.leader = -1;
+    for (size_t i = 0; i < MVM_PERF_EVENTS; ++i) {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = perfEvents[i].type;
+        attr.config = perfEvents[i].config;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = perf.leader < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf.fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, perf.leader, 0);
+        perf.errors[i] = perf.fds[i] < 0 ? errno : 0;
+        if (perf.leader < 0) {
+            perf.leader = perf.fds[i];
+        }
+    }
+}
+
+// Adds the counts since the last call to `label`.
+static void perfSample(PerfLabel* label)
+{
+    uint64_t data[3 + MVM_PERF_EVENTS];
+    if (perf.leader < 0 || read(perf.leader, data, sizeof(data)) < (ssize_t)(sizeof(uint64_t) * 2)) {
+        return;
+    }
+    perf.running = data[1];
+    for (size_t i = 0, value = 2; i < MVM_PERF_EVENTS && value < 2 + data[0]; ++i) {
+        if (perf.fds[i] >= 0) {
+            label->counts[i] += data[value] - perf.last[i];
+            perf.totals[i] = perf.last[i] = data[value];
+            value += 1;
+        }
+    }
+}
+
+static void perfEnable(bool enable)
+{
+    if (perf.leader >= 0) {
+        ioctl(perf.leader, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+#else
+static void perfOpen(void)
+{
+    perf.leader = -1;
+    for (size_t i = 0; i < MVM_PERF_EVENTS; ++i) {
+        perf.fds[i] = -1;
+        perf.errors[i] = ENOSYS;
+    }
+}
+
+static void perfSample(PerfLabel* label)
+{
+    (void)label;
+}
+
+static void perfEnable(bool enable)
+{
+    (void)enable;
+}
+#endif
+
+// Same as mvm_execProgram, but counts the executed instructions and the hardware events while it runs.
+// With `byLabel` the counters are read whenever execution moves to another label, which costs a system call.
+static ExceptionState execProgramCounted(bool byLabel)
+{
+    const size_t none = mvm.symbols_size;
+    for (InstAddr addr = 0; addr < mvm.program_size; ++addr) {
+        const MvmSymbol* symbol = mvm_findSymbol(&mvm, addr);
+        perf.labelOf[addr] = (uint16_t)(symbol != NULL ? (size_t)(symbol - mvm.symbols) : none);
+    }
+    size_t current = mvm.ip < mvm.program_size ? perf.labelOf[mvm.ip] : none;
+
+    perfOpen();
+    perfEnable(true);
+    ExceptionState err = mvm.metered ? mvm_chargeFuel(&mvm) : EXCEPTION_SATE_OK;
+    while (err == EXCEPTION_SATE_OK && !mvm.halt) {
+        if (byLabel) {
+            const size_t label = mvm.ip < mvm.program_size ? perf.labelOf[mvm.ip] : none;
+            if (label != current) {
+                perfSample(&perf.labels[current]);
+                current = label;
+            }
+            perf.labels[current].insts += 1;
+        }
+        err = mvm_execInst(&mvm);
+        if (mvm.stack_size > MVM_STACK_CAPACITY) {
+            err = EXCEPTION_STACK_OVERFLOW;
+        }
+        perf.retired += err == EXCEPTION_SATE_OK;
+    }
+    perfEnable(false);
+    perfSample(&perf.labels[current]);
+    return err;
+}
+
+static void perfPrintRow(const char* name, uint64_t insts, const uint64_t* counts)
+{
+    fprintf(stderr, "PERF: %-24s %14" PRIu64, name, insts);
+    for (size_t i = 0; i < MVM_PERF_EVENTS; ++i) {
+        if (perf.fds[i] < 0) {
+            fprintf(stderr, " %14s", "-");
+        } else {
+            fprintf(stderr, " %14.3f", insts > 0 ? (double)counts[i] / (double)insts : 0.0);
+        }
+    }
+    fprintf(stderr, "\n");
 }
 
+// Prints the counts per executed instruction to stderr, so the output of the program stays untouched.
+static void perfReport(bool byLabel)
+{
+    if (perf.leader < 0) {
+        fprintf(stderr, "PERF: Hardware counters are not available! : %s\n", strerror(perf.errors[0]));
+    } else if (perf.running == 0) {
+        fprintf(stderr, "PERF: Hardware counters were never scheduled! : Too many events for the available counters\n");
+    } else {
+        for (size_t i = 0; i < MVM_PERF_EVENTS; ++i) {
+            if (perf.fds[i] < 0) {
+                fprintf(stderr, "PERF: Event '%s' is not available! : %s\n", perfNames[i], strerror(perf.errors[i]));
+            }
+        }
+    }
+
+    fprintf(stderr, "PERF: %-24s %14s", "per instruction", "executed");
+    for (size_t i = 0; i < MVM_PERF_EVENTS; ++i) {
+        fprintf(stderr, " %14s", perfNames[i]);
+    }
+    fprintf(stderr, "\n");
+    perfPrintRow("<total>", perf.retired, perf.totals);
+    if (!byLabel) {
+        return;
+    }
+
+    char name[32];
+    for (size_t i = 0; i <= mvm.symbols_size; ++i) {
+        const PerfLabel* label = &perf.labels[i];
+        if (label->insts == 0) {
+            continue;
+        }
+        if (i == mvm.symbols_size) {
+            snprintf(name, sizeof(name), "<no label>");
+        } else {
+            snprintf(name, sizeof(name), "%.*s", (int)mvm.symbols[i].name.count, mvm.symbols[i].name.data);
+        }
+        perfPrintRow(name, label->insts, label->counts);
+    }
+}
+
+#ifdef MVM_POSIX
+// Guarded memory: the memory is followed by an inaccessible guard page. Memory instructions
+// clamp their address to the memory capacity and access it without a bounds check, a fault on
+// the guard page jumps back into the loop of the faulting thread which fails with
+// EXCEPTION_MEMORY_ACCESS_VIOLATION.
+static _Thread_local sigjmp_buf* guardJump = NULL;
+
+static void onGuardFault(int sig, siginfo_t* info, void* context)
+{
+    (void)context;
+    const uintptr_t addr = (uintptr_t)info->si_addr;
+    const uintptr_t memory = (uintptr_t)mvm.memory;
+    if (guardJump != NULL && addr >= memory && addr < memory + MVM_GUARD_RESERVATION) {
+        siglongjmp(*guardJump, 1);
+    }
+    // Not caused by a memory instruction, fault again without the handler.
+    signal(sig, SIG_DFL);
+}
+
+static void initGuardedMemory(void)
+{
+    void* memory = mmap(NULL, MVM_GUARD_RESERVATION, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED || mprotect(memory, MVM_MEMORY_CAPACITY, PROT_READ | PROT_WRITE) < 0) {
+        fprintf(stderr, "ERROR: Could not reserve the guarded memory! : %s\n", strerror(errno));
+        exit(1);
+    }
+    struct sigaction action = {0};
+    action.sa_sigaction = onGuardFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+    // The loaders keep memory that is already there.
+    mvm.memory = memory;
+}
+
+static ExceptionState execProgramGuarded(Mvm* vm)
+{
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 1) != 0) {
+        guardJump = NULL;
+        return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+    }
+    guardJump = &jump;
+
+    ExceptionState err = vm->metered ? mvm_chargeFuel(vm) : EXCEPTION_SATE_OK;
+    while (err == EXCEPTION_SATE_OK && !vm->halt) {
+        err = mvm_execInstGuarded(vm);
+        if (vm->stack_size > MVM_STACK_CAPACITY) {
+            err = EXCEPTION_STACK_OVERFLOW;
+        }
+    }
+    guardJump = NULL;
+    return err;
+}
+
+// Server mode: the program is loaded once and every job runs on a reset copy of the VM.
+// stdin and stdout of the program are redirected into temporary files, so the interrupts
+// work unchanged. The memory is write protected between jobs and the first write to a page
+// marks it as dirty, only those pages are restored before the next job.
+static void onDirtyFault(int sig, siginfo_t* info, void* context)
+{
+    (void)context;
+    const uintptr_t addr = (uintptr_t)info->si_addr;
+    const uintptr_t memory = (uintptr_t)mvm.memory;
+    if (server.tracked && addr >= memory && addr < memory + MVM_MEMORY_ALLOC_SIZE) {
+        const size_t page = (size_t)((addr - memory) / pageSize);
+        mprotect((void*)(memory + page * pageSize), pageSize, PROT_READ | PROT_WRITE);
+        server.dirty[page] = 1;
+        return;
+    }
+    // Not caused by the memory of a job, fault again without the handler.
+    signal(sig, SIG_DFL);
+}
+
+static void serverResetMemory(void)
+{
+    if (!server.tracked) {
+        memcpy(mvm.memory, server.pristine, MVM_MEMORY_ALLOC_SIZE);
+        return;
+    }
+    for (size_t i = 0; i < server.pages; ++i) {
+        if (server.dirty[i]) {
+            memcpy(&mvm.memory[i * pageSize], &server.pristine[i * pageSize], pageSize);
+            mprotect(&mvm.memory[i * pageSize], pageSize, PROT_READ);
+            server.dirty[i] = 0;
+        }
+    }
+}
+
+static bool readAll(int fd, void* data, size_t size)
+{
+    uint8_t* bytes = data;
+    while (size > 0) {
+        const ssize_t n = read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    while (size > 0) {
+        const ssize_t n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+// Runs one job read from `in` and writes its result to `out`.
+// Returns false at the end of the stream or if the client misbehaves.
+static bool serveJob(int in, int out)
+{
+    MvmJob_Header header;
+    if (!readAll(in, &header, sizeof(header))) {
+        return false;
+    }
+    if (header.magic != MVM_JOB_MAGIC) {
+        fprintf(stderr, "ERROR: Invalid job! : Unexpected magic '%08X' : Expected '%08X'\n", header.magic, MVM_JOB_MAGIC);
+        return false;
+    }
+
+    // Nothing of the previous job may survive: threads it left running would keep writing the memory.
+    mvm_stopThreads(&mvm);
+    mvm.thread_failed = false;
+    mvm_closeFiles();
+    mvm_freeChannels(&mvm);
+    mvm_freeHeap(&mvm);
+    serverResetMemory();
+    mvm.ip = 0;
+    mvm.halt = false;
+    mvm.stack_size = 0;
+    mvm.rstack_size = 0;
+    mvm.frames_size = 0;
+    mvm.fp = 0;
+    mvm_freeCoroutines(&mvm);
+    if (mvm.metered) {
+        mvm_setFuel(&mvm, server.fuel);
+    }
+    atomic_store_explicit(&mvm.deadline_expired, 0, memory_order_relaxed);
+
+    ExceptionState state = EXCEPTION_SATE_OK;
+    for (uint32_t i = 0; i < header.stack_size; ++i) {
+        Word word;
+        if (!readAll(in, &word, sizeof(word))) {
+            return false;
+        }
+        if (mvm.stack_size < MVM_STACK_CAPACITY) {
+            mvm.stack[mvm.stack_size++] = word;
+        } else {
+            state = EXCEPTION_STACK_OVERFLOW;
+        }
+    }
+
+    if (ftruncate(STDIN_FILENO, 0) < 0) {
+        fprintf(stderr, "ERROR: Could not reset the input of a job! : %s\n", strerror(errno));
+        exit(1);
+    }
+    for (uint64_t offset = 0; offset < header.input_size;) {
+        const uint64_t remaining = header.input_size - offset;
+        const size_t chunk = remaining < sizeof(serverBuffer) ? (size_t)remaining : sizeof(serverBuffer);
+        if (!readAll(in, serverBuffer, chunk)) {
+            return false;
+        }
+        if (pwrite(STDIN_FILENO, serverBuffer, chunk, (off_t)offset) != (ssize_t)chunk) {
+            fprintf(stderr, "ERROR: Could not write the input of a job! : %s\n", strerror(errno));
+            exit(1);
+        }
+        offset += chunk;
+    }
+    fseek(stdin, 0, SEEK_SET);
+    clearerr(stdin);
+
+    fflush(stdout);
+    if (ftruncate(STDOUT_FILENO, 0) < 0) {
+        fprintf(stderr, "ERROR: Could not reset the output of a job! : %s\n", strerror(errno));
+        exit(1);
+    }
+    fseek(stdout, 0, SEEK_SET);
+
+    if (state == EXCEPTION_SATE_OK) {
+        if (server.timeLimit > 0) {
+            startDeadline(server.timeLimit);
+        }
+        state = mvm_execProgram(&mvm);
+        if (server.timeLimit > 0) {
+            stopDeadline();
+        }
+    }
+    fflush(stdout);
+
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) < 0) {
+        st.st_size = 0;
+    }
+    const MvmJob_Result result = {
+            .magic = MVM_JOB_RESULT_MAGIC,
+            .state = (uint32_t)state,
+            .output_size = (uint64_t)st.st_size,
+            .stack_size = mvm.stack_size
+    };
+    if (!writeAll(out, &result, sizeof(result))) {
+        return false;
+    }
+    for (off_t offset = 0; offset < st.st_size;) {
+        const ssize_t n = pread(STDOUT_FILENO, serverBuffer, sizeof(serverBuffer), offset);
+        if (n <= 0 || !writeAll(out, serverBuffer, (size_t)n)) {
+            return false;
+        }
+        offset += n;
+    }
+    return writeAll(out, mvm.stack, sizeof(Word) * mvm.stack_size);
+}
+
+static int serve(const char* socketPath, uint64_t fuel, uint64_t timeLimit)
+{
+    server.fuel = fuel;
+    server.timeLimit = timeLimit;
+    if (!mvm.metered) {
+        // Threads a job leaves running stop when they charge fuel.
+        mvm_setFuel(&mvm, MVM_FUEL_UNLIMITED);
+    }
+    server.pristine = malloc(MVM_MEMORY_ALLOC_SIZE);
+    if (server.pristine == NULL) {
+        fprintf(stderr, "ERROR: Could not allocate %d bytes for the server!\n", MVM_MEMORY_ALLOC_SIZE);
+        exit(1);
+    }
+    memcpy(server.pristine, mvm.memory, MVM_MEMORY_ALLOC_SIZE);
+
+    // The protocol keeps the original stdin and stdout, the program gets the files.
+    const int in = dup(STDIN_FILENO);
+    const int out = dup(STDOUT_FILENO);
+    FILE* inputFile = tmpfile();
+    FILE* outputFile = tmpfile();
+    if (in < 0 || out < 0 || inputFile == NULL || outputFile == NULL
+        || dup2(fileno(inputFile), STDIN_FILENO) < 0 || dup2(fileno(outputFile), STDOUT_FILENO) < 0) {
+        fprintf(stderr, "ERROR: Could not redirect the program input and output! : %s\n", strerror(errno));
+        exit(1);
+    }
+    // A buffered stdin could still hold the input of the previous job after rewinding it.
+    setvbuf(stdin, NULL, _IONBF, 0);
+
+    pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    server.tracked = MVM_MEMORY_ALIGNMENT % pageSize == 0;
+    if (server.tracked) {
+        server.pages = MVM_MEMORY_ALLOC_SIZE / pageSize;
+        server.dirty = calloc(server.pages, 1);
+        struct sigaction action = {0};
+        action.sa_sigaction = onDirtyFault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        if (server.dirty == NULL || sigaction(SIGSEGV, &action, NULL) < 0
+            || mprotect(mvm.memory, MVM_MEMORY_ALLOC_SIZE, PROT_READ) < 0) {
+            fprintf(stderr, "ERROR: Could not protect the memory of the program! : %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (socketPath == NULL) {
+        while (serveJob(in, out)) {}
+        return 0;
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: The socket path '%s' is too long!\n", socketPath);
+        exit(1);
+    }
+    strcpy(addr.sun_path, socketPath);
+    remove(socketPath);
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        fprintf(stderr, "ERROR: Could not listen on socket '%s'! : %s\n", socketPath, strerror(errno));
+        exit(1);
+    }
+    // A client that disconnects early must not stop the server.
+    signal(SIGPIPE, SIG_IGN);
+    for (;;) {
+        const int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: Could not accept a client on socket '%s'! : %s\n", socketPath, strerror(errno));
+            exit(1);
+        }
+        while (serveJob(client, client)) {}
+        close(client);
+    }
+}
+#endif
+
 int main(int argc, char** argv)
 {
     shift(&argc, &argv); // Skip program name.
     char* inputFilePath = NULL;
-    int limit = -1;
+    const char* traceFilePath = NULL;
+    const char* statsFilePath = NULL;
+    const char* profileFilePath = NULL;
+    const char* socketPath = NULL;
+    int serverMode = 0;
+    int guardedMemory = 0;
+    int perfCounters = 0;
+    bool perfByLabel = false;
+    const char* cacheDir = NULL;
+    bool useCache = true;
+    uint64_t fuel = MVM_FUEL_UNLIMITED;
+    uint64_t timeLimit = 0;
     int debug = 0;
     int debugPrint = 0;
+    int debugger = 0;
+    const char* breakpointArgs[MVM_BREAKPOINTS_CAPACITY];
+    size_t breakpointArgs_size = 0;
+    const char* watchpointArgs[MVM_WATCHPOINTS_CAPACITY];
+    size_t watchpointArgs_size = 0;
+    const char* pluginArgs[MVM_PLUGINS_CAPACITY];
+    size_t pluginArgs_size = 0;
+    const char* fileRoot = NULL;
     int error = 0;
     const char* errorFlag = NULL;
 
@@ -42,7 +1218,102 @@ int main(int argc, char** argv)
                 usage(stderr);
                 exit(1);
             }
-            limit = atoi(shift(&argc, &argv));
+            const char* arg = shift(&argc, &argv);
+            if (!parseNumber(cstr_as_sv(arg), &fuel)) {
+                fprintf(stderr, "ERROR: '%s' is not a valid number for flag '%s'!\n", arg, flag);
+                exit(1);
+            }
+        } else if (strcmp(flag, "-tl") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            const char* arg = shift(&argc, &argv);
+            if (!parseNumber(cstr_as_sv(arg), &timeLimit) || timeLimit == 0) {
+                fprintf(stderr, "ERROR: '%s' is not a valid time limit for flag '%s'!\n", arg, flag);
+                exit(1);
+            }
+        } else if (strcmp(flag, "-c") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            cacheDir = shift(&argc, &argv);
+        } else if (strcmp(flag, "-t") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            traceFilePath = shift(&argc, &argv);
+        } else if (strcmp(flag, "-m") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            statsFilePath = shift(&argc, &argv);
+        } else if (strcmp(flag, "-P") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            profileFilePath = shift(&argc, &argv);
+        } else if (strcmp(flag, "-b") == 0 || strcmp(flag, "-w") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            if (flag[1] == 'b' && breakpointArgs_size < MVM_BREAKPOINTS_CAPACITY) {
+                breakpointArgs[breakpointArgs_size++] = shift(&argc, &argv);
+            } else if (flag[1] == 'w' && watchpointArgs_size < MVM_WATCHPOINTS_CAPACITY) {
+                watchpointArgs[watchpointArgs_size++] = shift(&argc, &argv);
+            } else {
+                fprintf(stderr, "ERROR: Too many '%s' flags!\n", flag);
+                exit(1);
+            }
+            debugger = 1;
+        } else if (strcmp(flag, "-p") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            if (pluginArgs_size >= MVM_PLUGINS_CAPACITY) {
+                fprintf(stderr, "ERROR: Too many '%s' flags!\n", flag);
+                exit(1);
+            }
+            pluginArgs[pluginArgs_size++] = shift(&argc, &argv);
+        } else if (strcmp(flag, "-fs") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            fileRoot = shift(&argc, &argv);
+        } else if (strcmp(flag, "-sock") == 0) {
+            if (argc == 0) {
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                usage(stderr);
+                exit(1);
+            }
+            socketPath = shift(&argc, &argv);
+            serverMode = 1;
+        } else if (strcmp(flag, "-S") == 0) {
+            serverMode = 1;
+        } else if (strcmp(flag, "-pc") == 0 || strcmp(flag, "-pcl") == 0) {
+            perfCounters = 1;
+            perfByLabel = perfByLabel || flag[3] == 'l';
+        } else if (strcmp(flag, "-gm") == 0) {
+            guardedMemory = 1;
+        } else if (strcmp(flag, "-g") == 0) {
+            debugger = 1;
+        } else if (strcmp(flag, "-nc") == 0) {
+            useCache = false;
         } else if (strcmp(flag, "-h") == 0) {
             usage(stdout);
             exit(0);
@@ -78,30 +1349,157 @@ int main(int argc, char** argv)
         exit(1);
     }
 
-    mvm_pushInterrupt(&mvm, interrupt_PRINTchar); // 0
-    mvm_pushInterrupt(&mvm, interrupt_PRINTf64);  // 1
-    mvm_pushInterrupt(&mvm, interrupt_PRINTi64);  // 2
-    mvm_pushInterrupt(&mvm, interrupt_PRINTu64);  // 3
-    mvm_pushInterrupt(&mvm, interrupt_PRINTptr);  // 4
-    mvm_pushInterrupt(&mvm, interrupt_ALLOC);     // 5
-    mvm_pushInterrupt(&mvm, interrupt_FREE);      // 6
-    mvm_pushInterrupt(&mvm, interrupt_DUMPMEM);   // 7
-    mvm_pushInterrupt(&mvm, interrupt_WRITE);     // 8
-    mvm_pushInterrupt(&mvm, interrupt_READLINE);  // 9
+    if (guardedMemory && (debug || debugger || serverMode || traceFilePath != NULL || statsFilePath != NULL || perfCounters)) {
+        fprintf(stderr, "ERROR: '-gm' can't be used with '-d', '-t', '-m', '-pc', server mode or the debugger enabled!\n");
+        usage(stderr);
+        exit(1);
+    }
+    if (perfCounters && (debug || debugger || serverMode || traceFilePath != NULL || statsFilePath != NULL)) {
+        fprintf(stderr, "ERROR: '-pc' can't be used with '-d', '-t', '-m', server mode or the debugger enabled!\n");
+        usage(stderr);
+        exit(1);
+    }
+    if (profileFilePath != NULL && (debug || debugger || serverMode || guardedMemory || traceFilePath != NULL
+                                    || statsFilePath != NULL || perfCounters)) {
+        fprintf(stderr, "ERROR: '-P' can't be used with '-d', '-t', '-m', '-pc', '-gm', server mode or the debugger enabled!\n");
+        usage(stderr);
+        exit(1);
+    }
+    if (guardedMemory) {
+#ifdef MVM_POSIX
+        initGuardedMemory();
+        mvm_threadMain = execProgramGuarded;
+#else
+        fprintf(stderr, "ERROR: '-gm' is not supported on this platform!\n");
+        exit(1);
+#endif
+    }
+
+    if (fileRoot != NULL && !mvm_setFileRoot(fileRoot)) {
+        fprintf(stderr, "ERROR: Could not open the file root '%s'! : %s\n", fileRoot, strerror(errno));
+        exit(1);
+    }
+
+    mvm_pushStdInterrupts(&mvm);
+
+    if (hasExtension(inputFilePath, ".msm")) {
+        char defaultDir[MVM_CACHE_PATH_CAPACITY];
+        if (useCache && cacheDir == NULL && defaultCacheDir(defaultDir, sizeof(defaultDir))) {
+            cacheDir = defaultDir;
+        }
+        loadSourceFile(inputFilePath, useCache ? cacheDir : NULL);
+    } else {
+        mvm_loadProgramFromFile(&mvm, inputFilePath);
+    }
+    for (size_t i = 0; i < pluginArgs_size; ++i) {
+        loadPlugin(pluginArgs[i]);
+    }
+    mvm_linkImports(&mvm, natives, natives_size);
+    if (debug && traceFilePath != NULL) {
+        fprintf(stderr, "ERROR: '-t' can't be used with '-d' enabled!\n");
+        usage(stderr);
+        exit(1);
+    }
+    if (statsFilePath != NULL && (debug || debugger || traceFilePath != NULL)) {
+        fprintf(stderr, "ERROR: '-m' can't be used with '-d', '-t' or the debugger enabled!\n");
+        usage(stderr);
+        exit(1);
+    }
+    if (debugger && (debug || debugPrint || traceFilePath != NULL)) {
+        fprintf(stderr, "ERROR: The debugger can't be used with '-d', '-ds' or '-t' enabled!\n");
+        usage(stderr);
+        exit(1);
+    }
+
+    if (timeLimit > 0 && (debug || debugger)) {
+        fprintf(stderr, "ERROR: '-tl' can't be used with '-d' or the debugger enabled!\n");
+        usage(stderr);
+        exit(1);
+    }
+    if (serverMode && (debug || debugPrint || debugger || traceFilePath != NULL || statsFilePath != NULL)) {
+        fprintf(stderr, "ERROR: Server mode can't be used with '-d', '-ds', '-t', '-m' or the debugger enabled!\n");
+        usage(stderr);
+        exit(1);
+    }
+    if (fuel != MVM_FUEL_UNLIMITED || timeLimit > 0) {
+        mvm_setFuel(&mvm, fuel);
+    }
+
+    if (serverMode) {
+#ifdef MVM_POSIX
+        return serve(socketPath, fuel, timeLimit);
+#else
+        fprintf(stderr, "ERROR: Server mode is not supported on this platform!\n");
+        exit(1);
+#endif
+    }
+
+    if (debugger) {
+        for (size_t i = 0; i < breakpointArgs_size; ++i) {
+            InstAddr addr;
+            if (!parseLocation(cstr_as_sv(breakpointArgs[i]), &addr) || !addBreakpoint(addr)) {
+                exit(1);
+            }
+        }
+        for (size_t i = 0; i < watchpointArgs_size; ++i) {
+            StringView size = cstr_as_sv(watchpointArgs[i]);
+            StringView addr = sv_chopByDelim(&size, ':');
+            MemoryAddr watchAddr;
+            uint64_t watchSize;
+            if (!parseNumber(addr, &watchAddr) || !parseNumber(size, &watchSize)) {
+                fprintf(stderr, "ERROR: Expected '<addr>:<size>' for flag '-w' but got '%s'!\n", watchpointArgs[i]);
+                exit(1);
+            }
+            if (!addWatchpoint(watchAddr, watchSize)) {
+                exit(1);
+            }
+        }
+        return debugProgram();
+    }
 
-    mvm_loadProgramFromFile(&mvm, inputFilePath);
     if (!debug) {
-        ExceptionState state = mvm_execProgram(&mvm, limit);
+        ExceptionState state;
+        if (timeLimit > 0) {
+            startDeadline(timeLimit);
+        }
+        if (traceFilePath != NULL) {
+            mvm_traceOpen(&trace, &mvm, traceFilePath);
+            state = mvm_execProgramTraced(&mvm, &trace);
+            mvm_traceClose(&trace);
+        } else if (statsFilePath != NULL) {
+            state = mvm_execProgramStats(&mvm, openStats(statsFilePath));
+        } else if (profileFilePath != NULL) {
+            static uint64_t counts[MVM_PROGRAM_CAPACITY];
+            static uint64_t taken[MVM_PROGRAM_CAPACITY];
+            state = mvm_execProgramProfiled(&mvm, counts, taken);
+            mvm_saveProfile(&mvm, counts, taken, profileFilePath);
+        } else if (perfCounters) {
+            state = execProgramCounted(perfByLabel);
+            perfReport(perfByLabel);
+        } else {
+            state = mvm_threadMain(&mvm);
+        }
+        if (timeLimit > 0) {
+            stopDeadline();
+        }
         if (state != EXCEPTION_STACK_OVERFLOW && debugPrint) {
             mvm_dumpStack(stdout, &mvm);
             //mvm_dumpMemory(stdout, &mvm);
         } else if (state != EXCEPTION_SATE_OK) {
             fprintf(stderr, "ERROR: Failed to execute program! : %s\n", exception_as_cstr(state));
+            if (mvm.flags & MVM_FLAG_RSTACK) {
+                mvm_dumpCallStack(stderr, &mvm);
+            }
             return 1;
         }
     } else {
         int step = 0;
-        while (limit != 0 && !mvm.halt) {
+        ExceptionState err = mvm.metered ? mvm_chargeFuel(&mvm) : EXCEPTION_SATE_OK;
+        if (err != EXCEPTION_SATE_OK) {
+            fprintf(stderr, "ERROR: Failed to execute program! : %s\n", exception_as_cstr(err));
+            exit(1);
+        }
+        while (!mvm.halt) {
             step++;
             if (InstHasOperand(mvm.program[mvm.ip].type)) {
                 printf("\n[DEBUG] Executing '%s %" PRIu64 "' | Step [%d] |:\n",
@@ -111,20 +1509,23 @@ int main(int argc, char** argv)
                 printf("\n[DEBUG] Executing '%s' | Step [%d] |:\n",
                            InstName(mvm.program[mvm.ip].type), step);
             }
-            ExceptionState err = mvm_execInst(&mvm);
+            err = mvm_execInst(&mvm);
             if (mvm.stack_size > MVM_STACK_CAPACITY) {
                 fprintf(stderr, "ERROR: Failed to execute program! : %s\n", exception_as_cstr(EXCEPTION_STACK_OVERFLOW));
                 exit(1);
             }
             if (err != EXCEPTION_SATE_OK) {
                 fprintf(stderr, "ERROR: Failed to execute program! : %s\n", exception_as_cstr(err));
+                if (mvm.flags & MVM_FLAG_RSTACK) {
+                    mvm_dumpCallStack(stderr, &mvm);
+                }
                 exit(1);
             }
-            if (limit > 0) {
-                --limit;
-            }
             printf("\n");
             mvm_dumpStack(stdout, &mvm);
+            if (mvm.flags & MVM_FLAG_RSTACK) {
+                mvm_dumpCallStack(stdout, &mvm);
+            }
             //mvm_dumpMemory(stdout, &mvm);
             printf("\nPress enter to execute the next instruction...\n");
             getchar();
@@ -0,0 +1,123 @@
+//
+// Monitor for the stats pages published with 'mvm -m'.
+//
+
+#define MVM_SHARED_IMPLEMENTATION
+#include "../shared.h"
+#include <threads.h>
+
+#define MVMTOP_FILES_CAPACITY 256
+
+static void usage(FILE* stream)
+{
+    fprintf(stream, "Usage: mvmtop [options] <stats files...>\n");
+    fprintf(stream, "  -h          Provides a help list.\n");
+    fprintf(stream, "  -o          Prints the stats once instead of refreshing them every second.\n");
+    fprintf(stream, "  -v          Also lists the calls per interrupt vector.\n");
+}
+
+static const char* stateName(uint64_t state)
+{
+    switch (state) {
+        case MVM_STATS_RUNNING: return "running";
+        case MVM_STATS_HALTED:  return "halted";
+        case MVM_STATS_FAILED:  return "failed";
+        default:                return "unknown";
+    }
+}
+
+static bool readStats(const char* filePath, MvmStats* stats)
+{
+    FILE* f = fopen(filePath, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    size_t n = fread(stats, sizeof(*stats), 1, f);
+    fclose(f);
+    return n == 1 && stats->magic == MVM_STATS_MAGIC && stats->version == MVM_STATS_VERSION;
+}
+
+#define LOAD(field) atomic_load_explicit(&stats.field, memory_order_relaxed)
+
+static void printStats(const char** files, size_t files_size, bool verbose)
+{
+    const uint64_t now = mvm_nowMs();
+    printf("%-8s %-8s %8s %8s %14s %12s %6s %6s %6s %12s %8s  %s\n",
+           "PID", "STATE", "UPTIME", "UPDATED", "INSTS", "INST/S", "STACK", "MAX", "CALLS", "HEAP", "BLOCKS", "FILE");
+
+    for (size_t i = 0; i < files_size; ++i) {
+        MvmStats stats;
+        if (!readStats(files[i], &stats)) {
+            printf("%-8s %-8s %8s %8s %14s %12s %6s %6s %6s %12s %8s  %s\n",
+                   "-", "invalid", "-", "-", "-", "-", "-", "-", "-", "-", "-", files[i]);
+            continue;
+        }
+        const uint64_t updated = LOAD(updated_ms);
+        printf("%-8" PRIu64 " %-8s %7.1fs %7.1fs %14" PRIu64 " %12" PRIu64 " %6" PRIu64 " %6" PRIu64 " %6" PRIu64 " %12" PRIu64 " %8" PRIu64 "  %s\n",
+               stats.pid, stateName(LOAD(state)),
+               (double)(updated - stats.started_ms) / 1000.0,
+               now > updated ? (double)(now - updated) / 1000.0 : 0.0,
+               LOAD(insts_retired), LOAD(insts_per_sec),
+               LOAD(stack_size), LOAD(stack_max), LOAD(rstack_size),
+               LOAD(heap_allocated), LOAD(heap_blocks), files[i]);
+
+        if (verbose) {
+            printf("    memory: %" PRIu64 " bytes | interrupts:", LOAD(memory_size));
+            for (size_t j = 0; j < MVM_NATIVES_CAPACITY; ++j) {
+                const uint64_t calls = LOAD(interrupts[j]);
+                if (calls > 0) {
+                    printf(" [%zu] %" PRIu64, j, calls);
+                }
+            }
+            printf("\n");
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    shift(&argc, &argv); // Skip program name.
+    const char* files[MVMTOP_FILES_CAPACITY];
+    size_t files_size = 0;
+    bool once = false;
+    bool verbose = false;
+
+    while (argc > 0) {
+        const char* arg = shift(&argc, &argv);
+        if (strcmp(arg, "-h") == 0) {
+            usage(stdout);
+            exit(0);
+        } else if (strcmp(arg, "-o") == 0) {
+            once = true;
+        } else if (strcmp(arg, "-v") == 0) {
+            verbose = true;
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "ERROR: Unknown flag '%s'!\n", arg);
+            usage(stderr);
+            exit(1);
+        } else if (files_size >= MVMTOP_FILES_CAPACITY) {
+            fprintf(stderr, "ERROR: Too many stats files! : The max amount of files is %d.\n", MVMTOP_FILES_CAPACITY);
+            exit(1);
+        } else {
+            files[files_size++] = arg;
+        }
+    }
+
+    if (files_size == 0) {
+        fprintf(stderr, "ERROR: Expected stats file!\n");
+        usage(stderr);
+        exit(1);
+    }
+
+    if (once) {
+        printStats(files, files_size, verbose);
+        return 0;
+    }
+
+    for (;;) {
+        printf("\033[H\033[J");
+        printStats(files, files_size, verbose);
+        fflush(stdout);
+        thrd_sleep(&(struct timespec) {.tv_sec = 1}, NULL);
+    }
+}
@@ -4,15 +4,37 @@
 
 #ifndef MVM_SHARED_H
 #define MVM_SHARED_H
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_DEFAULT_SOURCE)
+#   define _DEFAULT_SOURCE // pread, pwrite and MAP_ANONYMOUS for the file interrupts.
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <threads.h>
+#if defined(__unix__) || defined(__APPLE__)
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   if defined(__linux__)
+#       include <sys/syscall.h>
+#       if defined(SYS_io_uring_setup)
+#           include <linux/io_uring.h>
+#           define MVM_FILES_IO_URING
+#       endif
+#   endif
+#   define MVM_FILES_POSIX
+#endif
 
 // PACK struct definition code: https://stackoverflow.com/a/3312896/18037447
 #if defined(__GNUC__) || defined(__clang__)
@@ -21,6 +43,14 @@
 #   define PACK( __Declaration__ ) __pragma( pack(push, 1) ) __Declaration__ __pragma( pack(pop))
 #endif
 
+#if defined(__GNUC__) || defined(__clang__)
+#   define MVM_ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#   define MVM_ALWAYS_INLINE __forceinline
+#else
+#   define MVM_ALWAYS_INLINE inline
+#endif
+
 
 // Checking for OS type
 #if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
@@ -45,16 +75,67 @@ else
 #define MASM_LABEL_CAPACITY 1024
 #define MASM_DEFERRED_OPERANDS_CAPACITY 1024
 #define MASM_MAX_INCLUDES 42
+#define MASM_INLINES_CAPACITY 256
+#define MASM_INLINE_LOCALS_CAPACITY 1024
+#define MASM_MAX_INLINE_DEPTH 16
+#define MASM_FRAME_NAMES_CAPACITY 256
+#define MASM_DATA_CAPACITY 1024
+#define MASM_DATA_DEFAULT_ALIGNMENT 8
 #define MASM_MEMARENA_CAPACITY (1000 * 1000 * 1000) // 1GB
 #define MASM_COMMENT_SYMBOL ';'
 #define MASM_PP_SYMBOL '%'
+#define MASM_HASH_SEED 14695981039346656037ULL // FNV-1a 64 offset basis
+#define MASM_HASH_PRIME 1099511628211ULL
+#define MASM_OPTIMIZER_MAX_PASSES 16
+#define MASM_OPTIMIZER_MAX_JUMP_HOPS 16
+#define MASM_VERSION 3 // Bump whenever masm emits a different image for the same source.
 
 #define MVM_STACK_CAPACITY 942 //TODO: Fix stack-underflow if lager than 942.
+#define MVM_RSTACK_CAPACITY 4096
+#define MVM_CALLSTACK_DUMP_LIMIT 32
+#define MVM_SYMBOLS_CAPACITY 1024
+#define MVM_SYMBOL_NAMES_CAPACITY (64 * 1024)
 #define MVM_PROGRAM_CAPACITY 1024
 #define MVM_NATIVES_CAPACITY 1024
-#define MVM_MEMORY_CAPACITY (640 * 1000) // 640 KB
+#define MVM_STD_INTERRUPTS 32 // Interrupts of mvm_pushStdInterrupts, imported ones are linked after them.
+#define MVM_IMPORT_VECTORS MVM_NATIVES_CAPACITY // 'int' operands of the imports in an image, see mvm_linkImports.
+#define MVM_IMPORTS_CAPACITY 64
+#define MVM_IMPORT_NAME_CAPACITY 64
+#define MVM_MEMORY_CAPACITY (640 * 1024) // 640 KB, whole pages, so guarded memory faults right after it.
+#define MVM_MEMORY_ALIGNMENT 4096
+#define MVM_MEMORY_ALLOC_SIZE ((MVM_MEMORY_CAPACITY + MVM_MEMORY_ALIGNMENT - 1) / MVM_MEMORY_ALIGNMENT * MVM_MEMORY_ALIGNMENT)
+#define MVM_THREADS_CAPACITY 64
+#define MVM_CHANNELS_CAPACITY 256
+#define MVM_CHANNEL_SPINS 1024 // Busy polls of a blocked channel before the thread parks.
+#define MVM_CHANNEL_WAIT_NS 1000000 // A parked thread checks the limits and the other threads this often.
+#define MVM_COROUTINES_CAPACITY 256
+#define MVM_COROUTINE_STACK_CAPACITY 64 // Words, calls and frames a suspended coroutine can keep.
+#define MVM_COROUTINE_RETURN UINT64_MAX // Return address of the function of a coroutine.
+#define MVM_FILES_CAPACITY 64
+#define MVM_FILE_MAPS_CAPACITY 64
+#define MVM_FILE_REQUESTS_CAPACITY 256
+#define MVM_FILE_WORKERS 4 // Threads serving the asynchronous file requests without io_uring.
+#define MVM_FILE_RING_CHUNK (1u << 30) // Largest transfer of a single io_uring entry.
+#define MVM_FILE_WAIT_NS 10000000 // A blocked file interrupt checks the run time limit this often.
+#define MVM_FILE_PATH_CAPACITY 4096
+#define MVM_FILE_READ     0x01
+#define MVM_FILE_WRITE    0x02 // Creates the file if it does not exist.
+#define MVM_FILE_TRUNCATE 0x04
+#define MVM_FILE_APPEND   0x08
 #define MVM_FILE_MAGIC (uint32_t) 0x4d564d
-#define MVM_FILE_VERSION 3
+#define MVM_FILE_VERSION 9
+#define MVM_FLAG_RSTACK 0x01 // call/ret use the separate return stack.
+#define MVM_TRACE_MAGIC (uint32_t) 0x4d565452
+#define MVM_TRACE_VERSION 2
+#define MVM_TRACE_MEMORY 0xFF // Record type of memory written by an interrupt.
+#define MVM_TRACE_BUFFER_CAPACITY (256 * 1024)
+#define MVM_FUEL_UNLIMITED UINT64_MAX
+#define MVM_FUEL_LEASE 4096 // Fuel a thread takes from the shared budget at once.
+#define MVM_STATS_MAGIC (uint32_t) 0x4d565353
+#define MVM_STATS_VERSION 1
+#define MVM_STATS_BATCH 65536 // Instructions executed between two updates of the stats page.
+#define MVM_JOB_MAGIC (uint32_t) 0x4d564a42
+#define MVM_JOB_RESULT_MAGIC (uint32_t) 0x4d564a52
 //#define MVM_MEMORY_CAPACITY 20
 
 typedef enum {false, true} bool;
@@ -66,11 +147,18 @@ typedef union _WORD_ {
     void* as_ptr;
 } Word;
 static_assert(sizeof(Word) == 8, "The MVMs Word is expected to be 64 bits!");
+static_assert(MVM_MEMORY_CAPACITY % (64 * 1024) == 0, "The memory has to end at a page boundary for any page size!");
 
 Word word_u64(uint64_t value);
 Word word_f64(double value);
 Word word_i64(int64_t value);
 Word word_ptr(void* value);
+// Signed integer helpers shared by the interpreter, the optimizer and mbc2c output. None of them is undefined
+// for any input except a division by zero: INT64_MIN / -1 wraps, shifts saturate and NaN converts to 0.
+Word mvm_divS(Word a, Word b);
+Word mvm_modS(Word a, Word b);
+Word mvm_sar(Word a, Word b);
+int64_t mvm_f64ToI64(double value);
 
 typedef struct _STRINGVIEW_ {
     size_t count;
@@ -94,6 +182,14 @@ typedef enum _EXCEPTIONSTATE_ {
     EXCEPTION_ILLEGAL_OPERAND,
     EXCEPTION_MEMORY_ACCESS_VIOLATION,
     EXCEPTION_INTERRUPT_FAILED,
+    EXCEPTION_RSTACK_OVERFLOW,
+    EXCEPTION_RSTACK_UNDERFLOW,
+    EXCEPTION_BREAKPOINT,
+    EXCEPTION_OUT_OF_FUEL,
+    EXCEPTION_TIMEOUT,
+    EXCEPTION_THREAD_FAILED,
+    EXCEPTION_COROUTINE_FAILED,
+    EXCEPTION_DEADLOCK,
 } ExceptionState;
 
 const char* exception_as_cstr(ExceptionState exception);
@@ -149,12 +245,65 @@ typedef enum _INSTTYPE_ {
     INST_WRITE32,
     INST_WRITE64,
 
+    INST_BREAK,
+
+    INST_SPAWN,
+    INST_JOIN,
+    INST_ATOMADD,
+    INST_ATOMCAS,
+    INST_ATOMXCHG,
+    INST_FENCE,
+
+    INST_JEQ,
+    INST_JNE,
+    INST_JLTI,
+    INST_JLEI,
+    INST_JGTI,
+    INST_JGEI,
+    INST_JLTF,
+    INST_JLEF,
+    INST_JGTF,
+    INST_JGEF,
+    INST_JZ,
+
+    INST_ENTER,
+    INST_LEAVE,
+    INST_LOADL,
+    INST_STOREL,
+
+    INST_SQRTF,
+    INST_ABSF,
+    INST_FLOORF,
+    INST_CEILF,
+    INST_SINF,
+    INST_COSF,
+    INST_EXPF,
+    INST_LOGF,
+    INST_MINF,
+    INST_MAXF,
+    INST_FMAF,
+    INST_I2F,
+    INST_F2I,
+    INST_DIVS,
+    INST_MODS,
+    INST_GES,
+    INST_LES,
+    INST_SAR,
+    INST_ABSI,
+    INST_MINS,
+    INST_MAXS,
+
+    INST_COCREATE,
+    INST_CORESUME,
+    INST_YIELD,
+
     NUMBER_OF_INSTS
 } InstType;
 
 const char* InstName(InstType instType);
 bool GetInstName(StringView name, InstType* out);
 bool InstHasOperand(InstType instType);
+bool InstIsJump(InstType instType);
 
 typedef struct Inst {
     InstType type;
@@ -164,6 +313,8 @@ typedef struct Inst {
 typedef struct _LABEL_ {
     StringView name;
     Word word;
+    bool is_addr; // Bound to an instruction address rather than a %define value.
+    bool removed; // The code at the label was unreachable and removed by the optimizer.
 } Label;
 
 typedef struct DeferredOperand {
@@ -173,6 +324,37 @@ typedef struct DeferredOperand {
 
 typedef uint64_t MemoryAddr;
 
+typedef struct _MASM_INLINE_ {
+    StringView name;
+    StringView body; // Source lines between '%inline <name>' and '%end'.
+    StringView file;
+    int line;
+    size_t locals_begin; // Labels defined in the body, stored in Masm.inlineLocals.
+    size_t locals_size;
+} MasmInline;
+
+// A string literal or a %data array placed in the memory section, or a %bss region reserved behind it.
+typedef struct _MASM_DATA_ {
+    StringView name; // The %define, %data or %bss naming it, empty for literal operands.
+    MemoryAddr addr;
+    uint64_t size;
+    uint64_t align;  // Only used for reserved regions, which are placed when the whole source is read.
+    bool reserved;   // Zero-initialized, only its size is stored in the file.
+    bool removed;    // Unreferenced and dropped by the optimizer.
+} MasmData;
+
+// An instruction with a string literal operand.
+typedef struct _MASM_DATA_REF_ {
+    InstAddr inst;
+    size_t data;
+} MasmDataRef;
+
+typedef struct _MASM_FRAME_NAME_ {
+    StringView name;
+    uint64_t offset; // Signed offset from the frame pointer, used as the 'loadl'/'storel' operand.
+    bool is_arg;
+} MasmFrameName;
+
 typedef struct _MASM_ {
     Label labels[MASM_LABEL_CAPACITY];
     size_t labels_size;
@@ -180,6 +362,17 @@ typedef struct _MASM_ {
     DeferredOperand deferredOperands[MASM_DEFERRED_OPERANDS_CAPACITY];
     size_t deferredOperands_size;
 
+    MasmInline inlines[MASM_INLINES_CAPACITY];
+    size_t inlines_size;
+    StringView inlineLocals[MASM_INLINE_LOCALS_CAPACITY];
+    size_t inlineLocals_size;
+    size_t inlineExpansions_size;
+    size_t inline_depth;
+
+    // Names declared with %args and %locals for the current function.
+    MasmFrameName frameNames[MASM_FRAME_NAMES_CAPACITY];
+    size_t frameNames_size;
+
     char memarena[MASM_MEMARENA_CAPACITY];
     size_t memarena_size;
 
@@ -189,20 +382,91 @@ typedef struct _MASM_ {
     uint8_t memory[MVM_MEMORY_CAPACITY];
     size_t memory_size;
     size_t memory_capacity;
+    MasmData data[MASM_DATA_CAPACITY];
+    size_t data_size;
+    MasmDataRef dataRefs[MVM_PROGRAM_CAPACITY];
+    size_t dataRefs_size;
+
+    // Unreachable instructions and unreferenced bytes of data removed by the optimizer.
+    size_t shaken_insts;
+    uint64_t shaken_bytes;
+
+    StringView imports[MVM_IMPORTS_CAPACITY]; // Declared with %interrupt.
+    size_t imports_size;
+
+    uint8_t flags;
+    bool share_literals; // Set with -O, identical string literal operands share their bytes.
 } Masm;
 
 void* masm_memarenaAlloc(Masm* masm, size_t size);
 bool masm_resolveLabel(const Masm* masm, StringView name, Word* out);
 bool masm_bindLabel(Masm* masm, StringView name, Word word);
+bool masm_bindAddrLabel(Masm* masm, StringView name, InstAddr addr);
 void masm_pushDeferredOperand(Masm* masm, InstAddr addr, StringView label);
 StringView masm_slurpFile(Masm* masm, StringView file_path);
 Word masm_pushStringToMemory(Masm* masm, StringView string);
 bool masm_translateLiteral (Masm* masm, StringView sv, Word* out);
+const MasmInline* masm_findInline(const Masm* masm, StringView name);
+uint64_t masm_hashBytes(uint64_t hash, const void* data, size_t size);
+uint64_t masm_hashSourceFile(Masm* masm, StringView inputFile, uint64_t hash, size_t level);
 
 typedef struct _MVM_ Mvm;
 
 typedef ExceptionState (*MvmInterrupt)(Mvm*);
 
+typedef struct _MVM_NATIVE_ {
+    const char* name;
+    MvmInterrupt interrupt;
+} MvmNative;
+
+// Plugins loaded with 'mvm -p' export MVM_PLUGIN_ENTRY, which calls `claim` once for every
+// interrupt they provide. The interrupts are matched by name with the %interrupt imports of a program.
+#define MVM_PLUGIN_ENTRY "mvm_plugin"
+typedef bool (*MvmPlugin_Claim)(void* registry, const char* name, MvmInterrupt interrupt);
+typedef bool (*MvmPlugin_Entry)(void* registry, MvmPlugin_Claim claim);
+bool mvm_plugin(void* registry, MvmPlugin_Claim claim);
+
+typedef struct _MVM_SYMBOL_ {
+    StringView name; // Points into Mvm.symbolNames.
+    InstAddr addr;
+} MvmSymbol;
+
+// Header of a block allocated by 'alloc'. The blocks of a program are linked, so they can be freed with it.
+typedef struct _MVM_HEAP_BLOCK_ {
+    struct _MVM_HEAP_BLOCK_* prev;
+    struct _MVM_HEAP_BLOCK_* next;
+} MvmHeapBlock;
+static_assert(sizeof(MvmHeapBlock) % _Alignof(max_align_t) == 0, "Blocks have to keep the alignment of malloc!");
+
+typedef struct _MVM_FRAME_ {
+    uint64_t fp;     // Frame pointer of the caller.
+    uint64_t locals; // Locals reserved by 'enter'.
+} MvmFrame;
+
+// While a coroutine runs, its segment lies on top of the stacks of the resumer, starting at `base`, `rbase` and
+// `fbase`. Suspending it copies the segment out, frame pointers are kept relative to `base`.
+typedef struct _MVM_COROUTINE_ {
+    bool used;
+    bool running;
+    bool started;
+    InstAddr ip;     // Where it continues, the entry point until the first 'coresume'.
+    uint64_t parent; // Handle of the coroutine that resumed it, 0 for the program itself.
+
+    uint64_t base;
+    uint64_t rbase;
+    uint64_t fbase;
+    uint64_t callerFp;
+    InstAddr callerIp;
+
+    Word stack[MVM_COROUTINE_STACK_CAPACITY];
+    uint64_t stack_size;
+    InstAddr rstack[MVM_COROUTINE_STACK_CAPACITY];
+    uint64_t rstack_size;
+    MvmFrame frames[MVM_COROUTINE_STACK_CAPACITY];
+    uint64_t frames_size;
+    uint64_t fp;
+} MvmCoroutine;
+
 struct _MVM_ {
     Word stack[MVM_STACK_CAPACITY];
     uint64_t stack_size;
@@ -213,20 +477,109 @@ struct _MVM_ {
 
     MvmInterrupt interrupts[MVM_NATIVES_CAPACITY];
     size_t interrupts_size;
-
-    uint8_t memory[MVM_MEMORY_CAPACITY];
+    // Named interrupts the program expects from plugins, appended to the interrupts by mvm_linkImports.
+    char imports[MVM_IMPORTS_CAPACITY][MVM_IMPORT_NAME_CAPACITY];
+    size_t imports_size;
+
+    uint8_t* memory; // MVM_MEMORY_CAPACITY bytes, shared by all threads of a program.
+    uint64_t memory_size; // Size of the initialized memory section loaded with the program.
+    Mvm* root; // The VM that spawned the first thread, NULL for the main VM itself.
+
+    InstAddr rstack[MVM_RSTACK_CAPACITY];
+    uint64_t rstack_size;
+    uint8_t flags;
+
+    // Frames opened with 'enter', 'loadl' and 'storel' address the stack relative to `fp`.
+    MvmFrame frames[MVM_RSTACK_CAPACITY];
+    uint64_t frames_size;
+    uint64_t fp;
+
+    // Coroutines created with 'cocreate', allocated with the first one. Handles are their index plus one.
+    MvmCoroutine* coroutines;
+    uint64_t coroutine; // Handle of the running coroutine, 0 outside of coroutines.
+
+    // Code labels, only present if the program was assembled with symbols.
+    MvmSymbol symbols[MVM_SYMBOLS_CAPACITY];
+    size_t symbols_size;
+    char symbolNames[MVM_SYMBOL_NAMES_CAPACITY];
+    size_t symbolNames_size;
+
+    uint64_t heap_allocated; // Bytes allocated by the 'alloc' interrupt so far.
+    uint64_t heap_blocks;    // Blocks allocated and not yet freed.
+    MvmHeapBlock* heap;      // Blocks of all threads, only used by the root VM.
+
+    // Execution limits, only checked when entering a new straight-line run if `metered` is set.
+    bool metered;
+    uint64_t fuel;                // Leased from the `fuel_pool` of the root VM, unless MVM_FUEL_UNLIMITED.
+    _Atomic uint64_t fuel_pool;   // Budget of all threads that is not leased yet, only used by the root VM.
+    uint32_t fuel_cost[MVM_PROGRAM_CAPACITY]; // Instructions from an address up to the next control transfer.
+    _Atomic uint8_t deadline_expired;         // Set by a timer thread.
+
+    // Spawned threads of the program, only used by the root VM and guarded by the lock of mvm_park.
+    uint64_t threads_running; // Spawned and not stopped yet.
+    uint64_t threads_joining; // Waiting in 'join' for a running thread.
+    uint64_t threads_parked;  // Parked on a channel since `parked_epoch`, including the main thread.
+    uint64_t parked_epoch;
+    bool thread_failed;       // A spawned thread stopped with an exception.
 
     bool halt;
 };
 
-void masm_saveToFile(Masm* masm, const char* filePathm, bool wos);
-
+void masm_saveToFile(Masm* masm, const char* filePathm, bool wos, bool symbols);
+size_t masm_optimize(Masm* masm);
+// Profiles are written by 'mvm -P' and read by 'masm -P'. Every line holds the location of an instruction,
+// a code label with an optional '+offset' or a plain address, and how often it was executed. These are the first
+// instructions of the basic blocks and the conditional jumps, which are followed by how often the jump was taken.
+void masm_loadProfile(Masm* masm, const char* filePath, uint64_t* counts, uint64_t* taken);
+size_t masm_layoutByProfile(Masm* masm, const uint64_t* counts, const uint64_t* taken);
+
+void mvm_initMemory(Mvm* mvm);
+ExceptionState mvm_spawn(Mvm* mvm, InstAddr entry);
+ExceptionState mvm_join(Mvm* mvm);
+ExceptionState mvm_enterFrame(Mvm* mvm, uint64_t locals);
+ExceptionState mvm_leaveFrame(Mvm* mvm, uint64_t args);
+ExceptionState mvm_coCreate(Mvm* mvm, InstAddr entry);
+ExceptionState mvm_coResume(Mvm* mvm);
+ExceptionState mvm_coYield(Mvm* mvm);
+ExceptionState mvm_coReturn(Mvm* mvm);
+void mvm_freeCoroutines(Mvm* mvm);
+// Stops the threads spawned by the program of the root VM `mvm` at their next charge of fuel and joins them.
+// Threads that are not metered are only stopped by a channel or file they wait for.
+void mvm_stopThreads(Mvm* mvm);
+// Frees the blocks the program of the root VM `mvm` allocated and did not free.
+void mvm_freeHeap(Mvm* mvm);
+// Runs a spawned thread, tools that execute programs differently (e.g. mbc2c) can replace it.
+extern ExceptionState (*mvm_threadMain)(Mvm* mvm);
+uint64_t mvm_channelCreate(const Mvm* mvm, uint64_t capacity);
+ExceptionState mvm_channelSend(Mvm* mvm, uint64_t handle, Word value, Word size);
+ExceptionState mvm_channelRecv(Mvm* mvm, uint64_t handle, Word* value, Word* size);
+// Frees the channels created by the threads of `mvm`. None of them may still be running.
+void mvm_freeChannels(const Mvm* mvm);
 void mvm_pushInterrupt(Mvm* mvm, MvmInterrupt interrupt);
+void mvm_pushStdInterrupts(Mvm* mvm);
+void mvm_linkImports(Mvm* mvm, const MvmNative* natives, size_t natives_size);
+void mvm_initStringKernels(void);
 void mvm_dumpStack(FILE *stream, const Mvm* mvm);
+void mvm_dumpCallStack(FILE *stream, const Mvm* mvm);
+void mvm_dumpMemory(FILE *stream, const Mvm* mvm, MemoryAddr addr, uint64_t size);
 void mvm_loadProgramFromFile(Mvm* mvm, const char* filePath);
+// Like mvm_loadProgramFromFile, but describes what is wrong with the file in `error` instead of exiting.
+bool mvm_readProgramFile(Mvm* mvm, const char* filePath, char* error, size_t errorSize);
+void mvm_loadProgramFromMasm(Mvm* mvm, const Masm* masm);
+bool mvm_pushSymbol(Mvm* mvm, StringView name, InstAddr addr);
+bool mvm_pushImport(Mvm* mvm, StringView name);
+bool mvm_resolveSymbol(const Mvm* mvm, StringView name, InstAddr* out);
+const MvmSymbol* mvm_findSymbol(const Mvm* mvm, InstAddr addr);
 void mvm_translateSourceFile(Masm* masm, StringView inputFile, size_t level);
+void mvm_setFuel(Mvm* mvm, uint64_t fuel);
+ExceptionState mvm_chargeFuel(Mvm* mvm);
 ExceptionState mvm_execInst(Mvm* mvm);
-ExceptionState mvm_execProgram(Mvm* mvm, int limit);
+// Like mvm_execInst, but memory instructions don't check their address. Only for memory that is
+// followed by 4 GB of faulting pages beyond its capacity (see 'mvm -gm').
+ExceptionState mvm_execInstGuarded(Mvm* mvm);
+ExceptionState mvm_execProgram(Mvm* mvm);
+ExceptionState mvm_execProgramProfiled(Mvm* mvm, uint64_t* counts, uint64_t* taken);
+void mvm_saveProfile(const Mvm* mvm, const uint64_t* counts, const uint64_t* taken, const char* filePath);
 
 PACK(struct _MVMFILE_META_ {
     uint16_t os;
@@ -236,9 +589,230 @@ PACK(struct _MVMFILE_META_ {
     uint64_t memory_size;
     uint64_t memory_capacity;
     uint8_t wos;
+    uint8_t flags;
+    uint64_t symbols_size; // Bytes of symbols following the memory section.
+    uint64_t imports_size; // Number of interrupt imports following the symbols.
 });
 typedef struct _MVMFILE_META_ MvmFile_Meta;
 
+// Each symbol is stored as its address, the length of its name and the name itself.
+PACK(struct _MVMFILE_SYMBOL_ {
+    uint64_t addr;
+    uint16_t name_size;
+});
+typedef struct _MVMFILE_SYMBOL_ MvmFile_Symbol;
+
+// Each import is stored as the length of its name and the name itself.
+PACK(struct _MVMFILE_IMPORT_ {
+    uint16_t name_size;
+});
+typedef struct _MVMFILE_IMPORT_ MvmFile_Import;
+
+// A trace file starts with this header, followed by the program and the initial memory section,
+// followed by one record per executed instruction.
+PACK(struct _MVMTRACE_HEADER_ {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t flags;
+    uint64_t program_size;
+    uint64_t memory_size;
+});
+typedef struct _MVMTRACE_HEADER_ MvmTrace_Header;
+
+// Each record is followed by `words` payload words:
+// the address and the value for write instructions, the pushed words for interrupts.
+// Memory written by an interrupt follows its record as MVM_TRACE_MEMORY records, their payload is
+// the address and the `top` written bytes.
+PACK(struct _MVMTRACE_RECORD_ {
+    uint32_t ip;
+    uint16_t words;
+    int16_t stack_delta;
+    uint8_t type;
+    uint8_t state; // ExceptionState, only the last record of a failed program has one.
+    uint64_t top; // Top of the stack after the instruction, 0 if the stack is empty.
+});
+typedef struct _MVMTRACE_RECORD_ MvmTrace_Record;
+
+// A job sent to 'mvm -S' is this header, followed by `stack_size` words that are pushed
+// before the program starts and `input_size` bytes that the program reads from stdin.
+PACK(struct _MVMJOB_HEADER_ {
+    uint32_t magic;
+    uint32_t stack_size;
+    uint64_t input_size;
+});
+typedef struct _MVMJOB_HEADER_ MvmJob_Header;
+
+// The answer to a job is this header, followed by `output_size` bytes the program wrote to stdout
+// and the `stack_size` words left on the stack (bottom first).
+PACK(struct _MVMJOB_RESULT_ {
+    uint32_t magic;
+    uint32_t state; // ExceptionState
+    uint64_t output_size;
+    uint64_t stack_size;
+});
+typedef struct _MVMJOB_RESULT_ MvmJob_Result;
+
+typedef struct _MVMTRACE_ {
+    FILE* file;
+    const char* filePath;
+    uint8_t buffer[MVM_TRACE_BUFFER_CAPACITY];
+    size_t buffer_size;
+    uint8_t* shadow; // The memory as replaying the trace reconstructs it.
+} MvmTrace;
+
+void mvm_traceOpen(MvmTrace* trace, const Mvm* mvm, const char* filePath);
+void mvm_traceClose(MvmTrace* trace);
+ExceptionState mvm_execProgramTraced(Mvm* mvm, MvmTrace* trace);
+
+typedef enum _MVM_STATS_STATE_ {
+    MVM_STATS_RUNNING = 0,
+    MVM_STATS_HALTED,
+    MVM_STATS_FAILED,
+} MvmStatsState;
+
+// Live statistics of a running program, meant to be placed in a file mapped into memory
+// so other processes (e.g. mvmtop) can read it. Counters are written with relaxed atomics.
+typedef struct _MVM_STATS_ {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t pid;
+    uint64_t started_ms; // Wall clock time in milliseconds since the epoch.
+    _Atomic uint64_t updated_ms;
+    _Atomic uint64_t state;
+    _Atomic uint64_t insts_retired;
+    _Atomic uint64_t insts_per_sec;
+    _Atomic uint64_t stack_size;
+    _Atomic uint64_t stack_max;
+    _Atomic uint64_t rstack_size;
+    _Atomic uint64_t memory_size;
+    _Atomic uint64_t heap_allocated;
+    _Atomic uint64_t heap_blocks;
+    _Atomic uint64_t interrupts[MVM_NATIVES_CAPACITY]; // Calls per interrupt vector.
+} MvmStats;
+
+uint64_t mvm_nowMs(void);
+void mvm_statsInit(MvmStats* stats, const Mvm* mvm, uint64_t pid);
+ExceptionState mvm_execProgramStats(Mvm* mvm, MvmStats* stats);
+
+// Typed interrupt bindings. MVM_BINDn(name, ret, fn, types...) defines the interrupt `name`, which checks
+// the stack once, decodes n arguments and calls `ExceptionState fn(Mvm*, args... [, ret* result])`.
+// The arguments are popped and the result is pushed only if fn succeeds. The last argument is the top of the stack.
+//   u64, i64, f64  One word.
+//   mem            One word, an address into the memory, passed as `uint8_t*`.
+//   span           Two words `addr, size`, passed as MvmSpan, the whole range lies in the memory.
+// `ret` is one of u64, i64, f64 or void.
+typedef struct _MVM_SPAN_ {
+    uint8_t* data;
+    uint64_t size;
+} MvmSpan;
+
+typedef uint64_t MvmArg_u64;
+typedef int64_t MvmArg_i64;
+typedef double MvmArg_f64;
+typedef uint8_t* MvmArg_mem;
+typedef MvmSpan MvmArg_span;
+
+#define MVM_WORDS_u64 1
+#define MVM_WORDS_i64 1
+#define MVM_WORDS_f64 1
+#define MVM_WORDS_mem 1
+#define MVM_WORDS_span 2
+
+static inline bool mvm_decode_u64(Mvm* mvm, const Word* w, uint64_t* out) { (void)mvm; *out = w->as_u64; return true; }
+static inline bool mvm_decode_i64(Mvm* mvm, const Word* w, int64_t* out) { (void)mvm; *out = w->as_i64; return true; }
+static inline bool mvm_decode_f64(Mvm* mvm, const Word* w, double* out) { (void)mvm; *out = w->as_f64; return true; }
+
+static inline bool mvm_decode_mem(Mvm* mvm, const Word* w, uint8_t** out)
+{
+    if (w->as_u64 >= MVM_MEMORY_CAPACITY) {
+        return false;
+    }
+    *out = &mvm->memory[w->as_u64];
+    return true;
+}
+
+static inline bool mvm_decode_span(Mvm* mvm, const Word* w, MvmSpan* out)
+{
+    if (w[0].as_u64 > MVM_MEMORY_CAPACITY || w[1].as_u64 > MVM_MEMORY_CAPACITY - w[0].as_u64) {
+        return false;
+    }
+    *out = (MvmSpan) {.data = &mvm->memory[w[0].as_u64], .size = w[1].as_u64};
+    return true;
+}
+
+#define MVM_RESULT_void(result)
+#define MVM_RESULT_u64(result) , &(result).as_u64
+#define MVM_RESULT_i64(result) , &(result).as_i64
+#define MVM_RESULT_f64(result) , &(result).as_f64
+#define MVM_PUSHES_void 0
+#define MVM_PUSHES_u64 1
+#define MVM_PUSHES_i64 1
+#define MVM_PUSHES_f64 1
+
+#define MVM_BIND_BEGIN(words)                                                   \
+    const uint64_t bindWords = (words);                                         \
+    if (mvm->stack_size < bindWords) {                                          \
+        return EXCEPTION_STACK_UNDERFLOW;                                       \
+    }                                                                           \
+    const Word* bindArgs = &mvm->stack[mvm->stack_size - bindWords];            \
+    Word bindResult = {0};                                                      \
+    (void)bindArgs
+
+#define MVM_BIND_DECODE(type, offset, arg)                                      \
+    MvmArg_##type arg;                                                          \
+    if (!mvm_decode_##type(mvm, &bindArgs[offset], &arg)) {                     \
+        return EXCEPTION_MEMORY_ACCESS_VIOLATION;                               \
+    }
+
+#define MVM_BIND_END(ret, call)                                                 \
+    const ExceptionState bindErr = (call);                                      \
+    if (bindErr != EXCEPTION_SATE_OK) {                                         \
+        return bindErr;                                                         \
+    }                                                                           \
+    mvm->stack_size -= bindWords;                                               \
+    if (MVM_PUSHES_##ret) {                                                     \
+        if (mvm->stack_size >= MVM_STACK_CAPACITY) {                            \
+            return EXCEPTION_STACK_OVERFLOW;                                    \
+        }                                                                       \
+        mvm->stack[mvm->stack_size++] = bindResult;                             \
+    }                                                                           \
+    return EXCEPTION_SATE_OK
+
+#define MVM_BIND0(name, ret, fn)                                                \
+    ExceptionState name(Mvm* mvm)                                               \
+    {                                                                           \
+        MVM_BIND_BEGIN(0);                                                      \
+        MVM_BIND_END(ret, fn(mvm MVM_RESULT_##ret(bindResult)));                \
+    }
+
+#define MVM_BIND1(name, ret, fn, t1)                                            \
+    ExceptionState name(Mvm* mvm)                                               \
+    {                                                                           \
+        MVM_BIND_BEGIN(MVM_WORDS_##t1);                                         \
+        MVM_BIND_DECODE(t1, 0, a1)                                              \
+        MVM_BIND_END(ret, fn(mvm, a1 MVM_RESULT_##ret(bindResult)));            \
+    }
+
+#define MVM_BIND2(name, ret, fn, t1, t2)                                        \
+    ExceptionState name(Mvm* mvm)                                               \
+    {                                                                           \
+        MVM_BIND_BEGIN(MVM_WORDS_##t1 + MVM_WORDS_##t2);                        \
+        MVM_BIND_DECODE(t1, 0, a1)                                              \
+        MVM_BIND_DECODE(t2, MVM_WORDS_##t1, a2)                                 \
+        MVM_BIND_END(ret, fn(mvm, a1, a2 MVM_RESULT_##ret(bindResult)));        \
+    }
+
+#define MVM_BIND3(name, ret, fn, t1, t2, t3)                                    \
+    ExceptionState name(Mvm* mvm)                                               \
+    {                                                                           \
+        MVM_BIND_BEGIN(MVM_WORDS_##t1 + MVM_WORDS_##t2 + MVM_WORDS_##t3);       \
+        MVM_BIND_DECODE(t1, 0, a1)                                              \
+        MVM_BIND_DECODE(t2, MVM_WORDS_##t1, a2)                                 \
+        MVM_BIND_DECODE(t3, MVM_WORDS_##t1 + MVM_WORDS_##t2, a3)                \
+        MVM_BIND_END(ret, fn(mvm, a1, a2, a3 MVM_RESULT_##ret(bindResult)));    \
+    }
+
 ////////////////////////////////////////////
 ExceptionState interrupt_PRINTchar (Mvm* mvm);
 ExceptionState interrupt_PRINTf64 (Mvm* mvm);
@@ -250,12 +824,43 @@ ExceptionState interrupt_FREE (Mvm* mvm);
 ExceptionState interrupt_DUMPMEM (Mvm* mvm);
 ExceptionState interrupt_WRITE (Mvm* mvm);
 ExceptionState interrupt_READLINE (Mvm* mvm);
+ExceptionState interrupt_CHANCREATE(Mvm* mvm);
+ExceptionState interrupt_CHANSEND(Mvm* mvm);
+ExceptionState interrupt_CHANRECV(Mvm* mvm);
+ExceptionState interrupt_CHANSENDBLK(Mvm* mvm);
+ExceptionState interrupt_CHANRECVBLK(Mvm* mvm);
+ExceptionState interrupt_STRLEN(Mvm* mvm);
+ExceptionState interrupt_STRTRANSLATE(Mvm* mvm);
+ExceptionState interrupt_STRFIND(Mvm* mvm);
+ExceptionState interrupt_STRCOUNT(Mvm* mvm);
+ExceptionState interrupt_U64TOSTR(Mvm* mvm);
+ExceptionState interrupt_STRTOU64(Mvm* mvm);
+ExceptionState interrupt_FILEOPEN(Mvm* mvm);
+ExceptionState interrupt_FILECLOSE(Mvm* mvm);
+ExceptionState interrupt_FILEREAD(Mvm* mvm);
+ExceptionState interrupt_FILEWRITE(Mvm* mvm);
+ExceptionState interrupt_FILESIZE(Mvm* mvm);
+ExceptionState interrupt_FILEMAP(Mvm* mvm);
+ExceptionState interrupt_FILEUNMAP(Mvm* mvm);
+ExceptionState interrupt_AIOREAD(Mvm* mvm);
+ExceptionState interrupt_AIOWRITE(Mvm* mvm);
+ExceptionState interrupt_AIOPOLL(Mvm* mvm);
+ExceptionState interrupt_AIOWAIT(Mvm* mvm);
+// Waits for all asynchronous file requests, then closes all files and unmaps all mapped files.
+void mvm_closeFiles(void);
+bool mvm_setFileRoot(const char* root);
+// True while asynchronous file requests are in flight, they may still write to the memory.
+bool mvm_filesPending(void);
 ////////////////////////////////////////////
 
 char* shift(int* argc, char*** argv);
 #endif //MVM_SHARED_H
 
 #ifdef MVM_SHARED_IMPLEMENTATION
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#   include <immintrin.h>
+#   define MVM_X86_SIMD
+#endif
 
 Word word_u64(uint64_t value)
 {
@@ -277,6 +882,39 @@ Word word_ptr(void* value)
     return (Word) {.as_ptr = value};
 }
 
+Word mvm_divS(Word a, Word b)
+{
+    return b.as_i64 == -1 ? word_u64(0 - a.as_u64) : word_i64(a.as_i64 / b.as_i64);
+}
+
+Word mvm_modS(Word a, Word b)
+{
+    return b.as_i64 == -1 ? word_u64(0) : word_i64(a.as_i64 % b.as_i64);
+}
+
+Word mvm_sar(Word a, Word b)
+{
+    if (b.as_u64 >= 64) {
+        return word_i64(a.as_i64 < 0 ? -1 : 0);
+    }
+    return word_i64(a.as_i64 >> b.as_u64);
+}
+
+// Truncates towards zero and saturates at the limits of int64_t.
+int64_t mvm_f64ToI64(double value)
+{
+    if (value != value) {
+        return 0;
+    }
+    if (value >= 9223372036854775808.0) {
+        return INT64_MAX;
+    }
+    if (value < -9223372036854775808.0) {
+        return INT64_MIN;
+    }
+    return (int64_t)value;
+}
+
 StringView cstr_as_sv(const char* cstr)
 {
     return (StringView) {
@@ -358,6 +996,14 @@ const char* exception_as_cstr(ExceptionState exception)
         case EXCEPTION_ILLEGAL_OPERAND:         return "EXCEPTION_ILLEGAL_OPERAND";
         case EXCEPTION_MEMORY_ACCESS_VIOLATION: return "EXCEPTION_MEMORY_ACCESS_VIOLATION";
         case EXCEPTION_INTERRUPT_FAILED:        return "EXCEPTION_INTERRUPT_FAILED";
+        case EXCEPTION_RSTACK_OVERFLOW:         return "EXCEPTION_RSTACK_OVERFLOW";
+        case EXCEPTION_RSTACK_UNDERFLOW:        return "EXCEPTION_RSTACK_UNDERFLOW";
+        case EXCEPTION_BREAKPOINT:              return "EXCEPTION_BREAKPOINT";
+        case EXCEPTION_OUT_OF_FUEL:             return "EXCEPTION_OUT_OF_FUEL";
+        case EXCEPTION_TIMEOUT:                 return "EXCEPTION_TIMEOUT";
+        case EXCEPTION_THREAD_FAILED:           return "EXCEPTION_THREAD_FAILED";
+        case EXCEPTION_COROUTINE_FAILED:        return "EXCEPTION_COROUTINE_FAILED";
+        case EXCEPTION_DEADLOCK:                return "EXCEPTION_DEADLOCK";
         default:
             fprintf(stderr, "ERROR: Encountered unknown Exception type!");
             exit(1);
@@ -409,6 +1055,52 @@ const char* InstName(InstType instType)
         case INST_WRITE16: return "write16";
         case INST_WRITE32: return "write32";
         case INST_WRITE64: return "write64";
+        case INST_BREAK:   return "brk";
+        case INST_SPAWN:   return "spawn";
+        case INST_JOIN:    return "join";
+        case INST_ATOMADD: return "atomadd";
+        case INST_ATOMCAS: return "atomcas";
+        case INST_ATOMXCHG: return "atomxchg";
+        case INST_FENCE:   return "fence";
+        case INST_JEQ:    return "jeq";
+        case INST_JNE:    return "jne";
+        case INST_JLTI:   return "jlti";
+        case INST_JLEI:   return "jlei";
+        case INST_JGTI:   return "jgti";
+        case INST_JGEI:   return "jgei";
+        case INST_JLTF:   return "jltf";
+        case INST_JLEF:   return "jlef";
+        case INST_JGTF:   return "jgtf";
+        case INST_JGEF:   return "jgef";
+        case INST_JZ:     return "jz";
+        case INST_ENTER:  return "enter";
+        case INST_LEAVE:  return "leave";
+        case INST_LOADL:  return "loadl";
+        case INST_STOREL: return "storel";
+        case INST_SQRTF:  return "sqrtf";
+        case INST_ABSF:   return "absf";
+        case INST_FLOORF: return "floorf";
+        case INST_CEILF:  return "ceilf";
+        case INST_SINF:   return "sinf";
+        case INST_COSF:   return "cosf";
+        case INST_EXPF:   return "expf";
+        case INST_LOGF:   return "logf";
+        case INST_MINF:   return "minf";
+        case INST_MAXF:   return "maxf";
+        case INST_FMAF:   return "fmaf";
+        case INST_I2F:    return "i2f";
+        case INST_F2I:    return "f2i";
+        case INST_DIVS:   return "divs";
+        case INST_MODS:   return "mods";
+        case INST_GES:    return "geeqs";
+        case INST_LES:    return "leeqs";
+        case INST_SAR:    return "sar";
+        case INST_ABSI:   return "absi";
+        case INST_MINS:   return "mins";
+        case INST_MAXS:   return "maxs";
+        case INST_COCREATE: return "cocreate";
+        case INST_CORESUME: return "coresume";
+        case INST_YIELD:  return "yield";
         case NUMBER_OF_INSTS:
         default:
             fprintf(stderr, "ERROR: Encountered unknown instruction!");
@@ -470,6 +1162,151 @@ bool InstHasOperand(InstType instType)
         case INST_WRITE16: return false;
         case INST_WRITE32: return false;
         case INST_WRITE64: return false;
+        case INST_BREAK:   return false;
+        case INST_SPAWN:   return true;
+        case INST_JOIN:    return false;
+        case INST_ATOMADD: return false;
+        case INST_ATOMCAS: return false;
+        case INST_ATOMXCHG: return false;
+        case INST_FENCE:   return false;
+        case INST_JEQ:    return true;
+        case INST_JNE:    return true;
+        case INST_JLTI:   return true;
+        case INST_JLEI:   return true;
+        case INST_JGTI:   return true;
+        case INST_JGEI:   return true;
+        case INST_JLTF:   return true;
+        case INST_JLEF:   return true;
+        case INST_JGTF:   return true;
+        case INST_JGEF:   return true;
+        case INST_JZ:     return true;
+        case INST_ENTER:  return true;
+        case INST_LEAVE:  return true;
+        case INST_LOADL:  return true;
+        case INST_STOREL: return true;
+        case INST_SQRTF:  return false;
+        case INST_ABSF:   return false;
+        case INST_FLOORF: return false;
+        case INST_CEILF:  return false;
+        case INST_SINF:   return false;
+        case INST_COSF:   return false;
+        case INST_EXPF:   return false;
+        case INST_LOGF:   return false;
+        case INST_MINF:   return false;
+        case INST_MAXF:   return false;
+        case INST_FMAF:   return false;
+        case INST_I2F:    return false;
+        case INST_F2I:    return false;
+        case INST_DIVS:   return false;
+        case INST_MODS:   return false;
+        case INST_GES:    return false;
+        case INST_LES:    return false;
+        case INST_SAR:    return false;
+        case INST_ABSI:   return false;
+        case INST_MINS:   return false;
+        case INST_MAXS:   return false;
+        case INST_COCREATE: return true;
+        case INST_CORESUME: return false;
+        case INST_YIELD:  return false;
+        case NUMBER_OF_INSTS:
+        default:
+            fprintf(stderr, "ERROR: Encountered unknown instruction!");
+            exit(1);
+    }
+}
+
+// Returns true if the operand of the instruction is an instruction address.
+bool InstIsJump(InstType instType)
+{
+    switch (instType) {
+        case INST_JMP:
+        case INST_JMPIF:
+        case INST_CALL:
+        case INST_SPAWN:
+        case INST_COCREATE:
+        case INST_JEQ:
+        case INST_JNE:
+        case INST_JLTI:
+        case INST_JLEI:
+        case INST_JGTI:
+        case INST_JGEI:
+        case INST_JLTF:
+        case INST_JLEF:
+        case INST_JGTF:
+        case INST_JGEF:
+        case INST_JZ:
+            return true;
+        case INST_NOP:
+        case INST_PUSH:
+        case INST_DUP:
+        case INST_SWAP:
+        case INST_DROP:
+        case INST_PLUSI:
+        case INST_MINUSI:
+        case INST_MULTI:
+        case INST_DIVI:
+        case INST_MODI:
+        case INST_PLUSF:
+        case INST_MINUSF:
+        case INST_MULTF:
+        case INST_DIVF:
+        case INST_ANDB:
+        case INST_ORB:
+        case INST_XOR:
+        case INST_NOTB:
+        case INST_SHR:
+        case INST_SHL:
+        case INST_INT:
+        case INST_RET:
+        case INST_EQ:
+        case INST_NOT:
+        case INST_GEF:
+        case INST_GEI:
+        case INST_LEF:
+        case INST_LEI:
+        case INST_HALT:
+        case INST_READ8:
+        case INST_READ16:
+        case INST_READ32:
+        case INST_READ64:
+        case INST_WRITE8:
+        case INST_WRITE16:
+        case INST_WRITE32:
+        case INST_WRITE64:
+        case INST_BREAK:
+        case INST_JOIN:
+        case INST_ATOMADD:
+        case INST_ATOMCAS:
+        case INST_ATOMXCHG:
+        case INST_FENCE:
+        case INST_ENTER:
+        case INST_LEAVE:
+        case INST_LOADL:
+        case INST_STOREL:
+        case INST_SQRTF:
+        case INST_ABSF:
+        case INST_FLOORF:
+        case INST_CEILF:
+        case INST_SINF:
+        case INST_COSF:
+        case INST_EXPF:
+        case INST_LOGF:
+        case INST_MINF:
+        case INST_MAXF:
+        case INST_FMAF:
+        case INST_I2F:
+        case INST_F2I:
+        case INST_DIVS:
+        case INST_MODS:
+        case INST_GES:
+        case INST_LES:
+        case INST_SAR:
+        case INST_ABSI:
+        case INST_MINS:
+        case INST_MAXS:
+        case INST_CORESUME:
+        case INST_YIELD:
+            return false;
         case NUMBER_OF_INSTS:
         default:
             fprintf(stderr, "ERROR: Encountered unknown instruction!");
@@ -477,6 +1314,12 @@ bool InstHasOperand(InstType instType)
     }
 }
 
+// Conditional jumps, they continue either at their operand or at the next instruction.
+static bool mvm_isBranch(InstType type)
+{
+    return InstIsJump(type) && type != INST_JMP && type != INST_CALL && type != INST_SPAWN && type != INST_COCREATE;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 
 void* masm_memarenaAlloc(Masm* masm, size_t size)
@@ -514,6 +1357,15 @@ bool masm_bindLabel(Masm* masm, StringView name, Word word)
     return false;
 }
 
+bool masm_bindAddrLabel(Masm* masm, StringView name, InstAddr addr)
+{
+    if (!masm_bindLabel(masm, name, word_u64(addr))) {
+        return false;
+    }
+    masm->labels[masm->labels_size - 1].is_addr = true;
+    return true;
+}
+
 void masm_pushDeferredOperand(Masm* masm, InstAddr addr, StringView label)
 {
     if (masm->deferredOperands_size >= MASM_DEFERRED_OPERANDS_CAPACITY) {
@@ -585,6 +1437,12 @@ Word masm_pushStringToMemory(Masm* masm, StringView string)
         exit(1);
     }
 
+    if (masm->data_size >= MASM_DATA_CAPACITY) {
+        fprintf(stderr, "ERROR: Too many strings! : The max amount of strings is %d.\n", MASM_DATA_CAPACITY);
+        exit(1);
+    }
+    masm->data[masm->data_size++] = (MasmData) {.addr = masm->memory_size, .size = string.count};
+
     Word res = word_u64(masm->memory_size);
     memcpy(masm->memory + masm->memory_size, string.data, string.count);
     masm->memory_size += string.count;
@@ -623,9 +1481,60 @@ bool masm_translateLiteral (Masm* masm, StringView sv, Word* out)
     return true;
 }
 
+uint64_t masm_hashBytes(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= MASM_HASH_PRIME;
+    }
+    return hash;
+}
+
+// Hashes the source file together with the contents of all files it includes (transitively),
+// in the same order mvm_translateSourceFile would visit them.
+uint64_t masm_hashSourceFile(Masm* masm, StringView inputFile, uint64_t hash, size_t level)
+{
+    StringView source = masm_slurpFile(masm, inputFile);
+    hash = masm_hashBytes(hash, &source.count, sizeof(source.count));
+    hash = masm_hashBytes(hash, source.data, source.count);
+
+    int lineNum = 0;
+    while (source.count > 0) {
+        StringView line = sv_trim(sv_chopByDelim(&source, '\n'));
+        lineNum += 1;
+        if (line.count == 0 || *line.data != MASM_PP_SYMBOL) {
+            continue;
+        }
+        StringView token = sv_chopByDelim(&line, ' ');
+        if (!sv_eq(token, cstr_as_sv("%include"))) {
+            continue;
+        }
+        line = sv_trim(line);
+        if (line.count >= 2 && *line.data == '"' && line.data[line.count - 1] == '"') {
+            line.data += 1;
+            line.count -= 2;
+
+            if (level + 1 < MASM_MAX_INCLUDES) {
+                hash = masm_hashSourceFile(masm, line, hash, level + 1);
+            } else {
+                fprintf(stderr, "%" PRIsv ":%d: ERROR: Exceeded maximum-include-level!\n", SV_FORMAT(inputFile), lineNum);
+                exit(1);
+            }
+        }
+    }
+    return hash;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void masm_saveToFile(Masm* masm, const char* filePath, bool wos)
+// Only code labels end up in the symbol section of a .mbc file.
+static bool masm_isSymbol(const Label* label)
+{
+    return label->is_addr && label->name.count <= UINT16_MAX;
+}
+
+void masm_saveToFile(Masm* masm, const char* filePath, bool wos, bool symbols)
 {
     FILE* f = fopen(filePath, "wb");
     if (f == NULL) {
@@ -633,16 +1542,32 @@ void masm_saveToFile(Masm* masm, const char* filePath, bool wos)
         exit(1);
     }
 
+    // Zeros at the end of the memory section are part of the capacity, the loader clears the memory anyway.
+    size_t memorySize = masm->memory_size;
+    while (memorySize > 0 && masm->memory[memorySize - 1] == 0) {
+        memorySize -= 1;
+    }
+
     MvmFile_Meta meta = {
             .os = OS,
             .version = MVM_FILE_VERSION,
             .magic = MVM_FILE_MAGIC,
             .program_size = masm->program_size,
-            .memory_size = masm->memory_size,
+            .memory_size = memorySize,
             .memory_capacity = masm->memory_capacity,
-            .wos = wos
+            .wos = wos,
+            .flags = masm->flags,
+            .imports_size = masm->imports_size
     };
 
+    if (symbols) {
+        for (size_t i = 0; i < masm->labels_size; ++i) {
+            if (masm_isSymbol(&masm->labels[i])) {
+                meta.symbols_size += sizeof(MvmFile_Symbol) + masm->labels[i].name.count;
+            }
+        }
+    }
+
     fwrite(&meta, sizeof(meta), 1, f);
     if (ferror(f)) {
         fprintf(stderr, "ERROR: Could not write META to file '%s'! : %s\n", filePath, strerror(errno));
@@ -655,906 +1580,4991 @@ void masm_saveToFile(Masm* masm, const char* filePath, bool wos)
         exit(1);
     }
 
-    fwrite(masm->memory, sizeof(masm->memory[0]), masm->memarena_size, f);
+    fwrite(masm->memory, sizeof(masm->memory[0]), memorySize, f);
     if (ferror(f)) {
         fprintf(stderr, "ERROR: Could not write MASM_MEMORY to file '%s'! : %s\n", filePath, strerror(errno));
         exit(1);
     }
 
-    fclose(f);
-}
+    for (size_t i = 0; symbols && i < masm->labels_size; ++i) {
+        const Label* label = &masm->labels[i];
+        if (!masm_isSymbol(label)) {
+            continue;
+        }
+        MvmFile_Symbol symbol = {
+                .addr = label->word.as_u64,
+                .name_size = (uint16_t)label->name.count
+        };
+        fwrite(&symbol, sizeof(symbol), 1, f);
+        fwrite(label->name.data, 1, label->name.count, f);
+        if (ferror(f)) {
+            fprintf(stderr, "ERROR: Could not write MASM_SYMBOLS to file '%s'! : %s\n", filePath, strerror(errno));
+            exit(1);
+        }
+    }
 
-void mvm_pushInterrupt(Mvm* mvm, MvmInterrupt interrupt)
-{
-    if (mvm->interrupts_size >= MVM_NATIVES_CAPACITY) {
-        fprintf(stderr, "ERROR: Failed to build interrupt table!");
-        exit(1);
+    for (size_t i = 0; i < masm->imports_size; ++i) {
+        MvmFile_Import import = {.name_size = (uint16_t)masm->imports[i].count};
+        fwrite(&import, sizeof(import), 1, f);
+        fwrite(masm->imports[i].data, 1, masm->imports[i].count, f);
+        if (ferror(f)) {
+            fprintf(stderr, "ERROR: Could not write MASM_IMPORTS to file '%s'! : %s\n", filePath, strerror(errno));
+            exit(1);
+        }
     }
-    mvm->interrupts[mvm->interrupts_size++] = interrupt;
+
+    fclose(f);
 }
 
-void mvm_dumpStack(FILE *stream, const Mvm* mvm)
+// Evaluates `a b <type>` at assembly time exactly like mvm_execInst would, `b` being the top of the stack.
+static bool masm_foldBinary(InstType type, Word a, Word b, Word* out)
 {
-    fprintf(stream, "STACK:\n");
-    if (mvm->stack_size > 0) {
-        for (InstAddr i = 0; i < mvm->stack_size; ++i) {
-            fprintf(stream, "  u64: %" PRIu64 " | i64: %" PRId64 " | f64: %lf",
-                    mvm->stack[i].as_u64,
-                    mvm->stack[i].as_i64,
-                    mvm->stack[i].as_f64);
-            if ((uintptr_t)mvm->stack[i].as_ptr > 0) {
-                fprintf(stream, " | ptr: 0x%" PRIx64 "\n", (uint64_t)*(uintptr_t*) &mvm->stack[i].as_ptr);
-            } else {
-                fprintf(stream, " | ptr: (nil)\n");
+    switch (type) {
+        case INST_PLUSI:  *out = word_u64(a.as_u64 + b.as_u64); return true;
+        case INST_MINUSI: *out = word_u64(a.as_u64 - b.as_u64); return true;
+        case INST_MULTI:  *out = word_u64(a.as_u64 * b.as_u64); return true;
+        case INST_DIVI: {
+            if (b.as_u64 == 0) {
+                return false;
             }
+            *out = word_u64(a.as_u64 / b.as_u64);
+            return true;
         }
-    } else {
-        fprintf(stream, " [empty]\n");
+        case INST_MODI: {
+            if (b.as_u64 == 0) {
+                return false;
+            }
+            *out = word_u64(a.as_u64 % b.as_u64);
+            return true;
+        }
+        case INST_PLUSF:  *out = word_f64(a.as_f64 + b.as_f64); return true;
+        case INST_MINUSF: *out = word_f64(a.as_f64 - b.as_f64); return true;
+        case INST_MULTF:  *out = word_f64(a.as_f64 * b.as_f64); return true;
+        case INST_DIVF:   *out = word_f64(a.as_f64 / b.as_f64); return true;
+        case INST_ANDB:   *out = word_u64(a.as_u64 & b.as_u64); return true;
+        case INST_ORB:    *out = word_u64(a.as_u64 | b.as_u64); return true;
+        case INST_XOR:    *out = word_u64(a.as_u64 ^ b.as_u64); return true;
+        case INST_SHR: {
+            if (b.as_u64 >= 64) {
+                return false;
+            }
+            *out = word_u64(a.as_u64 >> b.as_u64);
+            return true;
+        }
+        case INST_SHL: {
+            if (b.as_u64 >= 64) {
+                return false;
+            }
+            *out = word_u64(a.as_u64 << b.as_u64);
+            return true;
+        }
+        case INST_EQ:     *out = word_u64(b.as_u64 == a.as_u64); return true;
+        case INST_GEF:    *out = word_f64(b.as_f64 >= a.as_f64); return true;
+        case INST_GEI:    *out = word_u64(b.as_u64 >= a.as_u64); return true;
+        case INST_LEF:    *out = word_f64(b.as_f64 <= a.as_f64); return true;
+        case INST_LEI:    *out = word_u64(b.as_u64 <= a.as_u64); return true;
+        case INST_MINF:   *out = word_f64(fmin(a.as_f64, b.as_f64)); return true;
+        case INST_MAXF:   *out = word_f64(fmax(a.as_f64, b.as_f64)); return true;
+        case INST_GES:    *out = word_u64(b.as_i64 >= a.as_i64); return true;
+        case INST_LES:    *out = word_u64(b.as_i64 <= a.as_i64); return true;
+        case INST_SAR:    *out = mvm_sar(a, b); return true;
+        case INST_MINS:   *out = a.as_i64 < b.as_i64 ? a : b; return true;
+        case INST_MAXS:   *out = a.as_i64 > b.as_i64 ? a : b; return true;
+        case INST_DIVS: {
+            if (b.as_u64 == 0) {
+                return false;
+            }
+            *out = mvm_divS(a, b);
+            return true;
+        }
+        case INST_MODS: {
+            if (b.as_u64 == 0) {
+                return false;
+            }
+            *out = mvm_modS(a, b);
+            return true;
+        }
+        case INST_NOP:
+        case INST_PUSH:
+        case INST_DUP:
+        case INST_SWAP:
+        case INST_DROP:
+        case INST_NOTB:
+        case INST_JMP:
+        case INST_JMPIF:
+        case INST_CALL:
+        case INST_INT:
+        case INST_RET:
+        case INST_NOT:
+        case INST_HALT:
+        case INST_READ8:
+        case INST_READ16:
+        case INST_READ32:
+        case INST_READ64:
+        case INST_WRITE8:
+        case INST_WRITE16:
+        case INST_WRITE32:
+        case INST_WRITE64:
+        case INST_BREAK:
+        case INST_SPAWN:
+        case INST_JOIN:
+        case INST_ATOMADD:
+        case INST_ATOMCAS:
+        case INST_ATOMXCHG:
+        case INST_FENCE:
+        case INST_JEQ:
+        case INST_JNE:
+        case INST_JLTI:
+        case INST_JLEI:
+        case INST_JGTI:
+        case INST_JGEI:
+        case INST_JLTF:
+        case INST_JLEF:
+        case INST_JGTF:
+        case INST_JGEF:
+        case INST_JZ:
+        case INST_ENTER:
+        case INST_LEAVE:
+        case INST_LOADL:
+        case INST_STOREL:
+        case INST_SQRTF:
+        case INST_ABSF:
+        case INST_FLOORF:
+        case INST_CEILF:
+        case INST_SINF:
+        case INST_COSF:
+        case INST_EXPF:
+        case INST_LOGF:
+        case INST_FMAF:
+        case INST_I2F:
+        case INST_F2I:
+        case INST_ABSI:
+        case INST_COCREATE:
+        case INST_CORESUME:
+        case INST_YIELD:
+        case NUMBER_OF_INSTS:
+        default:
+            return false;
     }
 }
 
+// The fused conditional jump of a comparison followed by 'jmpif', INST_NOP if there is none.
+// geeq*/leeq* compare the top value with the one below, so they become jle*/jge*.
+static InstType masm_fuseBranch(InstType type)
+{
+    if (type == INST_EQ)  return INST_JEQ;
+    if (type == INST_NOT) return INST_JZ;
+    if (type == INST_GEI) return INST_JLEI;
+    if (type == INST_LEI) return INST_JGEI;
+    if (type == INST_GEF) return INST_JLEF;
+    if (type == INST_LEF) return INST_JGEF;
+    return INST_NOP;
+}
 
-void mvm_loadProgramFromFile(Mvm* mvm, const char* filePath)
+// Marks every address that can be entered other than by falling through from the previous instruction.
+static void masm_findLeaders(const Masm* masm, const bool* reloc, bool* leader)
 {
-    FILE* f = fopen(filePath, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "ERROR: Could not open file '%s'! : %s\n", filePath, strerror(errno));
-        exit(1);
+    memset(leader, 0, sizeof(leader[0]) * (MVM_PROGRAM_CAPACITY + 1));
+    leader[0] = true;
+    for (InstAddr i = 0; i < masm->program_size; ++i) {
+        const Inst inst = masm->program[i];
+        if ((InstIsJump(inst.type) || reloc[i]) && inst.operand.as_u64 <= masm->program_size) {
+            leader[inst.operand.as_u64] = true;
+        }
+        if (inst.type == INST_CALL) {
+            leader[i + 1] = true;
+        }
     }
+}
 
-    size_t n;
-
-    // Read and verify meta data.
-    MvmFile_Meta meta = {0};
+// Compacts the program and moves every instruction address (jump operands, address labels and
+// pushed label addresses) along with it. A removed instruction maps to the next surviving one.
+static void masm_removeDeadInsts(Masm* masm, bool* reloc, const bool* dead)
+{
+    InstAddr newAddr[MVM_PROGRAM_CAPACITY + 1];
+    InstAddr size = 0;
+    for (InstAddr i = 0; i < masm->program_size; ++i) {
+        newAddr[i] = size;
+        if (!dead[i]) {
+            size += 1;
+        }
+    }
+    newAddr[masm->program_size] = size;
 
-    n = fread(&meta, sizeof(meta), 1, f);
-    if (n < 1) {
-        fprintf(stderr, "ERROR: Could not read MVM_META from file '%s'! : %s\n", filePath, strerror(errno));
-        exit(1);
+    for (InstAddr i = 0; i < masm->program_size; ++i) {
+        if (dead[i]) {
+            continue;
+        }
+        Inst inst = masm->program[i];
+        if ((InstIsJump(inst.type) || reloc[i]) && inst.operand.as_u64 <= masm->program_size) {
+            inst.operand = word_u64(newAddr[inst.operand.as_u64]);
+        }
+        masm->program[newAddr[i]] = inst;
+        reloc[newAddr[i]] = reloc[i];
     }
 
-    if (meta.magic != MVM_FILE_MAGIC) {
-        fprintf(stderr, "ERROR: '%s' is not a valid mvm file! : "
-                        "Unexpected magic '%04X' : "
-                        "Expected '%04X'\n", filePath, meta.magic, MVM_FILE_MAGIC);
-        exit(1);
+    for (size_t i = 0; i < masm->labels_size; ++i) {
+        if (masm->labels[i].is_addr && masm->labels[i].word.as_u64 <= masm->program_size) {
+            masm->labels[i].word = word_u64(newAddr[masm->labels[i].word.as_u64]);
+        }
     }
 
-    if (meta.version != MVM_FILE_VERSION) {
-        fprintf(stderr, "ERROR: Unsupported file version %d in file '%s'! : "
-                        "Expected version %d\n", meta.version, filePath, MVM_FILE_VERSION);
-        exit(1);
+    size_t deferredSize = 0;
+    for (size_t i = 0; i < masm->deferredOperands_size; ++i) {
+        DeferredOperand deferred = masm->deferredOperands[i];
+        if (!dead[deferred.addr]) {
+            deferred.addr = newAddr[deferred.addr];
+            masm->deferredOperands[deferredSize++] = deferred;
+        }
     }
-    
-    if (meta.os != OS && meta.wos) {
-    	switch (meta.os) {
-    	   case (uint16_t)0x544e: 
-    	      printf("[!] This programm was compiled for Windows based systems\n");
-    	      break;
-    	   case (uint16_t)0x5855:
-    	      printf("[!] This programm was compiled for UNIX based systems\n");
-    	      break;
-    	   case (uint16_t)0x4c41:
-    	      printf("[!] This programm was compiled for Mac-OS-X based systems\n");
-    	      break;
-    	   case (uint16_t)0x584c:
-    	      printf("[!] This programm was compiled for LINUX based systems\n");
-    	      break;
-    	   case (uint16_t)0x4246:
-    	      printf("[!] This programm was compiled for FreeBSD based systems\n");
-    	      break;
-    	   case (uint16_t)0x4441:
-    	      printf("[!] This programm was compiled for Android based systems\n");
-    	      break;
-    	   default:
-    	      printf("[!] This programm was compiled for an UNKNOWN operating system\n");
-    	      break;
-    	}
+    masm->deferredOperands_size = deferredSize;
+
+    size_t refsSize = 0;
+    for (size_t i = 0; i < masm->dataRefs_size; ++i) {
+        MasmDataRef ref = masm->dataRefs[i];
+        if (!dead[ref.inst]) {
+            ref.inst = newAddr[ref.inst];
+            masm->dataRefs[refsSize++] = ref;
+        }
     }
+    masm->dataRefs_size = refsSize;
+    masm->program_size = size;
+}
 
-    if (meta.program_size > MVM_PROGRAM_CAPACITY) {
-        fprintf(stderr, "ERROR: To large program section in file '%s'! : "
-                        "This file contains %lld instructions. : "
-                        "The max amount of instructions for this section is %d.\n",
-                        filePath, meta.program_size, MVM_PROGRAM_CAPACITY);
-        exit(1);
+// Hands the literal operands and the names used by the instruction at `from` to the one at `to`, when its
+// operand was folded into `to`. The data stays used, the folded constant may still point into it.
+static void masm_moveDataRefs(Masm* masm, InstAddr from, InstAddr to)
+{
+    for (size_t i = 0; i < masm->dataRefs_size; ++i) {
+        if (masm->dataRefs[i].inst == from) {
+            masm->dataRefs[i].inst = to;
+        }
     }
-
-    if (meta.memory_capacity > MVM_MEMORY_CAPACITY) {
-        fprintf(stderr, "ERROR: To large memory section in file '%s'! : "
-                        "This files memory section size is %" PRIu64 " bytes big. : "
-                        "The max size for this section is %d bytes.\n",
-                        filePath, meta.memory_capacity, MVM_MEMORY_CAPACITY);
-        exit(1);
+    for (size_t i = 0; i < masm->deferredOperands_size; ++i) {
+        if (masm->deferredOperands[i].addr == from) {
+            masm->deferredOperands[i].addr = to;
+        }
     }
+}
 
-    if (meta.memory_size > meta.memory_capacity)
-    {
-        fprintf(stderr, "ERROR: To large memory section in file '%s'! : "
-                        "%" PRIu64 " bytes of memory are declared but the memory section is %lld bytes big.\n",
-                        filePath, meta.memory_capacity, meta.memory_size);
-        exit(1);
+// Constant folding and removal of redundant stack shuffles. Patterns never span a leader,
+// so every instruction that can be jumped to still behaves the same.
+static bool masm_peephole(Masm* masm, const bool* reloc, const bool* leader, bool* dead)
+{
+    Inst* program = masm->program;
+    const InstAddr size = masm->program_size;
+    bool changed = false;
+
+    for (InstAddr i = 0; i < size; ++i) {
+        const bool hasNext = i + 1 < size && !leader[i + 1];
+        const bool hasNext2 = hasNext && i + 2 < size && !leader[i + 2];
+        const bool literal = program[i].type == INST_PUSH && !reloc[i];
+
+        if (program[i].type == INST_NOP
+            || (program[i].type == INST_SWAP && program[i].operand.as_u64 == 0)
+            || (program[i].type == INST_JMP && program[i].operand.as_u64 == i + 1)) {
+            dead[i] = true;
+        } else if (program[i].type == INST_JMPIF && program[i].operand.as_u64 == i + 1) {
+            program[i] = (Inst) {.type = INST_DROP};
+        } else if (hasNext2 && literal && program[i + 1].type == INST_PUSH && !reloc[i + 1]
+                   && masm_foldBinary(program[i + 2].type, program[i].operand, program[i + 1].operand, &program[i].operand)) {
+            masm_moveDataRefs(masm, i + 1, i);
+            dead[i + 1] = true;
+            dead[i + 2] = true;
+        } else if (hasNext && literal && program[i + 1].type == INST_NOT) {
+            program[i].operand = word_u64(!program[i].operand.as_u64);
+            dead[i + 1] = true;
+        } else if (hasNext && literal && program[i + 1].type == INST_JMPIF) {
+            if (program[i].operand.as_u64) {
+                program[i] = (Inst) {.type = INST_JMP, .operand = program[i + 1].operand};
+            } else {
+                dead[i] = true;
+            }
+            dead[i + 1] = true;
+        } else if (hasNext && literal && program[i].operand.as_u64 == 0 && program[i + 1].type == INST_EQ) {
+            // Comparing with zero is a logical not.
+            program[i] = (Inst) {.type = INST_NOT};
+            dead[i + 1] = true;
+        } else if (hasNext && program[i].type == INST_NOT && program[i + 1].type == INST_JZ) {
+            program[i] = (Inst) {.type = INST_JMPIF, .operand = program[i + 1].operand};
+            dead[i + 1] = true;
+        } else if (hasNext2 && program[i].type == INST_EQ && program[i + 1].type == INST_NOT
+                   && program[i + 2].type == INST_JMPIF) {
+            program[i] = (Inst) {.type = INST_JNE, .operand = program[i + 2].operand};
+            dead[i + 1] = true;
+            dead[i + 2] = true;
+        } else if (hasNext && program[i + 1].type == INST_JMPIF && masm_fuseBranch(program[i].type) != INST_NOP) {
+            program[i] = (Inst) {.type = masm_fuseBranch(program[i].type), .operand = program[i + 1].operand};
+            dead[i + 1] = true;
+        } else if (hasNext && literal && program[i + 1].type == INST_DROP) {
+            dead[i] = true;
+            dead[i + 1] = true;
+        } else if (hasNext && program[i].type == INST_SWAP && program[i + 1].type == INST_SWAP
+                   && program[i].operand.as_u64 == program[i + 1].operand.as_u64) {
+            dead[i] = true;
+            dead[i + 1] = true;
+        } else if (hasNext && program[i].type == INST_DUP && program[i].operand.as_u64 == 0
+                   && program[i + 1].type == INST_SWAP && program[i + 1].operand.as_u64 == 1) {
+            dead[i + 1] = true;
+        } else {
+            continue;
+        }
+
+        changed = true;
+        // Skip the instructions consumed by the pattern.
+        while (i + 1 < size && dead[i + 1]) {
+            i += 1;
+        }
     }
+    return changed;
+}
 
-    // Read the program.
-    mvm->program_size = fread(mvm->program, sizeof(mvm->program[0]), (size_t)meta.program_size, f);
-    if (mvm->program_size != meta.program_size) {
-        fprintf(stderr, "ERROR: Could only read %" PRIu64 " from a total of %" PRIu64 " program instructions from file '%s'!",
-                mvm->program_size, meta.program_size, filePath);
-        exit(1);
+// Retargets jumps and calls whose destination is an unconditional jump.
+static bool masm_threadJumps(Masm* masm)
+{
+    bool changed = false;
+    for (InstAddr i = 0; i < masm->program_size; ++i) {
+        if (!InstIsJump(masm->program[i].type)) {
+            continue;
+        }
+        InstAddr target = masm->program[i].operand.as_u64;
+        for (size_t hops = 0; hops < MASM_OPTIMIZER_MAX_JUMP_HOPS; ++hops) {
+            if (target >= masm->program_size || masm->program[target].type != INST_JMP
+                || masm->program[target].operand.as_u64 == target) {
+                break;
+            }
+            target = masm->program[target].operand.as_u64;
+        }
+        if (target != masm->program[i].operand.as_u64) {
+            masm->program[i].operand = word_u64(target);
+            changed = true;
+        }
     }
+    return changed;
+}
 
-    // Read the memory.
-    n = fread(mvm->memory, sizeof(mvm->memory[0]), (size_t)meta.memory_size, f);
-    if (n != meta.memory_size) {
-        fprintf(stderr, "ERROR: Could only read %zd from a total of %" PRIu64 " bytes of memory section from file '%s'!",
-                n, meta.memory_size, filePath);
-        exit(1);
+// Marks every instruction that can't be reached from the entry point or from a pushed label address.
+static bool masm_findDeadCode(const Masm* masm, const bool* reloc, bool* dead)
+{
+    bool reachable[MVM_PROGRAM_CAPACITY + 1] = {0};
+    InstAddr work[2 * MVM_PROGRAM_CAPACITY + 1];
+    size_t work_size = 0;
+
+    work[work_size++] = 0;
+    for (InstAddr i = 0; i < masm->program_size; ++i) {
+        if (reloc[i]) {
+            work[work_size++] = masm->program[i].operand.as_u64;
+        }
     }
 
-    fclose(f);
+    while (work_size > 0) {
+        InstAddr i = work[--work_size];
+        if (i >= masm->program_size || reachable[i]) {
+            continue;
+        }
+        reachable[i] = true;
+
+        const Inst inst = masm->program[i];
+        if (InstIsJump(inst.type)) {
+            work[work_size++] = inst.operand.as_u64;
+        }
+        if (inst.type != INST_JMP && inst.type != INST_RET && inst.type != INST_HALT) {
+            work[work_size++] = i + 1;
+        }
+    }
+
+    bool changed = false;
+    for (InstAddr i = 0; i < masm->program_size; ++i) {
+        if (!reachable[i]) {
+            dead[i] = true;
+            changed = true;
+        }
+    }
+    return changed;
 }
 
-void mvm_translateSourceFile(Masm* masm, StringView inputFile, size_t level)
+// Records the unreachable code for the report of 'masm -d' before it is removed.
+static void masm_recordDeadCode(Masm* masm, const bool* dead)
 {
-    StringView source_original = masm_slurpFile(masm, inputFile);
-    StringView source = source_original;
+    for (InstAddr i = 0; i < masm->program_size; ++i) {
+        masm->shaken_insts += dead[i];
+    }
+    for (size_t i = 0; i < masm->labels_size; ++i) {
+        Label* label = &masm->labels[i];
+        if (label->is_addr && label->word.as_u64 < masm->program_size && dead[label->word.as_u64]) {
+            label->removed = true;
+        }
+    }
+}
 
-    // Pass one
-    int lineNum = 0;
-    while (source.count > 0) {
-        StringView  line = sv_trim(sv_chopByDelim(&source, '\n'));
-        lineNum += 1;
-        if (line.count > 0 && *line.data != MASM_COMMENT_SYMBOL) {
-            StringView  token = sv_chopByDelim(&line, ' ');
+static bool masm_isDataUsed(const Masm* masm, const MasmData* data)
+{
+    for (size_t i = 0; i < masm->dataRefs_size; ++i) {
+        if (&masm->data[masm->dataRefs[i].data] == data) {
+            return true;
+        }
+    }
+    for (size_t i = 0; data->name.count > 0 && i < masm->deferredOperands_size; ++i) {
+        if (sv_eq(masm->deferredOperands[i].label, data->name)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-            // Preprocessor
-            if (token.count > 0 && *token.data == MASM_PP_SYMBOL) {
-                token.count -= 1;
-                token.data += 1;
-                if (sv_eq(token, cstr_as_sv("define"))) {
-                    line = sv_trim(line);
-                    StringView label = sv_chopByDelim(&line, ' ');
+// Drops the strings and arrays at the end of the memory section that are neither used as a literal operand nor
+// by their name. Only the tail is trimmed, unused data before a used one stays: the section isn't compacted, since
+// programs may compute the address of one item from another and the references couldn't be relocated with it.
+static void masm_trimData(Masm* masm)
+{
+    const size_t memorySize = masm->memory_size;
+    for (size_t i = masm->data_size; i > 0; --i) {
+        MasmData* data = &masm->data[i - 1];
+        if (data->removed || data->reserved) {
+            continue;
+        }
+        if (data->addr + data->size != masm->memory_size) {
+            break;
+        }
+        if (masm_isDataUsed(masm, data)) {
+            break;
+        }
+        data->removed = true;
+        masm->memory_size = data->addr;
+        masm->shaken_bytes += data->size;
+        if (masm->memory_capacity == memorySize) {
+            masm->memory_capacity = masm->memory_size;
+        }
+    }
+}
 
-                    if (label.count > 0) {
-                        line = sv_trim(line);
-                        StringView value = line;
-                        Word word = {0};
-                        if (!masm_translateLiteral(masm, value, &word)) {
-                            fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is not a string or a number!\n", SV_FORMAT(inputFile), lineNum,
-                                    SV_FORMAT(value));
-                            exit(1);
-                        }
+// Marks the instructions whose operand resolved to an address label, it has to move with the code.
+static void masm_findRelocs(const Masm* masm, bool* reloc)
+{
+    memset(reloc, 0, sizeof(reloc[0]) * MVM_PROGRAM_CAPACITY);
+    for (size_t i = 0; i < masm->deferredOperands_size; ++i) {
+        for (size_t j = 0; j < masm->labels_size; ++j) {
+            if (masm->labels[j].is_addr && sv_eq(masm->labels[j].name, masm->deferredOperands[i].label)) {
+                reloc[masm->deferredOperands[i].addr] = true;
+                break;
+            }
+        }
+    }
+}
 
-                        if (!masm_bindLabel(masm, label, word)) {
-                            fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is already defined!!\n", SV_FORMAT(inputFile), lineNum,
-                                    SV_FORMAT(label));
-                            exit(1);
-                        }
-                    } else {
-                        fprintf(stderr, "%" PRIsv ":%d: ERROR: Definition name expected!\n", SV_FORMAT(inputFile), lineNum);
-                        exit(1);
-                    }
-                } else if (sv_eq(token, cstr_as_sv("include"))) {
-                    line = sv_trim(line);
-                    if (line.count > 0) {
-                        if (*line.data == '"' && line.data[line.count - 1] == '"') {
-                            line.data += 1;
-                            line.count -= 2;
+// Runs the optimizer passes until nothing changes anymore, then drops unreferenced data at the end of the memory.
+// Returns the number of removed instructions.
+size_t masm_optimize(Masm* masm)
+{
+    bool reloc[MVM_PROGRAM_CAPACITY];
+    bool dead[MVM_PROGRAM_CAPACITY];
+    bool leader[MVM_PROGRAM_CAPACITY + 1];
+    const uint64_t originalSize = masm->program_size;
 
-                            if (level + 1 < MASM_MAX_INCLUDES) {
-                                mvm_translateSourceFile(masm, line, level + 1);
-                            } else {
-                                fprintf(stderr, "%" PRIsv ":%d: ERROR: Exceeded maximum-include-level!\n", SV_FORMAT(inputFile), lineNum);
-                                exit(1);
-                            }
-                        } else {
-                            fprintf(stderr, "%" PRIsv ":%d: ERROR: Include-Path has to be surrounded with quotation marks!\n", SV_FORMAT(inputFile), lineNum);
-                            exit(1);
-                        }
-                    } else {
-                        fprintf(stderr, "%" PRIsv ":%d: ERROR: Include-Path is not provided!\n", SV_FORMAT(inputFile), lineNum);
-                        exit(1);
-                    }
-                } else {
-                    fprintf(stderr, "%" PRIsv ":%d: ERROR: Unknown preprocessor directive '%" PRIsv "'!\n", SV_FORMAT(inputFile), lineNum,
-                            SV_FORMAT(token));
-                    exit(1);
-                }
-            } else {
+    masm_findRelocs(masm, reloc);
 
-                if (token.count > 0 && token.data[token.count - 1] == ':') {
-                    StringView label = (StringView) {.count = token.count - 1, .data = token.data};
-                    if (!masm_bindLabel(masm, label, word_u64(masm->program_size))) {
-                        fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is already defined!\n", SV_FORMAT(inputFile), lineNum, SV_FORMAT(label));
-                        exit(1);
-                    }
-                    token = sv_trim(sv_chopByDelim(&line, ' '));
-                }
+    for (size_t pass = 0; pass < MASM_OPTIMIZER_MAX_PASSES; ++pass) {
+        bool changed = false;
 
-                if (token.count > 0) {
-                    StringView operand = sv_trim(sv_chopByDelim(&line, MASM_COMMENT_SYMBOL));
-                    InstType instType = INST_NOP;
+        memset(dead, 0, sizeof(dead));
+        masm_findLeaders(masm, reloc, leader);
+        if (masm_peephole(masm, reloc, leader, dead)) {
+            masm_removeDeadInsts(masm, reloc, dead);
+            changed = true;
+        }
 
-                    if (GetInstName(token, &instType)) {
-                        if (masm->program_size >= MVM_PROGRAM_CAPACITY) {
-                            fprintf(stderr, "ERROR: Program size exceeded!");
-                            exit(1);
-                        }
-                        masm->program[masm->program_size].type = instType;
-                        if (InstHasOperand(instType)) {
-                            if (operand.count == 0) {
-                                fprintf(stderr, "%" PRIsv ":%d: ERROR: instruction '%" PRIsv "' expects an operand!\n",
-                                        SV_FORMAT(inputFile), lineNum, SV_FORMAT(token));
-                                exit(1);
-                            }
+        if (masm_threadJumps(masm)) {
+            changed = true;
+        }
 
-                            if (!masm_translateLiteral(
-                                    masm,
-                                    operand,
-                                    &masm->program[masm->program_size].operand)) {
-                                masm_pushDeferredOperand(masm, masm->program_size, operand);
-                            }
+        memset(dead, 0, sizeof(dead));
+        if (masm_findDeadCode(masm, reloc, dead)) {
+            masm_recordDeadCode(masm, dead);
+            masm_removeDeadInsts(masm, reloc, dead);
+            changed = true;
+        }
 
-                        }
-                        masm->program_size += 1;
-                    } else {
-                        fprintf(stderr, "%" PRIsv ":%d: ERROR: Unknown instruction '%" PRIsv "'!\n", SV_FORMAT(inputFile), lineNum,
-                                SV_FORMAT(token));
-                        exit(1);
-                    }
-                }
-            }
+        if (!changed) {
+            break;
         }
     }
+    masm_trimData(masm);
+    return (size_t)(originalSize - masm->program_size);
+}
 
-    // Pass two
-    for (size_t i = 0; i < masm->deferredOperands_size; ++i) {
-        StringView label = masm->deferredOperands[i].label;
-        Word* operand = &masm->program[masm->deferredOperands[i].addr].operand;
-        if (!masm_resolveLabel(masm, label, operand)) {
-            fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is not defined!\n", SV_FORMAT(inputFile), lineNum, SV_FORMAT(label));
+void masm_loadProfile(Masm* masm, const char* filePath, uint64_t* counts, uint64_t* taken)
+{
+    memset(counts, 0, sizeof(counts[0]) * MVM_PROGRAM_CAPACITY);
+    memset(taken, 0, sizeof(taken[0]) * MVM_PROGRAM_CAPACITY);
+    StringView source = masm_slurpFile(masm, cstr_as_sv(filePath));
+    int lineNum = 0;
+    while (source.count > 0) {
+        lineNum += 1;
+        StringView line = sv_trim(sv_chopByDelim(&source, '\n'));
+        if (line.count == 0 || *line.data == '#') {
+            continue;
+        }
+        StringView offset = sv_chopByDelim(&line, ' ');
+        StringView name = sv_chopByDelim(&offset, '+');
+        line = sv_trim(line);
+        StringView jumps = sv_trim(line);
+        line = sv_chopByDelim(&jumps, ' ');
+
+        Word addr = {0};
+        Word delta = {0};
+        Word count = {0};
+        Word jumped = {0};
+        bool found = false;
+        for (size_t i = 0; i < masm->labels_size && !found; ++i) {
+            if (masm->labels[i].is_addr && sv_eq(masm->labels[i].name, name)) {
+                addr = masm->labels[i].word;
+                found = true;
+            }
+        }
+        if (!found && !masm_translateLiteral(masm, name, &addr)) {
+            fprintf(stderr, "%s:%d: ERROR: Unknown label '%" PRIsv "'! : The profile doesn't match the program.\n",
+                    filePath, lineNum, SV_FORMAT(name));
+            exit(1);
+        }
+        if ((offset.count > 0 && !masm_translateLiteral(masm, offset, &delta))
+            || line.count == 0 || !masm_translateLiteral(masm, line, &count)
+            || (jumps.count > 0 && !masm_translateLiteral(masm, sv_trim(jumps), &jumped))) {
+            fprintf(stderr, "%s:%d: ERROR: Expected '<label>[+offset] <count> [<taken>]'!\n", filePath, lineNum);
+            exit(1);
+        }
+        if (addr.as_u64 + delta.as_u64 >= masm->program_size) {
+            fprintf(stderr, "%s:%d: ERROR: Address %" PRIu64 " is out of range! : The profile doesn't match the program.\n",
+                    filePath, lineNum, addr.as_u64 + delta.as_u64);
             exit(1);
         }
+        counts[addr.as_u64 + delta.as_u64] += count.as_u64;
+        taken[addr.as_u64 + delta.as_u64] += jumped.as_u64;
     }
 }
 
-ExceptionState mvm_execInst(Mvm* mvm)
+// Conditional jumps whose condition can be negated exactly. Float comparisons can't because of NaN.
+static InstType masm_invertBranch(InstType type)
 {
-    if (mvm->ip >= mvm->program_size) {
-        return EXCEPTION_ILLEGAL_INST_ACCESS;
-    }
+    if (type == INST_JMPIF) return INST_JZ;
+    if (type == INST_JZ)    return INST_JMPIF;
+    if (type == INST_JEQ)   return INST_JNE;
+    if (type == INST_JNE)   return INST_JEQ;
+    if (type == INST_JLTI)  return INST_JGEI;
+    if (type == INST_JGEI)  return INST_JLTI;
+    if (type == INST_JLEI)  return INST_JGTI;
+    if (type == INST_JGTI)  return INST_JLEI;
+    return INST_NOP;
+}
 
-    Inst inst = mvm->program[mvm->ip];
+static bool masm_endsFlow(InstType type)
+{
+    return type == INST_JMP || type == INST_RET || type == INST_HALT;
+}
 
-    switch (inst.type) {
-        case INST_NOP: {
-            mvm->ip += 1;
-            break;
+// Moves the basic blocks so that the blocks executed most often by the profiled run follow each other.
+// Starting at the entry, every block is followed by the successor it continued with most often, unless that one
+// is placed already, so fall-through follows the likely branch direction. When a chain ends, the hottest remaining
+// block starts the next one, blocks that never ran keep their order at the end. Broken fall-throughs get a 'jmp'
+// or an inverted branch. A call and its return address are never separated. Returns the number of blocks that moved.
+size_t masm_layoutByProfile(Masm* masm, const uint64_t* counts, const uint64_t* taken)
+{
+    static Inst program[MVM_PROGRAM_CAPACITY];
+    static bool reloc[MVM_PROGRAM_CAPACITY];
+    static bool movedReloc[MVM_PROGRAM_CAPACITY];
+    static bool leader[MVM_PROGRAM_CAPACITY + 1];
+    static bool dropped[MVM_PROGRAM_CAPACITY];
+    static InstAddr newAddr[MVM_PROGRAM_CAPACITY + 1];
+    static size_t blockOf[MVM_PROGRAM_CAPACITY + 1];
+    static InstAddr starts[MVM_PROGRAM_CAPACITY + 1];
+    static uint64_t heat[MVM_PROGRAM_CAPACITY];
+    static size_t order[MVM_PROGRAM_CAPACITY];
+    static bool placed[MVM_PROGRAM_CAPACITY];
+    const InstAddr size = masm->program_size;
+    if (size == 0) {
+        return 0;
+    }
+
+    masm_findRelocs(masm, reloc);
+    masm_findLeaders(masm, reloc, leader);
+    size_t blocks = 0;
+    for (InstAddr i = 0; i < size; ++i) {
+        const bool split = i == 0 || leader[i] || masm_endsFlow(masm->program[i - 1].type)
+                           || mvm_isBranch(masm->program[i - 1].type);
+        if (split && (i == 0 || masm->program[i - 1].type != INST_CALL)) {
+            heat[blocks] = 0;
+            starts[blocks++] = i;
         }
-        case INST_PUSH: {
-            if (mvm->stack_size >= MVM_STACK_CAPACITY) {
-                return EXCEPTION_STACK_OVERFLOW;
-            }
-            mvm->stack[mvm->stack_size++] = inst.operand;
-            mvm->ip += 1;
-            break;
+        blockOf[i] = blocks - 1;
+        if (counts[i] > heat[blocks - 1]) {
+            heat[blocks - 1] = counts[i];
         }
-
-        case INST_DUP: {
-            if (mvm->stack_size >= MVM_STACK_CAPACITY) {
-                return EXCEPTION_STACK_OVERFLOW;
+    }
+    starts[blocks] = size;
+    blockOf[size] = blocks;
+    memset(placed, 0, sizeof(placed[0]) * blocks);
+
+    size_t order_size = 0;
+    size_t current = 0;
+    while (order_size < blocks) {
+        order[order_size++] = current;
+        placed[current] = true;
+
+        // The successor taken most often, falling through wins a tie.
+        const InstAddr end = starts[current + 1];
+        const Inst last = masm->program[end - 1];
+        const uint64_t jumps = last.type == INST_JMP ? heat[current] : mvm_isBranch(last.type) ? taken[end - 1] : 0;
+        uint64_t falls = masm_endsFlow(last.type) ? 0 : heat[current];
+        if (mvm_isBranch(last.type)) {
+            falls = counts[end - 1] > taken[end - 1] ? counts[end - 1] - taken[end - 1] : 0;
+        }
+        size_t next = blocks;
+        if (falls > 0 && current + 1 < blocks && !placed[current + 1]) {
+            next = current + 1;
+        }
+        if (jumps > 0 && last.operand.as_u64 < size) {
+            const size_t target = blockOf[last.operand.as_u64];
+            if (starts[target] == last.operand.as_u64 && !placed[target] && (next == blocks || jumps > falls)) {
+                next = target;
             }
-            if (mvm->stack_size - inst.operand.as_u64 <= 0) {
-                return EXCEPTION_STACK_UNDERFLOW;
+        }
+        for (size_t i = 0; next == blocks && i < blocks; ++i) {
+            if (!placed[i] && heat[i] > 0 && (next == blocks || heat[i] > heat[next])) {
+                next = i;
             }
-
-            mvm->stack[mvm->stack_size] = mvm->stack[mvm->stack_size - 1 - inst.operand.as_u64];
-            mvm->stack_size += 1;
-            mvm->ip += 1;
-            break;
         }
-
-        case INST_SWAP: {
-            if (inst.operand.as_u64 >= mvm->stack_size) {
-                return EXCEPTION_STACK_UNDERFLOW;
+        for (size_t i = 0; next == blocks && i < blocks; ++i) {
+            if (!placed[i]) {
+                next = i;
             }
-            const uint64_t a = mvm->stack_size - 1;
-            const uint64_t b = mvm->stack_size - 1 - inst.operand.as_u64;
-            Word tmp = mvm->stack[a];
-            mvm->stack[a] = mvm->stack[b];
-            mvm->stack[b] = tmp;
-            mvm->ip += 1;
-            break;
         }
+        current = next;
+    }
 
-        case INST_DROP: {
-            if (mvm->stack_size < 1) {
-                return EXCEPTION_STACK_UNDERFLOW;
+    InstAddr programSize = 0;
+    size_t moved = 0;
+    memset(dropped, 0, sizeof(dropped[0]) * size);
+    for (size_t k = 0; k < blocks; ++k) {
+        const size_t block = order[k];
+        const InstAddr follower = k + 1 < blocks ? starts[order[k + 1]] : size;
+        moved += block != k;
+        for (InstAddr i = starts[block]; i < starts[block + 1]; ++i) {
+            if (programSize >= MVM_PROGRAM_CAPACITY) {
+                fprintf(stderr, "ERROR: Program size exceeded!");
+                exit(1);
             }
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
+            newAddr[i] = programSize;
+            movedReloc[programSize] = reloc[i];
+            program[programSize++] = masm->program[i];
         }
 
-        case INST_PLUSI: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
+        // Operands still hold old addresses here, they are moved below.
+        const InstAddr end = starts[block + 1];
+        Inst* last = &program[programSize - 1];
+        if (last->type == INST_JMP && last->operand.as_u64 == follower) {
+            // Jumping to the next instruction, its address now belongs to the target.
+            dropped[end - 1] = true;
+            programSize -= 1;
+        } else if (!masm_endsFlow(last->type) && end != follower) {
+            if (mvm_isBranch(last->type) && last->operand.as_u64 == follower && masm_invertBranch(last->type) != INST_NOP) {
+                *last = (Inst) {.type = masm_invertBranch(last->type), .operand = word_u64(end)};
+            } else if (programSize >= MVM_PROGRAM_CAPACITY) {
+                fprintf(stderr, "ERROR: Program size exceeded!");
+                exit(1);
+            } else {
+                movedReloc[programSize] = false;
+                program[programSize++] = (Inst) {.type = INST_JMP, .operand = word_u64(end)};
             }
-            mvm->stack[mvm->stack_size - 2].as_u64 += mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
         }
+    }
+    newAddr[size] = programSize;
 
-        case INST_MINUSI: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2].as_u64 -= mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
+    for (InstAddr i = 0; i < programSize; ++i) {
+        if ((InstIsJump(program[i].type) || movedReloc[i]) && program[i].operand.as_u64 <= size) {
+            program[i].operand = word_u64(newAddr[program[i].operand.as_u64]);
         }
+    }
+    memcpy(masm->program, program, sizeof(program[0]) * programSize);
+    masm->program_size = programSize;
 
-        case INST_MULTI: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2].as_u64 *= mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
+    for (size_t i = 0; i < masm->labels_size; ++i) {
+        if (masm->labels[i].is_addr && masm->labels[i].word.as_u64 <= size) {
+            masm->labels[i].word = word_u64(newAddr[masm->labels[i].word.as_u64]);
         }
-
-        case INST_DIVI: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            if (mvm->stack[mvm->stack_size - 1].as_u64 == 0) {
-                return EXCEPTION_DIV_BY_ZERO;
-            }
-            mvm->stack[mvm->stack_size - 2].as_u64 /= mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
+    }
+    size_t deferredSize = 0;
+    for (size_t i = 0; i < masm->deferredOperands_size; ++i) {
+        DeferredOperand deferred = masm->deferredOperands[i];
+        if (!dropped[deferred.addr]) {
+            deferred.addr = newAddr[deferred.addr];
+            masm->deferredOperands[deferredSize++] = deferred;
         }
+    }
+    masm->deferredOperands_size = deferredSize;
+    for (size_t i = 0; i < masm->dataRefs_size; ++i) {
+        masm->dataRefs[i].inst = newAddr[masm->dataRefs[i].inst];
+    }
+    return moved;
+}
 
-        case INST_MODI: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
+// The memory gets its own pages, so it can be protected without touching anything else (see mvm -w).
+void mvm_initMemory(Mvm* mvm)
+{
+    if (mvm->memory != NULL) {
+        return;
+    }
+    const size_t size = MVM_MEMORY_ALLOC_SIZE;
+#if defined(_MSC_VER)
+    mvm->memory = _aligned_malloc(size, MVM_MEMORY_ALIGNMENT);
+#else
+    mvm->memory = aligned_alloc(MVM_MEMORY_ALIGNMENT, size);
+#endif
+    if (mvm->memory == NULL) {
+        fprintf(stderr, "ERROR: Could not allocate %zu bytes of memory!\n", size);
+        exit(1);
+    }
+    memset(mvm->memory, 0, size);
+}
 
-            if (mvm->stack[mvm->stack_size - 1].as_u64 == 0) {
-                return EXCEPTION_DIV_BY_ZERO;
-            }
+// Threads blocked on a channel park here. Every successful send or receive and every thread that stops
+// moves the epoch on, a thread only parks if the epoch did not move since it found its channel blocked.
+static mtx_t mvm_parkLock;
+static cnd_t mvm_parkWake;
+static once_flag mvm_parkOnce = ONCE_FLAG_INIT;
+static _Atomic uint64_t mvm_parkEpoch;
+static _Atomic uint64_t mvm_parkWaiters;
 
-            mvm->stack[mvm->stack_size - 2].as_u64 = mvm->stack[mvm->stack_size - 2].as_u64 % mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+static void mvm_initPark(void)
+{
+    if (mtx_init(&mvm_parkLock, mtx_plain) != thrd_success || cnd_init(&mvm_parkWake) != thrd_success) {
+        fprintf(stderr, "ERROR: Could not initialize the parking of threads!\n");
+        exit(1);
+    }
+}
 
-        case INST_PLUSF: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2].as_f64 += mvm->stack[mvm->stack_size - 1].as_f64;
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+// Wakes the parked threads, something they wait for may have changed.
+static void mvm_unpark(void)
+{
+    atomic_fetch_add(&mvm_parkEpoch, 1);
+    if (atomic_load(&mvm_parkWaiters) > 0) {
+        call_once(&mvm_parkOnce, mvm_initPark);
+        mtx_lock(&mvm_parkLock);
+        cnd_broadcast(&mvm_parkWake);
+        mtx_unlock(&mvm_parkLock);
+    }
+}
 
-        case INST_MINUSF: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2].as_f64 -= mvm->stack[mvm->stack_size - 1].as_f64;
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
+// Parks the thread for at most MVM_CHANNEL_WAIT_NS, unless the epoch moved on from `epoch`. Fails if another
+// thread of the program failed, or with EXCEPTION_DEADLOCK if all of them are parked or wait in 'join'.
+static ExceptionState mvm_park(Mvm* mvm, uint64_t epoch)
+{
+    Mvm* root = mvm->root != NULL ? mvm->root : mvm;
+    call_once(&mvm_parkOnce, mvm_initPark);
+    mtx_lock(&mvm_parkLock);
+    atomic_fetch_add(&mvm_parkWaiters, 1);
+    ExceptionState result = EXCEPTION_SATE_OK;
+    if (root->thread_failed) {
+        result = EXCEPTION_THREAD_FAILED;
+    } else if (atomic_load(&mvm_parkEpoch) == epoch) {
+        if (root->parked_epoch != epoch) {
+            root->parked_epoch = epoch;
+            root->threads_parked = 0;
         }
-
-        case INST_MULTF: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
+        root->threads_parked += 1;
+        if (root->threads_parked + root->threads_joining > root->threads_running) {
+            result = EXCEPTION_DEADLOCK;
+        } else {
+            struct timespec until;
+            timespec_get(&until, TIME_UTC);
+            until.tv_nsec += MVM_CHANNEL_WAIT_NS;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec += 1;
+                until.tv_nsec -= 1000000000;
             }
-            mvm->stack[mvm->stack_size - 2].as_f64 *= mvm->stack[mvm->stack_size - 1].as_f64;
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
+            cnd_timedwait(&mvm_parkWake, &mvm_parkLock, &until);
+        }
+        if (root->parked_epoch == epoch) {
+            root->threads_parked -= 1;
         }
+    }
+    atomic_fetch_sub(&mvm_parkWaiters, 1);
+    mtx_unlock(&mvm_parkLock);
+    return result;
+}
 
-        case INST_DIVF: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
+typedef struct _MVM_THREAD_ {
+    Mvm* mvm;
+    thrd_t thread;
+    ExceptionState result;
+    uint32_t generation; // Counts the threads that used the slot, so stale handles are rejected.
+    bool used;
+    bool joining;
+    bool stopped; // Guarded by the lock of mvm_park, like `awaited`.
+    bool awaited; // Counted in `threads_joining` of the root.
+} MvmThread;
+
+// Handles of spawned threads are their index in this table plus one, with the generation
+// of the slot in the upper 32 bits.
+static MvmThread mvm_threads[MVM_THREADS_CAPACITY];
+static mtx_t mvm_threadsLock;
+static once_flag mvm_threadsOnce = ONCE_FLAG_INIT;
+
+ExceptionState (*mvm_threadMain)(Mvm* mvm) = mvm_execProgram;
+
+static void mvm_initThreads(void)
+{
+    if (mtx_init(&mvm_threadsLock, mtx_plain) != thrd_success) {
+        fprintf(stderr, "ERROR: Could not initialize the thread table!\n");
+        exit(1);
+    }
+}
 
-            mvm->stack[mvm->stack_size - 2].as_f64 /= mvm->stack[mvm->stack_size - 1].as_f64 ;
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+static int mvm_runThread(void* arg)
+{
+    MvmThread* thread = arg;
+    Mvm* root = thread->mvm->root;
+    thread->result = mvm_threadMain(thread->mvm);
+
+    mtx_lock(&mvm_parkLock);
+    root->threads_running -= 1;
+    root->thread_failed = root->thread_failed || thread->result != EXCEPTION_SATE_OK;
+    if (thread->awaited) {
+        root->threads_joining -= 1;
+    }
+    thread->stopped = true;
+    mtx_unlock(&mvm_parkLock);
+    mvm_unpark();
+    return 0;
+}
 
-        case INST_ANDB: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2]= word_u64(mvm->stack[mvm->stack_size - 2].as_u64 & mvm->stack[mvm->stack_size - 1].as_u64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+// Starts a thread at `entry` that shares the memory and program of `mvm`, but has its own stack.
+// The top of the stack is moved onto the stack of the new thread and replaced by its handle.
+ExceptionState mvm_spawn(Mvm* mvm, InstAddr entry)
+{
+    if (mvm->stack_size < 1) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+    call_once(&mvm_threadsOnce, mvm_initThreads);
 
-        case INST_ORB: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 2].as_u64 | mvm->stack[mvm->stack_size - 1].as_u64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
+    Mvm* child = malloc(sizeof(Mvm));
+    if (child == NULL) {
+        return EXCEPTION_THREAD_FAILED;
+    }
+    memcpy(child, mvm, sizeof(Mvm));
+    child->stack[0] = mvm->stack[mvm->stack_size - 1];
+    child->stack_size = 1;
+    child->rstack_size = 0;
+    child->frames_size = 0;
+    child->fp = 0;
+    child->coroutines = NULL;
+    child->coroutine = 0;
+    child->ip = entry;
+    child->halt = false;
+    child->root = mvm->root != NULL ? mvm->root : mvm;
+    // The fuel is shared, the thread leases its own from the root.
+    child->fuel = mvm->fuel == MVM_FUEL_UNLIMITED ? MVM_FUEL_UNLIMITED : 0;
+
+    MvmThread* thread = NULL;
+    mtx_lock(&mvm_threadsLock);
+    for (size_t i = 0; i < MVM_THREADS_CAPACITY; ++i) {
+        if (!mvm_threads[i].used) {
+            thread = &mvm_threads[i];
+            thread->used = true;
+            thread->generation += 1;
+            thread->mvm = child;
             break;
         }
+    }
+    mtx_unlock(&mvm_threadsLock);
+    if (thread == NULL) {
+        free(child);
+        return EXCEPTION_THREAD_FAILED;
+    }
 
-        case INST_XOR: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 2].as_u64 ^ mvm->stack[mvm->stack_size - 1].as_u64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+    call_once(&mvm_parkOnce, mvm_initPark);
+    mtx_lock(&mvm_parkLock);
+    thread->stopped = false;
+    thread->awaited = false;
+    child->root->threads_running += 1;
+    mtx_unlock(&mvm_parkLock);
+    if (thrd_create(&thread->thread, mvm_runThread, thread) != thrd_success) {
+        mtx_lock(&mvm_parkLock);
+        child->root->threads_running -= 1;
+        mtx_unlock(&mvm_parkLock);
+        mtx_lock(&mvm_threadsLock);
+        thread->used = false;
+        mtx_unlock(&mvm_threadsLock);
+        free(child);
+        return EXCEPTION_THREAD_FAILED;
+    }
+    mvm->stack[mvm->stack_size - 1] = word_u64((uint64_t)thread->generation << 32 | ((uint64_t)(thread - mvm_threads) + 1));
+    return EXCEPTION_SATE_OK;
+}
 
-        case INST_NOTB: {
-            if (mvm->stack_size < 1) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 1] = word_u64(~mvm->stack[mvm->stack_size - 1].as_u64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+// Waits for the thread whose handle is on top of the stack and replaces the handle with the
+// top of the thread's stack. Fails with the exception of the thread if it failed.
+ExceptionState mvm_join(Mvm* mvm)
+{
+    if (mvm->stack_size < 1) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+    const uint64_t handle = mvm->stack[mvm->stack_size - 1].as_u64;
+    const uint64_t index = handle & UINT32_MAX;
+    if (index == 0 || index > MVM_THREADS_CAPACITY) {
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+    call_once(&mvm_threadsOnce, mvm_initThreads);
+
+    MvmThread* thread = &mvm_threads[index - 1];
+    mtx_lock(&mvm_threadsLock);
+    const bool joinable = thread->used && !thread->joining && thread->generation == handle >> 32;
+    thread->joining = joinable || thread->joining;
+    mtx_unlock(&mvm_threadsLock);
+    if (!joinable) {
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
 
-        case INST_SHR: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 2].as_u64 >> mvm->stack[mvm->stack_size - 1].as_u64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+    // Counted as blocked for the deadlock detection of mvm_park, until the thread stops.
+    Mvm* root = mvm->root != NULL ? mvm->root : mvm;
+    call_once(&mvm_parkOnce, mvm_initPark);
+    mtx_lock(&mvm_parkLock);
+    if (!thread->stopped) {
+        thread->awaited = true;
+        root->threads_joining += 1;
+    }
+    mtx_unlock(&mvm_parkLock);
+    thrd_join(thread->thread, NULL);
+    const ExceptionState result = thread->result;
+    const Mvm* child = thread->mvm;
+    const Word value = child->stack_size > 0 ? child->stack[child->stack_size - 1] : word_u64(0);
+    if (child->metered && child->fuel != MVM_FUEL_UNLIMITED) {
+        atomic_fetch_add(&child->root->fuel_pool, child->fuel);
+    }
+    mvm_freeCoroutines(thread->mvm);
+    free(thread->mvm);
 
-        case INST_SHL: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2]= word_u64(mvm->stack[mvm->stack_size - 2].as_u64 << mvm->stack[mvm->stack_size - 1].as_u64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+    mtx_lock(&mvm_threadsLock);
+    thread->mvm = NULL;
+    thread->joining = false;
+    thread->used = false;
+    mtx_unlock(&mvm_threadsLock);
 
-        case INST_JMP: {
-            mvm->ip = inst.operand.as_u64;
-            break;
-        }
+    if (result != EXCEPTION_SATE_OK) {
+        return result;
+    }
+    mvm->stack[mvm->stack_size - 1] = value;
+    return EXCEPTION_SATE_OK;
+}
 
-        case INST_JMPIF: {
-            if (mvm->stack_size < 1) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            if (mvm->stack[mvm->stack_size - 1].as_u64) {
-                mvm->ip = inst.operand.as_u64;
-            } else {
-                mvm->ip += 1;
+void mvm_stopThreads(Mvm* mvm)
+{
+    call_once(&mvm_threadsOnce, mvm_initThreads);
+    atomic_store_explicit(&mvm->deadline_expired, 1, memory_order_relaxed);
+    mvm_unpark();
+    for (;;) {
+        MvmThread* thread = NULL;
+        bool waiting = false;
+        mtx_lock(&mvm_threadsLock);
+        for (size_t i = 0; i < MVM_THREADS_CAPACITY && thread == NULL; ++i) {
+            if (mvm_threads[i].used && mvm_threads[i].mvm->root == mvm) {
+                // A thread that is being joined by another one is left to it.
+                waiting = waiting || mvm_threads[i].joining;
+                thread = mvm_threads[i].joining ? NULL : &mvm_threads[i];
             }
-            mvm->stack_size -= 1;
-            break;
         }
-
-        case INST_CALL: {
-            if (mvm->stack_size >= MVM_STACK_CAPACITY) {
-                return EXCEPTION_STACK_OVERFLOW;
-            }
-            mvm->stack[mvm->stack_size++].as_u64 = mvm->ip + 1;
-            mvm->ip = inst.operand.as_u64;
-            break;
+        if (thread != NULL) {
+            thread->joining = true;
         }
+        mtx_unlock(&mvm_threadsLock);
 
-        case INST_INT: {
-            if (inst.operand.as_u64 > mvm->interrupts_size) {
-                return EXCEPTION_ILLEGAL_OPERAND;
+        if (thread == NULL) {
+            if (!waiting) {
+                return;
             }
-            mvm->interrupts[inst.operand.as_u64](mvm);
-            mvm->ip += 1;
-            break;
+            thrd_yield();
+            continue;
         }
+        thrd_join(thread->thread, NULL);
+        mvm_freeCoroutines(thread->mvm);
+        free(thread->mvm);
+
+        mtx_lock(&mvm_threadsLock);
+        thread->mvm = NULL;
+        thread->joining = false;
+        thread->used = false;
+        mtx_unlock(&mvm_threadsLock);
+    }
+}
 
-        case INST_RET: {
-            if (mvm->stack_size < 1) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->ip = mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 1;
-            break;
-        }
+// Opens a frame at the top of the stack and reserves `locals` zeroed words for it.
+ExceptionState mvm_enterFrame(Mvm* mvm, uint64_t locals)
+{
+    if (mvm->frames_size >= MVM_RSTACK_CAPACITY) {
+        return EXCEPTION_RSTACK_OVERFLOW;
+    }
+    if (locals > MVM_STACK_CAPACITY - mvm->stack_size) {
+        return EXCEPTION_STACK_OVERFLOW;
+    }
+    mvm->frames[mvm->frames_size++] = (MvmFrame) {.fp = mvm->fp, .locals = locals};
+    mvm->fp = mvm->stack_size;
+    memset(&mvm->stack[mvm->stack_size], 0, sizeof(Word) * locals);
+    mvm->stack_size += locals;
+    return EXCEPTION_SATE_OK;
+}
 
-        case INST_HALT: {
-            mvm->halt = true;
-            break;
-        }
+// Closes the current frame. The values above the locals are the results, they replace the
+// locals and the `args` words below the frame. Without a return stack the return address
+// below the frame is kept on top of the results, so 'ret' can follow.
+ExceptionState mvm_leaveFrame(Mvm* mvm, uint64_t args)
+{
+    if (mvm->frames_size < 1) {
+        return EXCEPTION_RSTACK_UNDERFLOW;
+    }
+    const MvmFrame frame = mvm->frames[mvm->frames_size - 1];
+    const uint64_t retWords = (mvm->flags & MVM_FLAG_RSTACK) ? 0 : 1;
+    if (mvm->stack_size < mvm->fp + frame.locals || mvm->fp < args + retWords) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
 
-        case INST_EQ: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 1].as_u64 == mvm->stack[mvm->stack_size - 2].as_u64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+    const uint64_t results = mvm->stack_size - mvm->fp - frame.locals;
+    const uint64_t base = mvm->fp - retWords - args;
+    const Word retAddr = retWords ? mvm->stack[mvm->fp - 1] : word_u64(0);
+    memmove(&mvm->stack[base], &mvm->stack[mvm->stack_size - results], sizeof(Word) * results);
+    if (retWords) {
+        mvm->stack[base + results] = retAddr;
+    }
+    mvm->stack_size = base + results + retWords;
+    mvm->fp = frame.fp;
+    mvm->frames_size -= 1;
+    return EXCEPTION_SATE_OK;
+}
 
-        case INST_NOT: {
-            if (mvm->stack_size < 1) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 1] = word_u64(!mvm->stack[mvm->stack_size - 1].as_u64);
-            mvm->ip += 1;
-            break;
+// Creates a suspended coroutine for the function at `entry` and pushes its handle.
+// Only creating the first coroutine of a VM allocates, switching between them never does.
+ExceptionState mvm_coCreate(Mvm* mvm, InstAddr entry)
+{
+    if (mvm->stack_size >= MVM_STACK_CAPACITY) {
+        return EXCEPTION_STACK_OVERFLOW;
+    }
+    if (mvm->coroutines == NULL) {
+        mvm->coroutines = calloc(MVM_COROUTINES_CAPACITY, sizeof(MvmCoroutine));
+        if (mvm->coroutines == NULL) {
+            return EXCEPTION_COROUTINE_FAILED;
         }
+    }
 
-        case INST_GEF: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2] = word_f64(mvm->stack[mvm->stack_size - 1].as_f64 >= mvm->stack[mvm->stack_size - 2].as_f64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
+    for (size_t i = 0; i < MVM_COROUTINES_CAPACITY; ++i) {
+        MvmCoroutine* co = &mvm->coroutines[i];
+        if (!co->used) {
+            co->used = true;
+            co->running = false;
+            co->started = false;
+            co->ip = entry;
+            co->stack_size = 0;
+            co->rstack_size = 0;
+            co->frames_size = 0;
+            co->fp = 0;
+            mvm->stack[mvm->stack_size++] = word_u64(i + 1);
+            return EXCEPTION_SATE_OK;
         }
+    }
+    return EXCEPTION_COROUTINE_FAILED;
+}
 
-        case INST_GEI: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 1].as_u64 >= mvm->stack[mvm->stack_size - 2].as_u64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
-        }
+// Continues the coroutine whose handle is below the top of the stack and passes it the top. The first resume
+// calls its function with the value as the argument, later ones return it from 'yield'.
+ExceptionState mvm_coResume(Mvm* mvm)
+{
+    if (mvm->stack_size < 2) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+    const uint64_t handle = mvm->stack[mvm->stack_size - 2].as_u64;
+    if (mvm->coroutines == NULL || handle == 0 || handle > MVM_COROUTINES_CAPACITY || !mvm->coroutines[handle - 1].used) {
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+    MvmCoroutine* co = &mvm->coroutines[handle - 1];
+    if (co->running) {
+        return EXCEPTION_COROUTINE_FAILED;
+    }
 
-        case INST_LEF: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2] = word_f64(mvm->stack[mvm->stack_size - 1].as_f64 <= mvm->stack[mvm->stack_size - 2].as_f64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
-            break;
+    // Room for the segment, the value and the return address of the first resume.
+    const uint64_t base = mvm->stack_size - 2;
+    if (base + co->stack_size + 2 > MVM_STACK_CAPACITY) {
+        return EXCEPTION_STACK_OVERFLOW;
+    }
+    if (mvm->rstack_size + co->rstack_size + 1 > MVM_RSTACK_CAPACITY || mvm->frames_size + co->frames_size > MVM_RSTACK_CAPACITY) {
+        return EXCEPTION_RSTACK_OVERFLOW;
+    }
+
+    const Word value = mvm->stack[mvm->stack_size - 1];
+    co->base = base;
+    co->rbase = mvm->rstack_size;
+    co->fbase = mvm->frames_size;
+    co->callerFp = mvm->fp;
+    co->callerIp = mvm->ip + 1;
+    co->parent = mvm->coroutine;
+
+    memcpy(&mvm->stack[base], co->stack, sizeof(Word) * co->stack_size);
+    mvm->stack_size = base + co->stack_size;
+    memcpy(&mvm->rstack[mvm->rstack_size], co->rstack, sizeof(InstAddr) * co->rstack_size);
+    mvm->rstack_size += co->rstack_size;
+    for (uint64_t i = 0; i < co->frames_size; ++i) {
+        mvm->frames[mvm->frames_size++] = (MvmFrame) {.fp = co->frames[i].fp + base, .locals = co->frames[i].locals};
+    }
+    mvm->fp = co->fp + base;
+
+    mvm->stack[mvm->stack_size++] = value;
+    if (!co->started) {
+        if (mvm->flags & MVM_FLAG_RSTACK) {
+            mvm->rstack[mvm->rstack_size++] = MVM_COROUTINE_RETURN;
+        } else {
+            mvm->stack[mvm->stack_size++] = word_u64(MVM_COROUTINE_RETURN);
         }
+        co->started = true;
+    }
+    co->running = true;
+    mvm->coroutine = handle;
+    mvm->ip = co->ip;
+    return EXCEPTION_SATE_OK;
+}
 
-        case INST_LEI: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 1].as_u64 <= mvm->stack[mvm->stack_size - 2].as_u64);
-            mvm->stack_size -= 1;
-            mvm->ip += 1;
+// Drops the segment of the running coroutine and continues its resumer with `value` and `resumable` on top.
+static void mvm_coSwitchBack(Mvm* mvm, MvmCoroutine* co, Word value, bool resumable)
+{
+    mvm->stack_size = co->base;
+    mvm->rstack_size = co->rbase;
+    mvm->frames_size = co->fbase;
+    mvm->fp = co->callerFp;
+    mvm->ip = co->callerIp;
+    mvm->coroutine = co->parent;
+    co->running = false;
+    mvm->stack[mvm->stack_size++] = value;
+    mvm->stack[mvm->stack_size++] = word_u64(resumable);
+}
+
+// Suspends the running coroutine, its resumer gets the top of the stack and 1.
+ExceptionState mvm_coYield(Mvm* mvm)
+{
+    if (mvm->coroutine == 0) {
+        return EXCEPTION_COROUTINE_FAILED;
+    }
+    MvmCoroutine* co = &mvm->coroutines[mvm->coroutine - 1];
+    if (mvm->stack_size < co->base + 1 || mvm->rstack_size < co->rbase || mvm->frames_size < co->fbase || mvm->fp < co->base) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+    const uint64_t words = mvm->stack_size - 1 - co->base;
+    const uint64_t calls = mvm->rstack_size - co->rbase;
+    const uint64_t frames = mvm->frames_size - co->fbase;
+    if (words > MVM_COROUTINE_STACK_CAPACITY) {
+        return EXCEPTION_STACK_OVERFLOW;
+    }
+    if (calls > MVM_COROUTINE_STACK_CAPACITY || frames > MVM_COROUTINE_STACK_CAPACITY) {
+        return EXCEPTION_RSTACK_OVERFLOW;
+    }
+
+    const Word value = mvm->stack[mvm->stack_size - 1];
+    memcpy(co->stack, &mvm->stack[co->base], sizeof(Word) * words);
+    co->stack_size = words;
+    memcpy(co->rstack, &mvm->rstack[co->rbase], sizeof(InstAddr) * calls);
+    co->rstack_size = calls;
+    for (uint64_t i = 0; i < frames; ++i) {
+        const MvmFrame frame = mvm->frames[co->fbase + i];
+        co->frames[i] = (MvmFrame) {.fp = frame.fp - co->base, .locals = frame.locals};
+    }
+    co->frames_size = frames;
+    co->fp = mvm->fp - co->base;
+    co->ip = mvm->ip + 1;
+    mvm_coSwitchBack(mvm, co, value, true);
+    return EXCEPTION_SATE_OK;
+}
+
+// Ends the running coroutine after its function returned to MVM_COROUTINE_RETURN. Its resumer gets the
+// top of the stack (the result of the function) and 0, the handle is free again.
+ExceptionState mvm_coReturn(Mvm* mvm)
+{
+    if (mvm->coroutine == 0) {
+        return EXCEPTION_ILLEGAL_INST_ACCESS;
+    }
+    MvmCoroutine* co = &mvm->coroutines[mvm->coroutine - 1];
+    if (mvm->stack_size < co->base || mvm->rstack_size < co->rbase || mvm->frames_size < co->fbase) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+    const Word value = mvm->stack_size > co->base ? mvm->stack[mvm->stack_size - 1] : word_u64(0);
+    co->used = false;
+    mvm_coSwitchBack(mvm, co, value, false);
+    return EXCEPTION_SATE_OK;
+}
+
+void mvm_freeCoroutines(Mvm* mvm)
+{
+    free(mvm->coroutines);
+    mvm->coroutines = NULL;
+    mvm->coroutine = 0;
+}
+
+typedef struct _MVM_CHANNEL_SLOT_ {
+    _Atomic uint64_t seq;
+    Word value;
+    Word size; // Size of a block, 0 for single words.
+} MvmChannel_Slot;
+
+// Bounded MPMC queue (Dmitry Vyukov): every slot carries a sequence number that tells
+// producers and consumers whose turn it is, so neither side takes a lock.
+typedef struct _MVM_CHANNEL_ {
+    _Alignas(64) _Atomic uint64_t head; // Next slot to write.
+    _Alignas(64) _Atomic uint64_t tail; // Next slot to read.
+    _Alignas(64) MvmChannel_Slot* slots;
+    uint64_t mask;
+    const uint8_t* owner; // Memory of the program that created the channel, only its threads may use it.
+    uint32_t generation;  // Counts the channels that used the slot, so stale handles are rejected.
+} MvmChannel;
+
+// Channels live as long as the program that created them. Their handles are their index in this
+// table plus one, with the generation of the slot in the upper 32 bits.
+static MvmChannel mvm_channels[MVM_CHANNELS_CAPACITY];
+static mtx_t mvm_channelsLock;
+static once_flag mvm_channelsOnce = ONCE_FLAG_INIT;
+
+static void mvm_initChannels(void)
+{
+    if (mtx_init(&mvm_channelsLock, mtx_plain) != thrd_success) {
+        fprintf(stderr, "ERROR: Could not initialize the channel table!\n");
+        exit(1);
+    }
+}
+
+uint64_t mvm_channelCreate(const Mvm* mvm, uint64_t capacity)
+{
+    uint64_t size = 2;
+    while (size < capacity && size < ((uint64_t)1 << 32)) {
+        size <<= 1;
+    }
+    MvmChannel_Slot* slots = malloc(sizeof(MvmChannel_Slot) * (size_t)size);
+    if (slots == NULL) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < size; ++i) {
+        atomic_init(&slots[i].seq, i);
+    }
+
+    call_once(&mvm_channelsOnce, mvm_initChannels);
+    mtx_lock(&mvm_channelsLock);
+    MvmChannel* channel = NULL;
+    for (size_t i = 0; i < MVM_CHANNELS_CAPACITY; ++i) {
+        if (mvm_channels[i].slots == NULL) {
+            channel = &mvm_channels[i];
             break;
         }
+    }
+    if (channel == NULL) {
+        mtx_unlock(&mvm_channelsLock);
+        free(slots);
+        return 0;
+    }
+    channel->slots = slots;
+    channel->mask = size - 1;
+    channel->owner = mvm->memory;
+    channel->generation += 1;
+    atomic_store_explicit(&channel->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&channel->tail, 0, memory_order_relaxed);
+    mtx_unlock(&mvm_channelsLock);
+    return (uint64_t)channel->generation << 32 | ((uint64_t)(channel - mvm_channels) + 1);
+}
 
-        case INST_READ8: {
-            if (mvm->stack_size < 1) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            const MemoryAddr addr = mvm->stack[mvm->stack_size - 1].as_u64;
-            if (addr >= MVM_MEMORY_CAPACITY) {
-                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
-            }
-            mvm->stack[mvm->stack_size - 1] = word_u64(mvm->memory[addr]);
-            mvm->ip += 1;
-            break;
+// The creating thread hands the handle to others through the memory, a channel or 'spawn',
+// which orders the creation before any use.
+static MvmChannel* mvm_getChannel(const Mvm* mvm, uint64_t handle)
+{
+    const uint64_t index = handle & UINT32_MAX;
+    if (index == 0 || index > MVM_CHANNELS_CAPACITY) {
+        return NULL;
+    }
+    MvmChannel* channel = &mvm_channels[index - 1];
+    if (channel->slots == NULL || channel->owner != mvm->memory || channel->generation != handle >> 32) {
+        return NULL;
+    }
+    return channel;
+}
+
+void mvm_freeChannels(const Mvm* mvm)
+{
+    call_once(&mvm_channelsOnce, mvm_initChannels);
+    mtx_lock(&mvm_channelsLock);
+    for (size_t i = 0; i < MVM_CHANNELS_CAPACITY; ++i) {
+        if (mvm_channels[i].slots != NULL && mvm_channels[i].owner == mvm->memory) {
+            free(mvm_channels[i].slots);
+            mvm_channels[i].slots = NULL;
+            mvm_channels[i].owner = NULL;
         }
+    }
+    mtx_unlock(&mvm_channelsLock);
+}
 
-        case INST_READ16: {
-            if (mvm->stack_size < 1) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            const MemoryAddr addr = mvm->stack[mvm->stack_size - 1].as_u64;
-            if (addr >= MVM_MEMORY_CAPACITY - 1) {
-                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+static ExceptionState mvm_leaseFuel(Mvm* mvm, uint64_t needed);
+
+// Backs off while a channel is full or empty, first spinning and then parking the thread (see mvm_park).
+// Every round parked costs one unit of fuel, so a blocked program runs out of fuel like a running one.
+// Gives up when the run time limit of the VM expires.
+static ExceptionState mvm_channelWait(Mvm* mvm, uint64_t* spins, uint64_t epoch)
+{
+    const Mvm* root = mvm->root != NULL ? mvm->root : mvm;
+    if (atomic_load_explicit(&root->deadline_expired, memory_order_relaxed)) {
+        return EXCEPTION_TIMEOUT;
+    }
+    if (++*spins < MVM_CHANNEL_SPINS) {
+        return EXCEPTION_SATE_OK;
+    }
+    if (mvm->metered && mvm->fuel != MVM_FUEL_UNLIMITED) {
+        if (mvm->fuel == 0) {
+            ExceptionState err = mvm_leaseFuel(mvm, 1);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
             }
-            mvm->stack[mvm->stack_size - 1] = word_u64(*(uint16_t*)&mvm->memory[addr]);
-            mvm->ip += 1;
-            break;
         }
+        mvm->fuel -= 1;
+    }
+    return mvm_park(mvm, epoch);
+}
 
-        case INST_READ32: {
-            if (mvm->stack_size < 1) {
-                return EXCEPTION_STACK_UNDERFLOW;
+ExceptionState mvm_channelSend(Mvm* mvm, uint64_t handle, Word value, Word size)
+{
+    MvmChannel* channel = mvm_getChannel(mvm, handle);
+    if (channel == NULL) {
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+
+    uint64_t spins = 0;
+    uint64_t epoch = atomic_load(&mvm_parkEpoch);
+    uint64_t pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    for (;;) {
+        MvmChannel_Slot* slot = &channel->slots[pos & channel->mask];
+        const uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        const int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->value = value;
+                slot->size = size;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                mvm_unpark();
+                return EXCEPTION_SATE_OK;
             }
-            const MemoryAddr addr = mvm->stack[mvm->stack_size - 1].as_u64;
-            if (addr >= MVM_MEMORY_CAPACITY - 3) {
-                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+        } else if (diff < 0) {
+            // Full, wait for a receiver.
+            ExceptionState err = mvm_channelWait(mvm, &spins, epoch);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
             }
-            mvm->stack[mvm->stack_size - 1] = word_u64(*(uint32_t*)&mvm->memory[addr]);
-            mvm->ip += 1;
-            break;
+            epoch = atomic_load(&mvm_parkEpoch);
+            pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
         }
+    }
+}
 
-        case INST_READ64: {
-            if (mvm->stack_size < 1) {
-                return EXCEPTION_STACK_UNDERFLOW;
+ExceptionState mvm_channelRecv(Mvm* mvm, uint64_t handle, Word* value, Word* size)
+{
+    MvmChannel* channel = mvm_getChannel(mvm, handle);
+    if (channel == NULL) {
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+
+    uint64_t spins = 0;
+    uint64_t epoch = atomic_load(&mvm_parkEpoch);
+    uint64_t pos = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    for (;;) {
+        MvmChannel_Slot* slot = &channel->slots[pos & channel->mask];
+        const uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        const int64_t diff = (int64_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *value = slot->value;
+                *size = slot->size;
+                atomic_store_explicit(&slot->seq, pos + channel->mask + 1, memory_order_release);
+                mvm_unpark();
+                return EXCEPTION_SATE_OK;
             }
-            const MemoryAddr addr = mvm->stack[mvm->stack_size - 1].as_u64;
-            if (addr >= MVM_MEMORY_CAPACITY - 7) {
-                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+        } else if (diff < 0) {
+            // Empty, wait for a sender.
+            ExceptionState err = mvm_channelWait(mvm, &spins, epoch);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
             }
-            mvm->stack[mvm->stack_size - 1] = word_u64(*(uint64_t*)&mvm->memory[addr]);
-            mvm->ip += 1;
-            break;
+            epoch = atomic_load(&mvm_parkEpoch);
+            pos = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&channel->tail, memory_order_relaxed);
         }
+    }
+}
 
-        case INST_WRITE8: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            const MemoryAddr addr = mvm->stack[mvm->stack_size - 2].as_u64;
-            if (addr >= MVM_MEMORY_CAPACITY) {
-                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+void mvm_pushInterrupt(Mvm* mvm, MvmInterrupt interrupt)
+{
+    if (mvm->interrupts_size >= MVM_NATIVES_CAPACITY) {
+        fprintf(stderr, "ERROR: Failed to build interrupt table!");
+        exit(1);
+    }
+    mvm->interrupts[mvm->interrupts_size++] = interrupt;
+}
+
+// Builds the interrupt table the stdlib expects. The order defines the interrupt numbers.
+void mvm_pushStdInterrupts(Mvm* mvm)
+{
+    mvm_pushInterrupt(mvm, interrupt_PRINTchar); // 0
+    mvm_pushInterrupt(mvm, interrupt_PRINTf64);  // 1
+    mvm_pushInterrupt(mvm, interrupt_PRINTi64);  // 2
+    mvm_pushInterrupt(mvm, interrupt_PRINTu64);  // 3
+    mvm_pushInterrupt(mvm, interrupt_PRINTptr);  // 4
+    mvm_pushInterrupt(mvm, interrupt_ALLOC);     // 5
+    mvm_pushInterrupt(mvm, interrupt_FREE);      // 6
+    mvm_pushInterrupt(mvm, interrupt_DUMPMEM);   // 7
+    mvm_pushInterrupt(mvm, interrupt_WRITE);     // 8
+    mvm_pushInterrupt(mvm, interrupt_READLINE);  // 9
+    mvm_pushInterrupt(mvm, interrupt_CHANCREATE);  // 10
+    mvm_pushInterrupt(mvm, interrupt_CHANSEND);    // 11
+    mvm_pushInterrupt(mvm, interrupt_CHANRECV);    // 12
+    mvm_pushInterrupt(mvm, interrupt_CHANSENDBLK); // 13
+    mvm_pushInterrupt(mvm, interrupt_CHANRECVBLK); // 14
+    mvm_pushInterrupt(mvm, interrupt_STRLEN);      // 15
+    mvm_pushInterrupt(mvm, interrupt_STRTRANSLATE); // 16
+    mvm_pushInterrupt(mvm, interrupt_STRFIND);     // 17
+    mvm_pushInterrupt(mvm, interrupt_STRCOUNT);    // 18
+    mvm_pushInterrupt(mvm, interrupt_U64TOSTR);    // 19
+    mvm_pushInterrupt(mvm, interrupt_STRTOU64);    // 20
+    mvm_pushInterrupt(mvm, interrupt_FILEOPEN);    // 21
+    mvm_pushInterrupt(mvm, interrupt_FILECLOSE);   // 22
+    mvm_pushInterrupt(mvm, interrupt_FILEREAD);    // 23
+    mvm_pushInterrupt(mvm, interrupt_FILEWRITE);   // 24
+    mvm_pushInterrupt(mvm, interrupt_FILESIZE);    // 25
+    mvm_pushInterrupt(mvm, interrupt_FILEMAP);     // 26
+    mvm_pushInterrupt(mvm, interrupt_FILEUNMAP);   // 27
+    mvm_pushInterrupt(mvm, interrupt_AIOREAD);     // 28
+    mvm_pushInterrupt(mvm, interrupt_AIOWRITE);    // 29
+    mvm_pushInterrupt(mvm, interrupt_AIOPOLL);     // 30
+    mvm_pushInterrupt(mvm, interrupt_AIOWAIT);     // 31
+    mvm_initStringKernels();
+}
+
+// Appends the imported interrupts of the program to the interrupt table. masm numbers the imports from
+// MVM_IMPORT_VECTORS on, so images stay valid when standard interrupts are added; their 'int' instructions
+// are pointed at the linked interrupts here.
+void mvm_linkImports(Mvm* mvm, const MvmNative* natives, size_t natives_size)
+{
+    const uint64_t base = mvm->interrupts_size;
+    for (InstAddr ip = 0; ip < mvm->program_size; ++ip) {
+        Inst* inst = &mvm->program[ip];
+        if (inst->type == INST_INT && inst->operand.as_u64 >= MVM_IMPORT_VECTORS
+            && inst->operand.as_u64 < MVM_IMPORT_VECTORS + mvm->imports_size) {
+            inst->operand.as_u64 = base + (inst->operand.as_u64 - MVM_IMPORT_VECTORS);
+        }
+    }
+    for (size_t i = 0; i < mvm->imports_size; ++i) {
+        const MvmNative* native = NULL;
+        for (size_t j = 0; j < natives_size && native == NULL; ++j) {
+            if (strcmp(natives[j].name, mvm->imports[i]) == 0) {
+                native = &natives[j];
             }
-            mvm->memory[addr] = (uint8_t)mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 2;
-            mvm->ip += 1;
-            break;
         }
+        if (native == NULL) {
+            fprintf(stderr, "ERROR: Interrupt '%s' is not provided by any plugin!\n", mvm->imports[i]);
+            exit(1);
+        }
+        mvm_pushInterrupt(mvm, native->interrupt);
+    }
+}
 
-        case INST_WRITE16: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            const MemoryAddr addr = mvm->stack[mvm->stack_size - 2].as_u64;
-            if (addr >= MVM_MEMORY_CAPACITY - 1) {
-                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+void mvm_dumpStack(FILE *stream, const Mvm* mvm)
+{
+    fprintf(stream, "STACK:\n");
+    if (mvm->stack_size > 0) {
+        for (InstAddr i = 0; i < mvm->stack_size; ++i) {
+            fprintf(stream, "  u64: %" PRIu64 " | i64: %" PRId64 " | f64: %lf",
+                    mvm->stack[i].as_u64,
+                    mvm->stack[i].as_i64,
+                    mvm->stack[i].as_f64);
+            if ((uintptr_t)mvm->stack[i].as_ptr > 0) {
+                fprintf(stream, " | ptr: 0x%" PRIx64 "\n", (uint64_t)*(uintptr_t*) &mvm->stack[i].as_ptr);
+            } else {
+                fprintf(stream, " | ptr: (nil)\n");
             }
-            *(uint16_t*)&mvm->memory[addr] = (uint16_t)mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 2;
-            mvm->ip += 1;
-            break;
         }
+    } else {
+        fprintf(stream, " [empty]\n");
+    }
+}
 
-        case INST_WRITE32: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            const MemoryAddr addr = mvm->stack[mvm->stack_size - 2].as_u64;
-            if (addr >= MVM_MEMORY_CAPACITY - 3) {
-                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
-            }
-            *(uint32_t*)&mvm->memory[addr] = (uint32_t)mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 2;
-            mvm->ip += 1;
+
+// Prints the return addresses of all active calls, innermost first. Only tracked in MVM_FLAG_RSTACK mode.
+void mvm_dumpCallStack(FILE *stream, const Mvm* mvm)
+{
+    fprintf(stream, "CALL STACK:\n");
+    if (!(mvm->flags & MVM_FLAG_RSTACK)) {
+        fprintf(stream, " [not tracked]\n");
+        return;
+    }
+    fprintf(stream, "  at %" PRIu64 "\n", mvm->ip);
+    uint64_t coroutine = mvm->coroutine;
+    for (uint64_t i = mvm->rstack_size; i > 0; --i) {
+        if (mvm->rstack_size - i >= MVM_CALLSTACK_DUMP_LIMIT) {
+            fprintf(stream, "  ... %" PRIu64 " more\n", i);
             break;
         }
+        // The function of a coroutine returns to its resumer, innermost coroutine first.
+        if (mvm->rstack[i - 1] == MVM_COROUTINE_RETURN && coroutine != 0) {
+            const MvmCoroutine* co = &mvm->coroutines[coroutine - 1];
+            fprintf(stream, "  from %" PRIu64 " (coresume)\n", co->callerIp - 1);
+            coroutine = co->parent;
+            continue;
+        }
+        fprintf(stream, "  from %" PRIu64 "\n", mvm->rstack[i - 1] - 1);
+    }
+}
 
-        case INST_WRITE64: {
-            if (mvm->stack_size < 2) {
-                return EXCEPTION_STACK_UNDERFLOW;
-            }
-            const MemoryAddr addr = mvm->stack[mvm->stack_size - 2].as_u64;
-            if (addr >= MVM_MEMORY_CAPACITY - 7) {
-                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
-            }
-            *(uint64_t*)&mvm->memory[addr] = (uint64_t)mvm->stack[mvm->stack_size - 1].as_u64;
-            mvm->stack_size -= 2;
-            mvm->ip += 1;
-            break;
+// Prints `size` bytes of memory starting at `addr`, 16 bytes per line.
+void mvm_dumpMemory(FILE *stream, const Mvm* mvm, MemoryAddr addr, uint64_t size)
+{
+    fprintf(stream, "MEMORY:\n");
+    for (uint64_t i = 0; i < size && addr + i < MVM_MEMORY_CAPACITY; ++i) {
+        if (i % 16 == 0) {
+            fprintf(stream, "%s  %08" PRIX64 ":", i > 0 ? "\n" : "", addr + i);
         }
+        fprintf(stream, " %02X", mvm->memory[addr + i]);
+    }
+    fprintf(stream, "\n");
+}
 
-        case NUMBER_OF_INSTS:
-        default:
-            return EXCEPTION_ILLEGAL_INST;
+bool mvm_readProgramFile(Mvm* mvm, const char* filePath, char* error, size_t errorSize)
+{
+    FILE* f = fopen(filePath, "rb");
+    if (f == NULL) {
+        snprintf(error, errorSize, "Could not open file '%s'! : %s", filePath, strerror(errno));
+        return false;
+    }
+
+    size_t n;
+
+    // Read and verify meta data.
+    MvmFile_Meta meta = {0};
+
+    n = fread(&meta, sizeof(meta), 1, f);
+    if (n < 1) {
+        snprintf(error, errorSize, "Could not read MVM_META from file '%s'! : %s", filePath,
+                 feof(f) ? "The file is too short" : strerror(errno));
+        goto fail;
+    }
+
+    if (meta.magic != MVM_FILE_MAGIC) {
+        snprintf(error, errorSize, "'%s' is not a valid mvm file! : "
+                                   "Unexpected magic '%04X' : "
+                                   "Expected '%04X'", filePath, meta.magic, MVM_FILE_MAGIC);
+        goto fail;
+    }
+
+    if (meta.version != MVM_FILE_VERSION) {
+        snprintf(error, errorSize, "Unsupported file version %d in file '%s'! : "
+                                   "Expected version %d", meta.version, filePath, MVM_FILE_VERSION);
+        goto fail;
+    }
+    
+    if (meta.os != OS && meta.wos) {
+    	switch (meta.os) {
+    	   case (uint16_t)0x544e: 
+    	      printf("[!] This programm was compiled for Windows based systems\n");
+    	      break;
+    	   case (uint16_t)0x5855:
+    	      printf("[!] This programm was compiled for UNIX based systems\n");
+    	      break;
+    	   case (uint16_t)0x4c41:
+    	      printf("[!] This programm was compiled for Mac-OS-X based systems\n");
+    	      break;
+    	   case (uint16_t)0x584c:
+    	      printf("[!] This programm was compiled for LINUX based systems\n");
+    	      break;
+    	   case (uint16_t)0x4246:
+    	      printf("[!] This programm was compiled for FreeBSD based systems\n");
+    	      break;
+    	   case (uint16_t)0x4441:
+    	      printf("[!] This programm was compiled for Android based systems\n");
+    	      break;
+    	   default:
+    	      printf("[!] This programm was compiled for an UNKNOWN operating system\n");
+    	      break;
+    	}
+    }
+
+    if (meta.program_size > MVM_PROGRAM_CAPACITY) {
+        snprintf(error, errorSize, "To large program section in file '%s'! : "
+                                   "This file contains %" PRIu64 " instructions. : "
+                                   "The max amount of instructions for this section is %d.",
+                                   filePath, meta.program_size, MVM_PROGRAM_CAPACITY);
+        goto fail;
+    }
+
+    if (meta.memory_capacity > MVM_MEMORY_CAPACITY) {
+        snprintf(error, errorSize, "To large memory section in file '%s'! : "
+                                   "This files memory section size is %" PRIu64 " bytes big. : "
+                                   "The max size for this section is %d bytes.",
+                                   filePath, meta.memory_capacity, MVM_MEMORY_CAPACITY);
+        goto fail;
+    }
+
+    if (meta.memory_size > meta.memory_capacity)
+    {
+        snprintf(error, errorSize, "To large memory section in file '%s'! : "
+                                   "%" PRIu64 " bytes of memory are declared but the memory section is %" PRIu64 " bytes big.",
+                                   filePath, meta.memory_capacity, meta.memory_size);
+        goto fail;
+    }
+
+    // Read the program.
+    mvm->program_size = fread(mvm->program, sizeof(mvm->program[0]), (size_t)meta.program_size, f);
+    if (mvm->program_size != meta.program_size) {
+        snprintf(error, errorSize, "Could only read %" PRIu64 " from a total of %" PRIu64 " program instructions from file '%s'!",
+                mvm->program_size, meta.program_size, filePath);
+        goto fail;
+    }
+
+    // Read the memory.
+    mvm_initMemory(mvm);
+    n = fread(mvm->memory, sizeof(mvm->memory[0]), (size_t)meta.memory_size, f);
+    if (n != meta.memory_size) {
+        snprintf(error, errorSize, "Could only read %zd from a total of %" PRIu64 " bytes of memory section from file '%s'!",
+                n, meta.memory_size, filePath);
+        goto fail;
+    }
+
+    mvm->memory_size = meta.memory_size;
+    mvm->flags = meta.flags;
+
+    // Read the symbols.
+    mvm->symbols_size = 0;
+    mvm->symbolNames_size = 0;
+    uint64_t symbolsLeft = meta.symbols_size;
+    while (symbolsLeft > 0) {
+        MvmFile_Symbol symbol = {0};
+        char name[UINT16_MAX];
+        if (symbolsLeft < sizeof(symbol)
+            || fread(&symbol, sizeof(symbol), 1, f) != 1
+            || symbolsLeft - sizeof(symbol) < symbol.name_size
+            || fread(name, 1, symbol.name_size, f) != symbol.name_size) {
+            snprintf(error, errorSize, "Could not read MVM_SYMBOLS from file '%s'! : Corrupted symbol section", filePath);
+            goto fail;
+        }
+        symbolsLeft -= sizeof(symbol) + symbol.name_size;
+        if (!mvm_pushSymbol(mvm, (StringView) {.count = symbol.name_size, .data = name}, symbol.addr)) {
+            snprintf(error, errorSize, "Too many symbols in file '%s'!", filePath);
+            goto fail;
+        }
+    }
+
+    // Read the imports.
+    mvm->imports_size = 0;
+    for (uint64_t i = 0; i < meta.imports_size; ++i) {
+        MvmFile_Import import = {0};
+        char name[UINT16_MAX];
+        if (fread(&import, sizeof(import), 1, f) != 1 || fread(name, 1, import.name_size, f) != import.name_size) {
+            snprintf(error, errorSize, "Could not read MVM_IMPORTS from file '%s'! : Corrupted import section", filePath);
+            goto fail;
+        }
+        if (!mvm_pushImport(mvm, (StringView) {.count = import.name_size, .data = name})) {
+            snprintf(error, errorSize, "Too many imports in file '%s'!", filePath);
+            goto fail;
+        }
+    }
+
+    fclose(f);
+    return true;
+
+fail:
+    // Leave nothing of a broken image in the memory, the caller may load another program instead.
+    if (mvm->memory != NULL && meta.memory_size <= MVM_MEMORY_CAPACITY) {
+        memset(mvm->memory, 0, (size_t)meta.memory_size);
+    }
+    fclose(f);
+    return false;
+}
+
+void mvm_loadProgramFromFile(Mvm* mvm, const char* filePath)
+{
+    char error[MVM_FILE_PATH_CAPACITY + 256];
+    if (!mvm_readProgramFile(mvm, filePath, error, sizeof(error))) {
+        fprintf(stderr, "ERROR: %s\n", error);
+        exit(1);
+    }
+}
+
+void mvm_loadProgramFromMasm(Mvm* mvm, const Masm* masm)
+{
+    if (masm->memory_capacity > MVM_MEMORY_CAPACITY) {
+        fprintf(stderr, "ERROR: To large memory section! : "
+                        "The memory section size is %zu bytes big. : "
+                        "The max size for this section is %d bytes.\n",
+                        masm->memory_capacity, MVM_MEMORY_CAPACITY);
+        exit(1);
+    }
+
+    memcpy(mvm->program, masm->program, sizeof(masm->program[0]) * (size_t)masm->program_size);
+    mvm->program_size = masm->program_size;
+    mvm_initMemory(mvm);
+    memcpy(mvm->memory, masm->memory, masm->memory_size);
+    mvm->memory_size = masm->memory_size;
+    mvm->flags = masm->flags;
+
+    mvm->symbols_size = 0;
+    mvm->symbolNames_size = 0;
+    for (size_t i = 0; i < masm->labels_size; ++i) {
+        if (masm->labels[i].is_addr && !mvm_pushSymbol(mvm, masm->labels[i].name, masm->labels[i].word.as_u64)) {
+            fprintf(stderr, "ERROR: Too many symbols! : The max amount of symbols is %d.\n", MVM_SYMBOLS_CAPACITY);
+            exit(1);
+        }
+    }
+
+    mvm->imports_size = 0;
+    for (size_t i = 0; i < masm->imports_size; ++i) {
+        if (!mvm_pushImport(mvm, masm->imports[i])) {
+            fprintf(stderr, "ERROR: Too many imports! : The max amount of imports is %d.\n", MVM_IMPORTS_CAPACITY);
+            exit(1);
+        }
+    }
+}
+
+// Imports longer than MVM_IMPORT_NAME_CAPACITY - 1 are rejected by masm already.
+bool mvm_pushImport(Mvm* mvm, StringView name)
+{
+    if (mvm->imports_size >= MVM_IMPORTS_CAPACITY || name.count >= MVM_IMPORT_NAME_CAPACITY) {
+        return false;
+    }
+    memcpy(mvm->imports[mvm->imports_size], name.data, name.count);
+    mvm->imports[mvm->imports_size][name.count] = '\0';
+    mvm->imports_size += 1;
+    return true;
+}
+
+bool mvm_pushSymbol(Mvm* mvm, StringView name, InstAddr addr)
+{
+    if (mvm->symbols_size >= MVM_SYMBOLS_CAPACITY
+        || mvm->symbolNames_size + name.count > MVM_SYMBOL_NAMES_CAPACITY) {
+        return false;
+    }
+    char* data = &mvm->symbolNames[mvm->symbolNames_size];
+    memcpy(data, name.data, name.count);
+    mvm->symbolNames_size += name.count;
+    mvm->symbols[mvm->symbols_size++] = (MvmSymbol) {
+            .name = {.count = name.count, .data = data},
+            .addr = addr
+    };
+    return true;
+}
+
+bool mvm_resolveSymbol(const Mvm* mvm, StringView name, InstAddr* out)
+{
+    for (size_t i = 0; i < mvm->symbols_size; ++i) {
+        if (sv_eq(mvm->symbols[i].name, name)) {
+            *out = mvm->symbols[i].addr;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the closest symbol at or before `addr`, NULL if there is none.
+const MvmSymbol* mvm_findSymbol(const Mvm* mvm, InstAddr addr)
+{
+    const MvmSymbol* result = NULL;
+    for (size_t i = 0; i < mvm->symbols_size; ++i) {
+        if (mvm->symbols[i].addr <= addr && (result == NULL || mvm->symbols[i].addr > result->addr)) {
+            result = &mvm->symbols[i];
+        }
+    }
+    return result;
+}
+
+const MasmInline* masm_findInline(const Masm* masm, StringView name)
+{
+    for (size_t i = 0; i < masm->inlines_size; ++i) {
+        if (sv_eq(masm->inlines[i].name, name)) {
+            return &masm->inlines[i];
+        }
+    }
+    return NULL;
+}
+
+// Labels defined inside an inline routine get a unique name for every expansion.
+static StringView masm_mangleInlineLabel(Masm* masm, const MasmInline* inl, size_t expansion, StringView name)
+{
+    if (inl == NULL) {
+        return name;
+    }
+    for (size_t i = 0; i < inl->locals_size; ++i) {
+        if (sv_eq(masm->inlineLocals[inl->locals_begin + i], name)) {
+            size_t size = name.count + 32;
+            char* mangled = masm_memarenaAlloc(masm, size);
+            int n = snprintf(mangled, size, "%" PRIsv "@%zu", SV_FORMAT(name), expansion);
+            return (StringView) {.count = (size_t)n, .data = mangled};
+        }
+    }
+    return name;
+}
+
+// Places a string literal operand of the next instruction. With `share_literals` identical literals share their
+// bytes, programs assembled like that must not write to them. Strings of a %define are never shared.
+static Word masm_pushLiteralOperand(Masm* masm, StringView literal)
+{
+    StringView string = {.count = literal.count - 2, .data = literal.data + 1};
+    size_t data = masm->data_size;
+    for (size_t i = 0; masm->share_literals && string.count > 0 && i < masm->data_size; ++i) {
+        const MasmData* other = &masm->data[i];
+        if (other->name.count == 0 && !other->reserved && other->size == string.count
+            && memcmp(&masm->memory[other->addr], string.data, string.count) == 0) {
+            data = i;
+            break;
+        }
+    }
+    if (data == masm->data_size) {
+        masm_translateLiteral(masm, literal, &(Word) {0});
+    }
+    if (masm->dataRefs_size < MVM_PROGRAM_CAPACITY) {
+        masm->dataRefs[masm->dataRefs_size++] = (MasmDataRef) {.inst = masm->program_size, .data = data};
+    }
+    return word_u64(masm->data[data].addr);
+}
+
+static uint64_t masm_alignUp(uint64_t value, uint64_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+// A number or the name of a %define.
+static bool masm_translateValue(Masm* masm, StringView sv, bool isFloat, Word* out)
+{
+    for (size_t i = 0; i < masm->labels_size; ++i) {
+        if (!masm->labels[i].is_addr && sv_eq(masm->labels[i].name, sv)) {
+            *out = masm->labels[i].word;
+            return true;
+        }
+    }
+    char buffer[64];
+    if (sv.count == 0 || sv.count >= sizeof(buffer) || *sv.data == '"') {
+        return false;
+    }
+    memcpy(buffer, sv.data, sv.count);
+    buffer[sv.count] = '\0';
+    char* end = NULL;
+    *out = isFloat ? word_f64(strtod(buffer, &end)) : word_u64(strtoull(buffer, &end, 0));
+    return *end == '\0';
+}
+
+static bool masm_parseAlignment(Masm* masm, StringView sv, uint64_t* out)
+{
+    Word align = {0};
+    if (!masm_translateValue(masm, sv, false, &align) || align.as_u64 == 0 || align.as_u64 > MVM_MEMORY_ALIGNMENT
+        || (align.as_u64 & (align.as_u64 - 1)) != 0) {
+        return false;
+    }
+    *out = align.as_u64;
+    return true;
+}
+
+// Pads the memory section with zeros up to the next multiple of `align`.
+static void masm_alignMemory(Masm* masm, StringView inputFile, int lineNum, uint64_t align)
+{
+    const uint64_t size = masm_alignUp(masm->memory_size, align);
+    if (size > MVM_MEMORY_CAPACITY) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: The memory section is full!\n", SV_FORMAT(inputFile), lineNum);
+        exit(1);
+    }
+    memset(&masm->memory[masm->memory_size], 0, size - masm->memory_size);
+    masm->memory_size = size;
+    if (masm->memory_size > masm->memory_capacity) {
+        masm->memory_capacity = masm->memory_size;
+    }
+}
+
+static void masm_pushData(Masm* masm, StringView inputFile, int lineNum, StringView name, uint64_t size, bool reserved)
+{
+    if (masm->data_size >= MASM_DATA_CAPACITY) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: Too many data definitions! : The max amount is %d.\n",
+                SV_FORMAT(inputFile), lineNum, MASM_DATA_CAPACITY);
+        exit(1);
+    }
+    masm->data[masm->data_size++] = (MasmData) {.name = name, .addr = masm->memory_size, .size = size, .reserved = reserved};
+}
+
+// '%data <name> <type> <values...>' places an array of u8, u16, u32, u64 or f64 values at the next
+// address aligned to the size of the type. The name is bound to its address.
+static void masm_defineData(Masm* masm, StringView inputFile, int lineNum, StringView line)
+{
+    static const struct {
+        const char* name;
+        uint64_t size;
+    } types[] = {{"u8", 1}, {"u16", 2}, {"u32", 4}, {"u64", 8}, {"f64", 8}};
+
+    line = sv_trim(sv_chopByDelim(&line, MASM_COMMENT_SYMBOL));
+    StringView name = sv_chopByDelim(&line, ' ');
+    line = sv_trim(line);
+    StringView typeName = sv_chopByDelim(&line, ' ');
+    line = sv_trim(line);
+    size_t type = sizeof(types) / sizeof(types[0]);
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        if (sv_eq(typeName, cstr_as_sv(types[i].name))) {
+            type = i;
+        }
+    }
+    if (name.count == 0 || type == sizeof(types) / sizeof(types[0]) || line.count == 0) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: Expected '%%data <name> <u8|u16|u32|u64|f64> <values...>'!\n",
+                SV_FORMAT(inputFile), lineNum);
+        exit(1);
+    }
+
+    const uint64_t width = types[type].size;
+    masm_alignMemory(masm, inputFile, lineNum, width);
+    const MemoryAddr addr = masm->memory_size;
+    if (!masm_bindLabel(masm, name, word_u64(addr))) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is already defined!\n", SV_FORMAT(inputFile), lineNum, SV_FORMAT(name));
+        exit(1);
+    }
+
+    uint64_t size = 0;
+    for (; line.count > 0; line = sv_trim(line)) {
+        StringView token = sv_chopByDelim(&line, ' ');
+        Word value = {0};
+        if (!masm_translateValue(masm, token, sv_eq(typeName, cstr_as_sv("f64")), &value)) {
+            fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is not a number!\n", SV_FORMAT(inputFile), lineNum, SV_FORMAT(token));
+            exit(1);
+        }
+        if (addr + size + width > MVM_MEMORY_CAPACITY) {
+            fprintf(stderr, "%" PRIsv ":%d: ERROR: The memory section is full!\n", SV_FORMAT(inputFile), lineNum);
+            exit(1);
+        }
+        uint8_t* dest = &masm->memory[addr + size];
+        if (width == 1) {
+            *dest = (uint8_t)value.as_u64;
+        } else if (width == 2) {
+            memcpy(dest, &(uint16_t) {(uint16_t)value.as_u64}, 2);
+        } else if (width == 4) {
+            memcpy(dest, &(uint32_t) {(uint32_t)value.as_u64}, 4);
+        } else {
+            memcpy(dest, &value.as_u64, 8);
+        }
+        size += width;
+    }
+
+    masm_pushData(masm, inputFile, lineNum, name, size, false);
+    masm->memory_size += size;
+    if (masm->memory_size > masm->memory_capacity) {
+        masm->memory_capacity = masm->memory_size;
+    }
+}
+
+// '%bss <name> <size> [<align>]' reserves zero-initialized memory. The regions are placed behind all
+// initialized data once the whole source is read, so the file only has to store their sizes.
+static void masm_reserveData(Masm* masm, StringView inputFile, int lineNum, StringView line)
+{
+    line = sv_trim(sv_chopByDelim(&line, MASM_COMMENT_SYMBOL));
+    StringView name = sv_chopByDelim(&line, ' ');
+    line = sv_trim(line);
+    StringView sizeText = sv_chopByDelim(&line, ' ');
+    StringView alignText = sv_trim(line);
+    Word size = {0};
+    uint64_t align = MASM_DATA_DEFAULT_ALIGNMENT;
+    if (name.count == 0 || !masm_translateValue(masm, sizeText, false, &size)
+        || (alignText.count > 0 && !masm_parseAlignment(masm, alignText, &align))) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: Expected '%%bss <name> <size> [<align>]'!\n", SV_FORMAT(inputFile), lineNum);
+        exit(1);
+    }
+    for (size_t i = 0; i < masm->labels_size; ++i) {
+        if (sv_eq(masm->labels[i].name, name)) {
+            fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is already defined!\n", SV_FORMAT(inputFile), lineNum, SV_FORMAT(name));
+            exit(1);
+        }
+    }
+    masm_pushData(masm, inputFile, lineNum, name, size.as_u64, true);
+    masm->data[masm->data_size - 1].align = align;
+}
+
+// Places the %bss regions behind the initialized data and binds their names.
+static void masm_placeReservedData(Masm* masm, StringView inputFile)
+{
+    uint64_t end = masm->memory_size;
+    for (size_t i = 0; i < masm->data_size; ++i) {
+        MasmData* data = &masm->data[i];
+        if (!data->reserved) {
+            continue;
+        }
+        data->addr = masm_alignUp(end, data->align);
+        end = data->addr + data->size;
+        if (data->size > MVM_MEMORY_CAPACITY || end > MVM_MEMORY_CAPACITY) {
+            fprintf(stderr, "%" PRIsv ": ERROR: Not enough memory for '%%bss %" PRIsv "'! : %" PRIu64 " bytes are available.\n",
+                    SV_FORMAT(inputFile), SV_FORMAT(data->name), (uint64_t)MVM_MEMORY_CAPACITY);
+            exit(1);
+        }
+        if (!masm_bindLabel(masm, data->name, word_u64(data->addr))) {
+            fprintf(stderr, "%" PRIsv ": ERROR: '%" PRIsv "' is already defined!\n", SV_FORMAT(inputFile), SV_FORMAT(data->name));
+            exit(1);
+        }
+    }
+    if (end > masm->memory_capacity) {
+        masm->memory_capacity = end;
+    }
+}
+
+static void masm_translateSource(Masm* masm, StringView inputFile, StringView source, int lineNum, size_t level,
+                                 const MasmInline* inl, size_t expansion);
+
+static void masm_expandInline(Masm* masm, StringView inputFile, int lineNum, const MasmInline* inl, size_t level)
+{
+    if (masm->inline_depth + 1 >= MASM_MAX_INLINE_DEPTH) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: Exceeded maximum-inline-depth while expanding '%" PRIsv "'!\n",
+                SV_FORMAT(inputFile), lineNum, SV_FORMAT(inl->name));
+        exit(1);
+    }
+    masm->inline_depth += 1;
+    masm_translateSource(masm, inl->file, inl->body, inl->line, level, inl, masm->inlineExpansions_size++);
+    masm->inline_depth -= 1;
+}
+
+// Reads the body of an inline routine up to the matching %end.
+static void masm_defineInline(Masm* masm, StringView inputFile, StringView* source, int* lineNum, StringView name)
+{
+    if (masm->inlines_size >= MASM_INLINES_CAPACITY) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: Too many inline routines!\n", SV_FORMAT(inputFile), *lineNum);
+        exit(1);
+    }
+
+    Word ignore = {0};
+    if (masm_findInline(masm, name) != NULL || masm_resolveLabel(masm, name, &ignore)) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is already defined!\n", SV_FORMAT(inputFile), *lineNum, SV_FORMAT(name));
+        exit(1);
+    }
+
+    MasmInline inl = {
+            .name = name,
+            .body = (StringView) {.count = 0, .data = source->data},
+            .file = inputFile,
+            .line = *lineNum,
+            .locals_begin = masm->inlineLocals_size,
+    };
+
+    while (true) {
+        if (source->count == 0) {
+            fprintf(stderr, "%" PRIsv ":%d: ERROR: Missing '%%end' for inline routine '%" PRIsv "'!\n",
+                    SV_FORMAT(inputFile), inl.line, SV_FORMAT(name));
+            exit(1);
+        }
+
+        const char* lineStart = source->data;
+        StringView line = sv_trim(sv_chopByDelim(source, '\n'));
+        *lineNum += 1;
+        if (line.count == 0 || *line.data == MASM_COMMENT_SYMBOL) {
+            continue;
+        }
+
+        StringView token = sv_chopByDelim(&line, ' ');
+        if (sv_eq(token, cstr_as_sv("%end"))) {
+            inl.body.count = (size_t)(lineStart - inl.body.data);
+            break;
+        }
+        if (*token.data == MASM_PP_SYMBOL) {
+            fprintf(stderr, "%" PRIsv ":%d: ERROR: Preprocessor directives are not allowed inside inline routines!\n",
+                    SV_FORMAT(inputFile), *lineNum);
+            exit(1);
+        }
+        if (token.data[token.count - 1] == ':') {
+            if (masm->inlineLocals_size >= MASM_INLINE_LOCALS_CAPACITY) {
+                fprintf(stderr, "%" PRIsv ":%d: ERROR: Too many labels inside inline routines!\n", SV_FORMAT(inputFile), *lineNum);
+                exit(1);
+            }
+            masm->inlineLocals[masm->inlineLocals_size++] = (StringView) {.count = token.count - 1, .data = token.data};
+            inl.locals_size += 1;
+        }
+    }
+
+    masm->inlines[masm->inlines_size++] = inl;
+}
+
+// Binds the name of a %interrupt to the next import vector, mvm links it to the interrupt
+// of the same name from a plugin.
+static void masm_declareImport(Masm* masm, StringView inputFile, int lineNum, StringView name)
+{
+    if (name.count == 0) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: Interrupt name expected!\n", SV_FORMAT(inputFile), lineNum);
+        exit(1);
+    }
+    if (name.count >= MVM_IMPORT_NAME_CAPACITY) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: Interrupt name '%" PRIsv "' is too long!\n", SV_FORMAT(inputFile), lineNum, SV_FORMAT(name));
+        exit(1);
+    }
+    if (masm->imports_size >= MVM_IMPORTS_CAPACITY) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: Too many imported interrupts!\n", SV_FORMAT(inputFile), lineNum);
+        exit(1);
+    }
+    if (!masm_bindLabel(masm, name, word_u64(MVM_IMPORT_VECTORS + masm->imports_size))) {
+        fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is already defined!\n", SV_FORMAT(inputFile), lineNum, SV_FORMAT(name));
+        exit(1);
+    }
+    masm->imports[masm->imports_size++] = name;
+}
+
+static const MasmFrameName* masm_findFrameName(const Masm* masm, StringView name)
+{
+    for (size_t i = 0; i < masm->frameNames_size; ++i) {
+        if (sv_eq(masm->frameNames[i].name, name)) {
+            return &masm->frameNames[i];
+        }
+    }
+    return NULL;
+}
+
+// Declares the names of a %args or %locals line. %args starts the frame of a new function,
+// the arguments are the words below the frame pointer (and below the return address if there is
+// no return stack), the last one being closest to it. %locals replaces the locals, which count up from 0.
+static void masm_declareFrameNames(Masm* masm, StringView inputFile, int lineNum, StringView line, bool args)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < masm->frameNames_size; ++i) {
+        if (!args && masm->frameNames[i].is_arg) {
+            masm->frameNames[kept++] = masm->frameNames[i];
+        }
+    }
+    masm->frameNames_size = kept;
+
+    StringView names = sv_trim(sv_chopByDelim(&line, MASM_COMMENT_SYMBOL));
+    uint64_t count = 0;
+    for (StringView rest = names; rest.count > 0; rest = sv_trim(rest)) {
+        sv_chopByDelim(&rest, ' ');
+        count += 1;
+    }
+
+    const uint64_t below = count + ((masm->flags & MVM_FLAG_RSTACK) ? 0 : 1);
+    for (uint64_t i = 0; names.count > 0; ++i, names = sv_trim(names)) {
+        StringView name = sv_chopByDelim(&names, ' ');
+        if (masm_findFrameName(masm, name) != NULL) {
+            fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is already declared in this frame!\n", SV_FORMAT(inputFile), lineNum, SV_FORMAT(name));
+            exit(1);
+        }
+        if (masm->frameNames_size >= MASM_FRAME_NAMES_CAPACITY) {
+            fprintf(stderr, "%" PRIsv ":%d: ERROR: Too many frame names!\n", SV_FORMAT(inputFile), lineNum);
+            exit(1);
+        }
+        masm->frameNames[masm->frameNames_size++] = (MasmFrameName) {
+                .name = name,
+                .offset = args ? (uint64_t)0 - below + i : i,
+                .is_arg = args,
+        };
+    }
+}
+
+static void masm_translateSource(Masm* masm, StringView inputFile, StringView source, int lineNum, size_t level,
+                                 const MasmInline* inl, size_t expansion)
+{
+    while (source.count > 0) {
+        StringView  line = sv_trim(sv_chopByDelim(&source, '\n'));
+        lineNum += 1;
+        if (line.count > 0 && *line.data != MASM_COMMENT_SYMBOL) {
+            StringView  token = sv_chopByDelim(&line, ' ');
+
+            // Preprocessor
+            if (token.count > 0 && *token.data == MASM_PP_SYMBOL) {
+                token.count -= 1;
+                token.data += 1;
+                if (sv_eq(token, cstr_as_sv("define"))) {
+                    line = sv_trim(line);
+                    StringView label = sv_chopByDelim(&line, ' ');
+
+                    if (label.count > 0) {
+                        line = sv_trim(line);
+                        StringView value = line;
+                        Word word = {0};
+                        if (!masm_translateLiteral(masm, value, &word)) {
+                            fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is not a string or a number!\n", SV_FORMAT(inputFile), lineNum,
+                                    SV_FORMAT(value));
+                            exit(1);
+                        }
+
+                        if (!masm_bindLabel(masm, label, word)) {
+                            fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is already defined!!\n", SV_FORMAT(inputFile), lineNum,
+                                    SV_FORMAT(label));
+                            exit(1);
+                        }
+                        if (value.count > 0 && *value.data == '"') {
+                            masm->data[masm->data_size - 1].name = label;
+                        }
+                    } else {
+                        fprintf(stderr, "%" PRIsv ":%d: ERROR: Definition name expected!\n", SV_FORMAT(inputFile), lineNum);
+                        exit(1);
+                    }
+                } else if (sv_eq(token, cstr_as_sv("include"))) {
+                    line = sv_trim(line);
+                    if (line.count > 0) {
+                        if (*line.data == '"' && line.data[line.count - 1] == '"') {
+                            line.data += 1;
+                            line.count -= 2;
+
+                            if (level + 1 < MASM_MAX_INCLUDES) {
+                                mvm_translateSourceFile(masm, line, level + 1);
+                            } else {
+                                fprintf(stderr, "%" PRIsv ":%d: ERROR: Exceeded maximum-include-level!\n", SV_FORMAT(inputFile), lineNum);
+                                exit(1);
+                            }
+                        } else {
+                            fprintf(stderr, "%" PRIsv ":%d: ERROR: Include-Path has to be surrounded with quotation marks!\n", SV_FORMAT(inputFile), lineNum);
+                            exit(1);
+                        }
+                    } else {
+                        fprintf(stderr, "%" PRIsv ":%d: ERROR: Include-Path is not provided!\n", SV_FORMAT(inputFile), lineNum);
+                        exit(1);
+                    }
+                } else if (sv_eq(token, cstr_as_sv("data"))) {
+                    masm_defineData(masm, inputFile, lineNum, line);
+                } else if (sv_eq(token, cstr_as_sv("bss"))) {
+                    masm_reserveData(masm, inputFile, lineNum, line);
+                } else if (sv_eq(token, cstr_as_sv("align"))) {
+                    StringView value = sv_trim(sv_chopByDelim(&line, MASM_COMMENT_SYMBOL));
+                    uint64_t align = 0;
+                    if (!masm_parseAlignment(masm, value, &align)) {
+                        fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is not a power of two up to %d!\n",
+                                SV_FORMAT(inputFile), lineNum, SV_FORMAT(value), MVM_MEMORY_ALIGNMENT);
+                        exit(1);
+                    }
+                    masm_alignMemory(masm, inputFile, lineNum, align);
+                } else if (sv_eq(token, cstr_as_sv("retstack"))) {
+                    masm->flags |= MVM_FLAG_RSTACK;
+                } else if (sv_eq(token, cstr_as_sv("interrupt"))) {
+                    StringView name = sv_trim(sv_chopByDelim(&line, MASM_COMMENT_SYMBOL));
+                    masm_declareImport(masm, inputFile, lineNum, name);
+                } else if (sv_eq(token, cstr_as_sv("args")) || sv_eq(token, cstr_as_sv("locals"))) {
+                    masm_declareFrameNames(masm, inputFile, lineNum, line, sv_eq(token, cstr_as_sv("args")));
+                } else if (sv_eq(token, cstr_as_sv("inline"))) {
+                    StringView name = sv_trim(sv_chopByDelim(&line, MASM_COMMENT_SYMBOL));
+                    if (name.count > 0) {
+                        masm_defineInline(masm, inputFile, &source, &lineNum, name);
+                    } else {
+                        fprintf(stderr, "%" PRIsv ":%d: ERROR: Inline routine name expected!\n", SV_FORMAT(inputFile), lineNum);
+                        exit(1);
+                    }
+                } else {
+                    fprintf(stderr, "%" PRIsv ":%d: ERROR: Unknown preprocessor directive '%" PRIsv "'!\n", SV_FORMAT(inputFile), lineNum,
+                            SV_FORMAT(token));
+                    exit(1);
+                }
+            } else {
+
+                if (token.count > 0 && token.data[token.count - 1] == ':') {
+                    StringView label = (StringView) {.count = token.count - 1, .data = token.data};
+                    label = masm_mangleInlineLabel(masm, inl, expansion, label);
+                    if (masm_findInline(masm, label) != NULL || !masm_bindAddrLabel(masm, label, masm->program_size)) {
+                        fprintf(stderr, "%" PRIsv ":%d: ERROR: '%" PRIsv "' is already defined!\n", SV_FORMAT(inputFile), lineNum, SV_FORMAT(label));
+                        exit(1);
+                    }
+                    token = sv_trim(sv_chopByDelim(&line, ' '));
+                }
+
+                if (token.count > 0) {
+                    StringView operand = sv_trim(sv_chopByDelim(&line, MASM_COMMENT_SYMBOL));
+                    InstType instType = INST_NOP;
+
+                    if (GetInstName(token, &instType)) {
+                        if (instType == INST_CALL) {
+                            const MasmInline* callee = masm_findInline(masm, operand);
+                            if (callee != NULL) {
+                                masm_expandInline(masm, inputFile, lineNum, callee, level);
+                                continue;
+                            }
+                        }
+                        if (inl != NULL && instType == INST_RET) {
+                            fprintf(stderr, "%" PRIsv ":%d: ERROR: 'ret' is not allowed inside inline routine '%" PRIsv "'!\n",
+                                    SV_FORMAT(inputFile), lineNum, SV_FORMAT(inl->name));
+                            exit(1);
+                        }
+                        if (masm->program_size >= MVM_PROGRAM_CAPACITY) {
+                            fprintf(stderr, "ERROR: Program size exceeded!");
+                            exit(1);
+                        }
+                        masm->program[masm->program_size].type = instType;
+                        if (InstHasOperand(instType)) {
+                            if (operand.count == 0) {
+                                fprintf(stderr, "%" PRIsv ":%d: ERROR: instruction '%" PRIsv "' expects an operand!\n",
+                                        SV_FORMAT(inputFile), lineNum, SV_FORMAT(token));
+                                exit(1);
+                            }
+
+                            const MasmFrameName* frameName = NULL;
+                            if (instType == INST_LOADL || instType == INST_STOREL) {
+                                frameName = masm_findFrameName(masm, operand);
+                            }
+                            operand = masm_mangleInlineLabel(masm, inl, expansion, operand);
+                            if (frameName != NULL) {
+                                masm->program[masm->program_size].operand = word_u64(frameName->offset);
+                            } else if (*operand.data == '"') {
+                                masm->program[masm->program_size].operand = masm_pushLiteralOperand(masm, operand);
+                            } else if (!masm_translateLiteral(
+                                    masm,
+                                    operand,
+                                    &masm->program[masm->program_size].operand)) {
+                                masm_pushDeferredOperand(masm, masm->program_size, operand);
+                            }
+
+                        }
+                        masm->program_size += 1;
+                    } else {
+                        fprintf(stderr, "%" PRIsv ":%d: ERROR: Unknown instruction '%" PRIsv "'!\n", SV_FORMAT(inputFile), lineNum,
+                                SV_FORMAT(token));
+                        exit(1);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void mvm_translateSourceFile(Masm* masm, StringView inputFile, size_t level)
+{
+    StringView source = masm_slurpFile(masm, inputFile);
+
+    // Pass one
+    masm_translateSource(masm, inputFile, source, 0, level, NULL, 0);
+    if (level > 0) {
+        // Included files may use labels of the including file, they are resolved once it is read.
+        return;
+    }
+    masm_placeReservedData(masm, inputFile);
+
+    // Pass two
+    for (size_t i = 0; i < masm->deferredOperands_size; ++i) {
+        StringView label = masm->deferredOperands[i].label;
+        Word* operand = &masm->program[masm->deferredOperands[i].addr].operand;
+        if (!masm_resolveLabel(masm, label, operand)) {
+            fprintf(stderr, "%" PRIsv ": ERROR: '%" PRIsv "' is not defined!\n", SV_FORMAT(inputFile), SV_FORMAT(label));
+            exit(1);
+        }
+    }
+}
+
+// Pops `words` operands of a conditional jump and continues at `target` if the branch is taken.
+static MVM_ALWAYS_INLINE ExceptionState mvm_branch(Mvm* mvm, InstAddr target, uint64_t words, bool taken)
+{
+    mvm->stack_size -= words;
+    mvm->ip = taken ? target : mvm->ip + 1;
+    if (mvm->metered) {
+        return mvm_chargeFuel(mvm);
+    }
+    return EXCEPTION_SATE_OK;
+}
+
+// Guarded execution takes memory addresses modulo 2^32 and skips their bounds checks.
+// Guarded memory instructions clamp their address instead of checking it. Every address beyond the
+// memory ends up on the guard page that follows it and faults.
+static MVM_ALWAYS_INLINE MemoryAddr mvm_guardedAddr(uint64_t addr)
+{
+    return addr < MVM_MEMORY_CAPACITY ? addr : MVM_MEMORY_CAPACITY;
+}
+
+static MVM_ALWAYS_INLINE ExceptionState mvm_execInstWith(Mvm* mvm, bool guarded)
+{
+    if (mvm->ip >= mvm->program_size) {
+        return EXCEPTION_ILLEGAL_INST_ACCESS;
+    }
+
+    Inst inst = mvm->program[mvm->ip];
+
+    switch (inst.type) {
+        case INST_NOP: {
+            mvm->ip += 1;
+            break;
+        }
+        case INST_PUSH: {
+            if (mvm->stack_size >= MVM_STACK_CAPACITY) {
+                return EXCEPTION_STACK_OVERFLOW;
+            }
+            mvm->stack[mvm->stack_size++] = inst.operand;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_DUP: {
+            if (mvm->stack_size >= MVM_STACK_CAPACITY) {
+                return EXCEPTION_STACK_OVERFLOW;
+            }
+            if (mvm->stack_size - inst.operand.as_u64 <= 0) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+
+            mvm->stack[mvm->stack_size] = mvm->stack[mvm->stack_size - 1 - inst.operand.as_u64];
+            mvm->stack_size += 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_SWAP: {
+            if (inst.operand.as_u64 >= mvm->stack_size) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const uint64_t a = mvm->stack_size - 1;
+            const uint64_t b = mvm->stack_size - 1 - inst.operand.as_u64;
+            Word tmp = mvm->stack[a];
+            mvm->stack[a] = mvm->stack[b];
+            mvm->stack[b] = tmp;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_DROP: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_PLUSI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2].as_u64 += mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MINUSI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2].as_u64 -= mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MULTI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2].as_u64 *= mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_DIVI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            if (mvm->stack[mvm->stack_size - 1].as_u64 == 0) {
+                return EXCEPTION_DIV_BY_ZERO;
+            }
+            mvm->stack[mvm->stack_size - 2].as_u64 /= mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MODI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+
+            if (mvm->stack[mvm->stack_size - 1].as_u64 == 0) {
+                return EXCEPTION_DIV_BY_ZERO;
+            }
+
+            mvm->stack[mvm->stack_size - 2].as_u64 = mvm->stack[mvm->stack_size - 2].as_u64 % mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_PLUSF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2].as_f64 += mvm->stack[mvm->stack_size - 1].as_f64;
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MINUSF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2].as_f64 -= mvm->stack[mvm->stack_size - 1].as_f64;
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MULTF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2].as_f64 *= mvm->stack[mvm->stack_size - 1].as_f64;
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_DIVF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+
+            mvm->stack[mvm->stack_size - 2].as_f64 /= mvm->stack[mvm->stack_size - 1].as_f64 ;
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_ANDB: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2]= word_u64(mvm->stack[mvm->stack_size - 2].as_u64 & mvm->stack[mvm->stack_size - 1].as_u64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_ORB: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 2].as_u64 | mvm->stack[mvm->stack_size - 1].as_u64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_XOR: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 2].as_u64 ^ mvm->stack[mvm->stack_size - 1].as_u64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_NOTB: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1] = word_u64(~mvm->stack[mvm->stack_size - 1].as_u64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_SHR: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 2].as_u64 >> mvm->stack[mvm->stack_size - 1].as_u64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_SHL: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2]= word_u64(mvm->stack[mvm->stack_size - 2].as_u64 << mvm->stack[mvm->stack_size - 1].as_u64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_JMP: {
+            mvm->ip = inst.operand.as_u64;
+            if (mvm->metered) {
+                return mvm_chargeFuel(mvm);
+            }
+            break;
+        }
+
+        case INST_JMPIF: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            if (mvm->stack[mvm->stack_size - 1].as_u64) {
+                mvm->ip = inst.operand.as_u64;
+            } else {
+                mvm->ip += 1;
+            }
+            mvm->stack_size -= 1;
+            if (mvm->metered) {
+                return mvm_chargeFuel(mvm);
+            }
+            break;
+        }
+
+        case INST_CALL: {
+            if (mvm->flags & MVM_FLAG_RSTACK) {
+                if (mvm->rstack_size >= MVM_RSTACK_CAPACITY) {
+                    return EXCEPTION_RSTACK_OVERFLOW;
+                }
+                mvm->rstack[mvm->rstack_size++] = mvm->ip + 1;
+            } else {
+                if (mvm->stack_size >= MVM_STACK_CAPACITY) {
+                    return EXCEPTION_STACK_OVERFLOW;
+                }
+                mvm->stack[mvm->stack_size++].as_u64 = mvm->ip + 1;
+            }
+            mvm->ip = inst.operand.as_u64;
+            if (mvm->metered) {
+                return mvm_chargeFuel(mvm);
+            }
+            break;
+        }
+
+        case INST_INT: {
+            if (inst.operand.as_u64 >= mvm->interrupts_size) {
+                return EXCEPTION_ILLEGAL_OPERAND;
+            }
+            const ExceptionState err = mvm->interrupts[inst.operand.as_u64](mvm);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
+            }
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_RET: {
+            if (mvm->flags & MVM_FLAG_RSTACK) {
+                if (mvm->rstack_size < 1) {
+                    return EXCEPTION_RSTACK_UNDERFLOW;
+                }
+                mvm->ip = mvm->rstack[--mvm->rstack_size];
+            } else {
+                if (mvm->stack_size < 1) {
+                    return EXCEPTION_STACK_UNDERFLOW;
+                }
+                mvm->ip = mvm->stack[mvm->stack_size - 1].as_u64;
+                mvm->stack_size -= 1;
+            }
+            if (mvm->ip == MVM_COROUTINE_RETURN) {
+                ExceptionState err = mvm_coReturn(mvm);
+                if (err != EXCEPTION_SATE_OK) {
+                    return err;
+                }
+            }
+            if (mvm->metered) {
+                return mvm_chargeFuel(mvm);
+            }
+            break;
+        }
+
+        case INST_HALT: {
+            mvm->halt = true;
+            break;
+        }
+
+        case INST_EQ: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 1].as_u64 == mvm->stack[mvm->stack_size - 2].as_u64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_NOT: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1] = word_u64(!mvm->stack[mvm->stack_size - 1].as_u64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_GEF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_f64(mvm->stack[mvm->stack_size - 1].as_f64 >= mvm->stack[mvm->stack_size - 2].as_f64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_GEI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 1].as_u64 >= mvm->stack[mvm->stack_size - 2].as_u64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_LEF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_f64(mvm->stack[mvm->stack_size - 1].as_f64 <= mvm->stack[mvm->stack_size - 2].as_f64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_LEI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 1].as_u64 <= mvm->stack[mvm->stack_size - 2].as_u64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_READ8: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = guarded ? mvm_guardedAddr(mvm->stack[mvm->stack_size - 1].as_u64) : mvm->stack[mvm->stack_size - 1].as_u64;
+            if (!guarded && addr >= MVM_MEMORY_CAPACITY) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            mvm->stack[mvm->stack_size - 1] = word_u64(mvm->memory[addr]);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_READ16: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = guarded ? mvm_guardedAddr(mvm->stack[mvm->stack_size - 1].as_u64) : mvm->stack[mvm->stack_size - 1].as_u64;
+            if (!guarded && addr >= MVM_MEMORY_CAPACITY - 1) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            mvm->stack[mvm->stack_size - 1] = word_u64(*(uint16_t*)&mvm->memory[addr]);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_READ32: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = guarded ? mvm_guardedAddr(mvm->stack[mvm->stack_size - 1].as_u64) : mvm->stack[mvm->stack_size - 1].as_u64;
+            if (!guarded && addr >= MVM_MEMORY_CAPACITY - 3) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            mvm->stack[mvm->stack_size - 1] = word_u64(*(uint32_t*)&mvm->memory[addr]);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_READ64: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = guarded ? mvm_guardedAddr(mvm->stack[mvm->stack_size - 1].as_u64) : mvm->stack[mvm->stack_size - 1].as_u64;
+            if (!guarded && addr >= MVM_MEMORY_CAPACITY - 7) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            mvm->stack[mvm->stack_size - 1] = word_u64(*(uint64_t*)&mvm->memory[addr]);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_WRITE8: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = guarded ? mvm_guardedAddr(mvm->stack[mvm->stack_size - 2].as_u64) : mvm->stack[mvm->stack_size - 2].as_u64;
+            if (!guarded && addr >= MVM_MEMORY_CAPACITY) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            mvm->memory[addr] = (uint8_t)mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack_size -= 2;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_WRITE16: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = guarded ? mvm_guardedAddr(mvm->stack[mvm->stack_size - 2].as_u64) : mvm->stack[mvm->stack_size - 2].as_u64;
+            if (!guarded && addr >= MVM_MEMORY_CAPACITY - 1) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            *(uint16_t*)&mvm->memory[addr] = (uint16_t)mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack_size -= 2;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_WRITE32: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = guarded ? mvm_guardedAddr(mvm->stack[mvm->stack_size - 2].as_u64) : mvm->stack[mvm->stack_size - 2].as_u64;
+            if (!guarded && addr >= MVM_MEMORY_CAPACITY - 3) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            *(uint32_t*)&mvm->memory[addr] = (uint32_t)mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack_size -= 2;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_WRITE64: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = guarded ? mvm_guardedAddr(mvm->stack[mvm->stack_size - 2].as_u64) : mvm->stack[mvm->stack_size - 2].as_u64;
+            if (!guarded && addr >= MVM_MEMORY_CAPACITY - 7) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            *(uint64_t*)&mvm->memory[addr] = (uint64_t)mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack_size -= 2;
+            mvm->ip += 1;
+            break;
+        }
+
+        // Trap for the debugger, the ip is left on the breakpoint.
+        case INST_BREAK:
+            return EXCEPTION_BREAKPOINT;
+
+        case INST_SPAWN: {
+            ExceptionState err = mvm_spawn(mvm, inst.operand.as_u64);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
+            }
+            mvm->ip += 1;
+            if (mvm->metered) {
+                return mvm_chargeFuel(mvm);
+            }
+            break;
+        }
+
+        case INST_JOIN: {
+            ExceptionState err = mvm_join(mvm);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
+            }
+            mvm->ip += 1;
+            break;
+        }
+
+        // Atomic operations work on naturally aligned 64 bit words and push the previous value.
+        case INST_ATOMADD:
+        case INST_ATOMXCHG: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = mvm->stack[mvm->stack_size - 2].as_u64;
+            if (addr >= MVM_MEMORY_CAPACITY - 7 || addr % 8 != 0) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            _Atomic uint64_t* word = (_Atomic uint64_t*)&mvm->memory[addr];
+            const uint64_t value = mvm->stack[mvm->stack_size - 1].as_u64;
+            mvm->stack[mvm->stack_size - 2] = word_u64(inst.type == INST_ATOMADD
+                                                       ? atomic_fetch_add(word, value)
+                                                       : atomic_exchange(word, value));
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_ATOMCAS: {
+            if (mvm->stack_size < 3) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const MemoryAddr addr = mvm->stack[mvm->stack_size - 3].as_u64;
+            if (addr >= MVM_MEMORY_CAPACITY - 7 || addr % 8 != 0) {
+                return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+            }
+            uint64_t expected = mvm->stack[mvm->stack_size - 2].as_u64;
+            atomic_compare_exchange_strong((_Atomic uint64_t*)&mvm->memory[addr], &expected,
+                                           mvm->stack[mvm->stack_size - 1].as_u64);
+            mvm->stack[mvm->stack_size - 3] = word_u64(expected);
+            mvm->stack_size -= 2;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_FENCE: {
+            atomic_thread_fence(memory_order_seq_cst);
+            mvm->ip += 1;
+            break;
+        }
+
+        // Fused compare and branch: pops a and b (b on top) and jumps if `a <op> b` holds.
+        case INST_JEQ: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_u64 == b.as_u64);
+        }
+
+        case INST_JNE: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_u64 != b.as_u64);
+        }
+
+        case INST_JLTI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_u64 < b.as_u64);
+        }
+
+        case INST_JLEI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_u64 <= b.as_u64);
+        }
+
+        case INST_JGTI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_u64 > b.as_u64);
+        }
+
+        case INST_JGEI: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_u64 >= b.as_u64);
+        }
+
+        case INST_JLTF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_f64 < b.as_f64);
+        }
+
+        case INST_JLEF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_f64 <= b.as_f64);
+        }
+
+        case INST_JGTF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_f64 > b.as_f64);
+        }
+
+        case INST_JGEF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            const Word a = mvm->stack[mvm->stack_size - 2];
+            const Word b = mvm->stack[mvm->stack_size - 1];
+            return mvm_branch(mvm, inst.operand.as_u64, 2, a.as_f64 >= b.as_f64);
+        }
+
+        case INST_JZ: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            return mvm_branch(mvm, inst.operand.as_u64, 1, mvm->stack[mvm->stack_size - 1].as_u64 == 0);
+        }
+
+        case INST_ENTER: {
+            const ExceptionState err = mvm_enterFrame(mvm, inst.operand.as_u64);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
+            }
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_LEAVE: {
+            const ExceptionState err = mvm_leaveFrame(mvm, inst.operand.as_u64);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
+            }
+            mvm->ip += 1;
+            break;
+        }
+
+        // The operand is a signed offset from the frame pointer, arguments are below it.
+        case INST_LOADL: {
+            const uint64_t slot = mvm->fp + inst.operand.as_u64;
+            if (slot >= mvm->stack_size) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            if (mvm->stack_size >= MVM_STACK_CAPACITY) {
+                return EXCEPTION_STACK_OVERFLOW;
+            }
+            mvm->stack[mvm->stack_size] = mvm->stack[slot];
+            mvm->stack_size += 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_STOREL: {
+            const uint64_t slot = mvm->fp + inst.operand.as_u64;
+            if (mvm->stack_size < 1 || slot >= mvm->stack_size - 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[slot] = mvm->stack[mvm->stack_size - 1];
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_SQRTF: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1].as_f64 = sqrt(mvm->stack[mvm->stack_size - 1].as_f64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_ABSF: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1].as_f64 = fabs(mvm->stack[mvm->stack_size - 1].as_f64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_FLOORF: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1].as_f64 = floor(mvm->stack[mvm->stack_size - 1].as_f64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_CEILF: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1].as_f64 = ceil(mvm->stack[mvm->stack_size - 1].as_f64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_SINF: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1].as_f64 = sin(mvm->stack[mvm->stack_size - 1].as_f64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_COSF: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1].as_f64 = cos(mvm->stack[mvm->stack_size - 1].as_f64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_EXPF: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1].as_f64 = exp(mvm->stack[mvm->stack_size - 1].as_f64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_LOGF: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1].as_f64 = log(mvm->stack[mvm->stack_size - 1].as_f64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_FMAF: {
+            if (mvm->stack_size < 3) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 3].as_f64 = fma(mvm->stack[mvm->stack_size - 3].as_f64, mvm->stack[mvm->stack_size - 2].as_f64, mvm->stack[mvm->stack_size - 1].as_f64);
+            mvm->stack_size -= 2;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_I2F: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1] = word_f64((double)mvm->stack[mvm->stack_size - 1].as_i64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_F2I: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1] = word_i64(mvm_f64ToI64(mvm->stack[mvm->stack_size - 1].as_f64));
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_ABSI: {
+            if (mvm->stack_size < 1) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 1] = word_u64(mvm->stack[mvm->stack_size - 1].as_i64 < 0 ? 0 - mvm->stack[mvm->stack_size - 1].as_u64 : mvm->stack[mvm->stack_size - 1].as_u64);
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MINF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_f64(fmin(mvm->stack[mvm->stack_size - 2].as_f64, mvm->stack[mvm->stack_size - 1].as_f64));
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MAXF: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_f64(fmax(mvm->stack[mvm->stack_size - 2].as_f64, mvm->stack[mvm->stack_size - 1].as_f64));
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_DIVS: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            if (mvm->stack[mvm->stack_size - 1].as_u64 == 0) {
+                return EXCEPTION_DIV_BY_ZERO;
+            }
+
+            mvm->stack[mvm->stack_size - 2] = mvm_divS(mvm->stack[mvm->stack_size - 2], mvm->stack[mvm->stack_size - 1]);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MODS: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            if (mvm->stack[mvm->stack_size - 1].as_u64 == 0) {
+                return EXCEPTION_DIV_BY_ZERO;
+            }
+
+            mvm->stack[mvm->stack_size - 2] = mvm_modS(mvm->stack[mvm->stack_size - 2], mvm->stack[mvm->stack_size - 1]);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_GES: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 1].as_i64 >= mvm->stack[mvm->stack_size - 2].as_i64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_LES: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = word_u64(mvm->stack[mvm->stack_size - 1].as_i64 <= mvm->stack[mvm->stack_size - 2].as_i64);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_SAR: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            mvm->stack[mvm->stack_size - 2] = mvm_sar(mvm->stack[mvm->stack_size - 2], mvm->stack[mvm->stack_size - 1]);
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MINS: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            if (mvm->stack[mvm->stack_size - 1].as_i64 < mvm->stack[mvm->stack_size - 2].as_i64) {
+                mvm->stack[mvm->stack_size - 2] = mvm->stack[mvm->stack_size - 1];
+            }
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_MAXS: {
+            if (mvm->stack_size < 2) {
+                return EXCEPTION_STACK_UNDERFLOW;
+            }
+            if (mvm->stack[mvm->stack_size - 1].as_i64 > mvm->stack[mvm->stack_size - 2].as_i64) {
+                mvm->stack[mvm->stack_size - 2] = mvm->stack[mvm->stack_size - 1];
+            }
+            mvm->stack_size -= 1;
+            mvm->ip += 1;
+            break;
+        }
+
+        case INST_COCREATE: {
+            ExceptionState err = mvm_coCreate(mvm, inst.operand.as_u64);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
+            }
+            mvm->ip += 1;
+            if (mvm->metered) {
+                return mvm_chargeFuel(mvm);
+            }
+            break;
+        }
+
+        // Both switch to another coroutine and set the ip themselves.
+        case INST_CORESUME:
+        case INST_YIELD: {
+            ExceptionState err = inst.type == INST_CORESUME ? mvm_coResume(mvm) : mvm_coYield(mvm);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
+            }
+            if (mvm->metered) {
+                return mvm_chargeFuel(mvm);
+            }
+            break;
+        }
+
+        case NUMBER_OF_INSTS:
+        default:
+            return EXCEPTION_ILLEGAL_INST;
+    }
+    return EXCEPTION_SATE_OK;
+}
+
+// Enables the execution limits. Fuel is charged for a whole straight-line run of instructions
+// when it is entered, so the per instruction cost is zero. Use MVM_FUEL_UNLIMITED to only
+// poll the deadline.
+void mvm_setFuel(Mvm* mvm, uint64_t fuel)
+{
+    uint32_t cost = 0;
+    for (InstAddr i = mvm->program_size; i > 0; --i) {
+        const InstType type = mvm->program[i - 1].type;
+        if (InstIsJump(type) || type == INST_RET || type == INST_HALT || type == INST_CORESUME || type == INST_YIELD) {
+            cost = 0;
+        }
+        cost += 1;
+        mvm->fuel_cost[i - 1] = cost;
+    }
+    mvm->fuel = fuel == MVM_FUEL_UNLIMITED ? MVM_FUEL_UNLIMITED : 0;
+    atomic_store(&mvm->fuel_pool, fuel == MVM_FUEL_UNLIMITED ? 0 : fuel);
+    mvm->metered = true;
+}
+
+// Takes at least `needed` fuel from the budget shared by all threads. A lease that is not used up
+// goes back to the budget when the thread is joined.
+static ExceptionState mvm_leaseFuel(Mvm* mvm, uint64_t needed)
+{
+    Mvm* root = mvm->root != NULL ? mvm->root : mvm;
+    const uint64_t wanted = needed > MVM_FUEL_LEASE ? needed : MVM_FUEL_LEASE;
+    uint64_t available = atomic_load_explicit(&root->fuel_pool, memory_order_relaxed);
+    uint64_t lease;
+    do {
+        if (available < needed) {
+            return EXCEPTION_OUT_OF_FUEL;
+        }
+        lease = available < wanted ? available : wanted;
+    } while (!atomic_compare_exchange_weak_explicit(&root->fuel_pool, &available, available - lease,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    mvm->fuel += lease;
+    return EXCEPTION_SATE_OK;
+}
+
+// Charges the run starting at the ip. Called on program start and after every control transfer.
+ExceptionState mvm_chargeFuel(Mvm* mvm)
+{
+    const Mvm* root = mvm->root != NULL ? mvm->root : mvm;
+    if (atomic_load_explicit(&root->deadline_expired, memory_order_relaxed)) {
+        return EXCEPTION_TIMEOUT;
+    }
+    const uint64_t cost = mvm->ip < mvm->program_size ? mvm->fuel_cost[mvm->ip] : 1;
+    if (mvm->fuel != MVM_FUEL_UNLIMITED) {
+        if (cost > mvm->fuel) {
+            ExceptionState err = mvm_leaseFuel(mvm, cost - mvm->fuel);
+            if (err != EXCEPTION_SATE_OK) {
+                return err;
+            }
+        }
+        mvm->fuel -= cost;
+    }
+    return EXCEPTION_SATE_OK;
+}
+
+ExceptionState mvm_execInst(Mvm* mvm)
+{
+    return mvm_execInstWith(mvm, false);
+}
+
+ExceptionState mvm_execInstGuarded(Mvm* mvm)
+{
+    return mvm_execInstWith(mvm, true);
+}
+
+ExceptionState mvm_execProgram(Mvm* mvm)
+{
+    if (mvm->metered) {
+        ExceptionState err = mvm_chargeFuel(mvm);
+        if (err != EXCEPTION_SATE_OK) {
+            return err;
+        }
+    }
+    while (!mvm->halt) {
+        ExceptionState err = mvm_execInst(mvm);
+        if (mvm->stack_size > MVM_STACK_CAPACITY) {
+            return EXCEPTION_STACK_OVERFLOW;
+        }
+        if (err != EXCEPTION_SATE_OK) {
+            return err;
+        }
+    }
+    return EXCEPTION_SATE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void mvm_traceWrite(MvmTrace* trace, const void* data, size_t size)
+{
+    if (trace->buffer_size + size > MVM_TRACE_BUFFER_CAPACITY) {
+        fwrite(trace->buffer, 1, trace->buffer_size, trace->file);
+        if (ferror(trace->file)) {
+            fprintf(stderr, "ERROR: Could not write trace to file '%s'! : %s\n", trace->filePath, strerror(errno));
+            exit(1);
+        }
+        trace->buffer_size = 0;
+    }
+    memcpy(trace->buffer + trace->buffer_size, data, size);
+    trace->buffer_size += size;
+}
+
+void mvm_traceOpen(MvmTrace* trace, const Mvm* mvm, const char* filePath)
+{
+    trace->file = fopen(filePath, "wb");
+    if (trace->file == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s'! : %s\n", filePath, strerror(errno));
+        exit(1);
+    }
+    trace->filePath = filePath;
+    trace->buffer_size = 0;
+    trace->shadow = calloc(MVM_MEMORY_CAPACITY, 1);
+    if (trace->shadow == NULL) {
+        fprintf(stderr, "ERROR: Could not allocate the trace memory!\n");
+        exit(1);
+    }
+    memcpy(trace->shadow, mvm->memory, (size_t)mvm->memory_size);
+
+    MvmTrace_Header header = {
+            .magic = MVM_TRACE_MAGIC,
+            .version = MVM_TRACE_VERSION,
+            .flags = mvm->flags,
+            .program_size = mvm->program_size,
+            .memory_size = mvm->memory_size,
+    };
+    mvm_traceWrite(trace, &header, sizeof(header));
+    mvm_traceWrite(trace, mvm->program, sizeof(mvm->program[0]) * (size_t)mvm->program_size);
+    mvm_traceWrite(trace, mvm->memory, (size_t)mvm->memory_size);
+}
+
+void mvm_traceClose(MvmTrace* trace)
+{
+    fwrite(trace->buffer, 1, trace->buffer_size, trace->file);
+    if (ferror(trace->file)) {
+        fprintf(stderr, "ERROR: Could not write trace to file '%s'! : %s\n", trace->filePath, strerror(errno));
+        exit(1);
+    }
+    fclose(trace->file);
+    trace->file = NULL;
+    free(trace->shadow);
+    trace->shadow = NULL;
+}
+
+// Records the memory an interrupt wrote, one range per changed page.
+static void mvm_traceMemory(MvmTrace* trace, const Mvm* mvm, InstAddr ip)
+{
+    for (uint64_t page = 0; page < MVM_MEMORY_CAPACITY; page += MVM_MEMORY_ALIGNMENT) {
+        const uint64_t end = page + MVM_MEMORY_ALIGNMENT < MVM_MEMORY_CAPACITY ? page + MVM_MEMORY_ALIGNMENT : MVM_MEMORY_CAPACITY;
+        if (memcmp(&trace->shadow[page], &mvm->memory[page], (size_t)(end - page)) == 0) {
+            continue;
+        }
+        uint64_t first = page;
+        uint64_t last = end;
+        while (trace->shadow[first] == mvm->memory[first]) {
+            first += 1;
+        }
+        while (trace->shadow[last - 1] == mvm->memory[last - 1]) {
+            last -= 1;
+        }
+        const uint64_t size = last - first;
+        memcpy(&trace->shadow[first], &mvm->memory[first], (size_t)size);
+
+        MvmTrace_Record record = {
+                .ip = (uint32_t)ip,
+                .words = (uint16_t)(1 + (size + sizeof(Word) - 1) / sizeof(Word)),
+                .type = MVM_TRACE_MEMORY,
+                .top = size,
+        };
+        Word data[MVM_MEMORY_ALIGNMENT / sizeof(Word)] = {0};
+        memcpy(data, &trace->shadow[first], (size_t)size);
+        mvm_traceWrite(trace, &record, sizeof(record));
+        mvm_traceWrite(trace, &(Word){.as_u64 = first}, sizeof(Word));
+        mvm_traceWrite(trace, data, sizeof(Word) * (record.words - 1u));
+    }
+}
+
+// Same as mvm_execProgram, but appends a record for every executed instruction to the trace,
+// including the one that failed.
+ExceptionState mvm_execProgramTraced(Mvm* mvm, MvmTrace* trace)
+{
+    if (mvm->metered) {
+        ExceptionState err = mvm_chargeFuel(mvm);
+        if (err != EXCEPTION_SATE_OK) {
+            return err;
+        }
+    }
+    while (!mvm->halt) {
+        const InstAddr ip = mvm->ip;
+        const uint64_t stackSize = mvm->stack_size;
+        const InstType type = ip < mvm->program_size ? mvm->program[ip].type : INST_NOP;
+
+        Word payload[2] = {0};
+        if (type >= INST_WRITE8 && type <= INST_WRITE64 && stackSize >= 2) {
+            payload[0] = mvm->stack[stackSize - 2];
+            payload[1] = mvm->stack[stackSize - 1];
+        }
+        // The memory an atomic operation writes, replaying it reproduces the write.
+        MemoryAddr atomic = MVM_MEMORY_CAPACITY;
+        if ((type == INST_ATOMADD || type == INST_ATOMXCHG) && stackSize >= 2) {
+            atomic = mvm->stack[stackSize - 2].as_u64;
+        } else if (type == INST_ATOMCAS && stackSize >= 3) {
+            atomic = mvm->stack[stackSize - 3].as_u64;
+        }
+
+        ExceptionState err = mvm_execInst(mvm);
+        if (err == EXCEPTION_SATE_OK && mvm->stack_size > MVM_STACK_CAPACITY) {
+            err = EXCEPTION_STACK_OVERFLOW;
+        }
+
+        MvmTrace_Record record = {
+                .ip = (uint32_t)ip,
+                .stack_delta = (int16_t)((int64_t)mvm->stack_size - (int64_t)stackSize),
+                .type = (uint8_t)type,
+                .state = (uint8_t)err,
+                .top = mvm->stack_size > 0 && mvm->stack_size <= MVM_STACK_CAPACITY ? mvm->stack[mvm->stack_size - 1].as_u64 : 0,
+        };
+        if (type >= INST_WRITE8 && type <= INST_WRITE64) {
+            if (err == EXCEPTION_SATE_OK) {
+                const size_t width = (size_t)1 << (type - INST_WRITE8);
+                memcpy(&trace->shadow[payload[0].as_u64], &mvm->memory[payload[0].as_u64], width);
+            }
+            record.words = 2;
+            mvm_traceWrite(trace, &record, sizeof(record));
+            mvm_traceWrite(trace, payload, sizeof(payload));
+        } else if (err != EXCEPTION_SATE_OK) {
+            mvm_traceWrite(trace, &record, sizeof(record));
+        } else if (type == INST_INT) {
+            // Interrupts can't be replayed, so the words they pushed and the memory they wrote are recorded.
+            record.words = (uint16_t)(mvm->stack_size > stackSize ? mvm->stack_size - stackSize : 0);
+            mvm_traceWrite(trace, &record, sizeof(record));
+            mvm_traceWrite(trace, &mvm->stack[stackSize], sizeof(Word) * record.words);
+            mvm_traceMemory(trace, mvm, ip);
+        } else {
+            if (atomic < MVM_MEMORY_CAPACITY) {
+                memcpy(&trace->shadow[atomic], &mvm->memory[atomic], sizeof(uint64_t));
+            }
+            mvm_traceWrite(trace, &record, sizeof(record));
+        }
+        if (err != EXCEPTION_SATE_OK) {
+            return err;
+        }
+    }
+    return EXCEPTION_SATE_OK;
+}
+
+uint64_t mvm_nowMs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void mvm_statsInit(MvmStats* stats, const Mvm* mvm, uint64_t pid)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->magic = MVM_STATS_MAGIC;
+    stats->version = MVM_STATS_VERSION;
+    stats->pid = pid;
+    stats->started_ms = mvm_nowMs();
+    atomic_store_explicit(&stats->updated_ms, stats->started_ms, memory_order_relaxed);
+    atomic_store_explicit(&stats->memory_size, mvm->memory_size, memory_order_relaxed);
+}
+
+// The instruction rate is sampled over windows of at least one second, starting at `rateMs`.
+static void mvm_statsPublish(MvmStats* stats, const Mvm* mvm, uint64_t retired, uint64_t stackMax,
+                             uint64_t* rateMs, uint64_t* rateRetired)
+{
+    const uint64_t now = mvm_nowMs();
+    if (now >= *rateMs + 1000) {
+        atomic_store_explicit(&stats->insts_per_sec, (retired - *rateRetired) * 1000 / (now - *rateMs), memory_order_relaxed);
+        *rateMs = now;
+        *rateRetired = retired;
+    }
+    atomic_store_explicit(&stats->updated_ms, now, memory_order_relaxed);
+    atomic_store_explicit(&stats->insts_retired, retired, memory_order_relaxed);
+    atomic_store_explicit(&stats->stack_size, mvm->stack_size, memory_order_relaxed);
+    atomic_store_explicit(&stats->stack_max, stackMax, memory_order_relaxed);
+    atomic_store_explicit(&stats->rstack_size, mvm->rstack_size, memory_order_relaxed);
+    atomic_store_explicit(&stats->heap_allocated, mvm->heap_allocated, memory_order_relaxed);
+    atomic_store_explicit(&stats->heap_blocks, mvm->heap_blocks, memory_order_relaxed);
+}
+
+// Same as mvm_execProgram, but keeps the stats up to date. The counters are published
+// every MVM_STATS_BATCH instructions, only interrupt calls are counted right away.
+ExceptionState mvm_execProgramStats(Mvm* mvm, MvmStats* stats)
+{
+    ExceptionState err = mvm->metered ? mvm_chargeFuel(mvm) : EXCEPTION_SATE_OK;
+    uint64_t retired = 0;
+    uint64_t stackMax = mvm->stack_size;
+    uint64_t batch = MVM_STATS_BATCH;
+    uint64_t rateMs = mvm_nowMs();
+    uint64_t rateRetired = 0;
+
+    while (err == EXCEPTION_SATE_OK && !mvm->halt) {
+        const InstAddr ip = mvm->ip;
+        if (ip < mvm->program_size && mvm->program[ip].type == INST_INT
+            && mvm->program[ip].operand.as_u64 < MVM_NATIVES_CAPACITY) {
+            atomic_fetch_add_explicit(&stats->interrupts[mvm->program[ip].operand.as_u64], 1, memory_order_relaxed);
+        }
+
+        err = mvm_execInst(mvm);
+        if (mvm->stack_size > MVM_STACK_CAPACITY) {
+            err = EXCEPTION_STACK_OVERFLOW;
+        }
+        if (err != EXCEPTION_SATE_OK) {
+            break;
+        }
+
+        retired += 1;
+        if (mvm->stack_size > stackMax) {
+            stackMax = mvm->stack_size;
+        }
+        if (--batch == 0) {
+            batch = MVM_STATS_BATCH;
+            mvm_statsPublish(stats, mvm, retired, stackMax, &rateMs, &rateRetired);
+        }
+    }
+
+    mvm_statsPublish(stats, mvm, retired, stackMax, &rateMs, &rateRetired);
+    if (rateRetired == 0) {
+        // The program ended before the first full sampling window, report the average instead.
+        const uint64_t elapsed = mvm_nowMs() - stats->started_ms;
+        atomic_store_explicit(&stats->insts_per_sec, retired * 1000 / (elapsed > 0 ? elapsed : 1), memory_order_relaxed);
+    }
+    atomic_store_explicit(&stats->state, err == EXCEPTION_SATE_OK ? MVM_STATS_HALTED : MVM_STATS_FAILED, memory_order_relaxed);
+    return err;
+}
+
+// Same as mvm_execProgram, but counts how often every instruction is executed and every conditional jump is taken.
+ExceptionState mvm_execProgramProfiled(Mvm* mvm, uint64_t* counts, uint64_t* taken)
+{
+    ExceptionState err = mvm->metered ? mvm_chargeFuel(mvm) : EXCEPTION_SATE_OK;
+    while (err == EXCEPTION_SATE_OK && !mvm->halt) {
+        const InstAddr ip = mvm->ip;
+        err = mvm_execInst(mvm);
+        if (ip < mvm->program_size) {
+            counts[ip] += 1;
+            taken[ip] += mvm_isBranch(mvm->program[ip].type) && mvm->ip != ip + 1;
+        }
+        if (mvm->stack_size > MVM_STACK_CAPACITY) {
+            err = EXCEPTION_STACK_OVERFLOW;
+        }
+    }
+    return err;
+}
+
+// Writes the counts of the first instruction of every basic block and of every conditional jump that ran,
+// see masm_loadProfile.
+void mvm_saveProfile(const Mvm* mvm, const uint64_t* counts, const uint64_t* taken, const char* filePath)
+{
+    bool leader[MVM_PROGRAM_CAPACITY + 1] = {0};
+    leader[0] = true;
+    for (InstAddr i = 0; i < mvm->program_size; ++i) {
+        const Inst inst = mvm->program[i];
+        if (InstIsJump(inst.type) && inst.operand.as_u64 < mvm->program_size) {
+            leader[inst.operand.as_u64] = true;
+        }
+        if (InstIsJump(inst.type) || inst.type == INST_RET || inst.type == INST_HALT) {
+            leader[i + 1] = true;
+        }
+    }
+    for (size_t i = 0; i < mvm->symbols_size; ++i) {
+        if (mvm->symbols[i].addr < mvm->program_size) {
+            leader[mvm->symbols[i].addr] = true;
+        }
+    }
+
+    FILE* f = fopen(filePath, "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s'! : %s\n", filePath, strerror(errno));
+        exit(1);
+    }
+    fprintf(f, "# <label>[+offset] <count> [<taken>], for 'masm -P'\n");
+    for (InstAddr i = 0; i < mvm->program_size; ++i) {
+        const bool branch = mvm_isBranch(mvm->program[i].type);
+        if ((!leader[i] && !branch) || counts[i] == 0) {
+            continue;
+        }
+        const MvmSymbol* symbol = mvm_findSymbol(mvm, i);
+        if (symbol == NULL) {
+            fprintf(f, "%" PRIu64, i);
+        } else if (symbol->addr == i) {
+            fprintf(f, "%" PRIsv, SV_FORMAT(symbol->name));
+        } else {
+            fprintf(f, "%" PRIsv "+%" PRIu64, SV_FORMAT(symbol->name), i - symbol->addr);
+        }
+        fprintf(f, " %" PRIu64, counts[i]);
+        if (branch) {
+            fprintf(f, " %" PRIu64, taken[i]);
+        }
+        fprintf(f, "\n");
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "ERROR: Could not write profile to file '%s'! : %s\n", filePath, strerror(errno));
+        exit(1);
+    }
+    fclose(f);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static ExceptionState mvm_printChar(Mvm* mvm, uint64_t c)
+{
+    (void)mvm;
+    if (c != 13) {
+        printf("%c", (int) c);
+    } else {
+        printf("\n");
+    }
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND1(interrupt_PRINTchar, void, mvm_printChar, u64)
+
+static ExceptionState mvm_printF64(Mvm* mvm, double value)
+{
+    (void)mvm;
+    printf("%lf", value);
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND1(interrupt_PRINTf64, void, mvm_printF64, f64)
+
+static ExceptionState mvm_printI64(Mvm* mvm, int64_t value)
+{
+    (void)mvm;
+    printf("%" PRId64, value);
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND1(interrupt_PRINTi64, void, mvm_printI64, i64)
+
+static ExceptionState mvm_printU64(Mvm* mvm, uint64_t value)
+{
+    (void)mvm;
+    printf("%" PRIu64, value);
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND1(interrupt_PRINTu64, void, mvm_printU64, u64)
+
+ExceptionState interrupt_PRINTptr(Mvm* mvm)
+{
+    if (mvm->stack_size < 1) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+
+    printf("0x%" PRIx64, (uint64_t)*(uintptr_t*) &mvm->stack[mvm->stack_size - 1].as_ptr);
+    mvm->stack_size -= 1;
+    return  EXCEPTION_SATE_OK;
+}
+
+static mtx_t mvm_heapLock;
+static once_flag mvm_heapOnce = ONCE_FLAG_INIT;
+
+static void mvm_initHeap(void)
+{
+    if (mtx_init(&mvm_heapLock, mtx_plain) != thrd_success) {
+        fprintf(stderr, "ERROR: Could not initialize the heap!\n");
+        exit(1);
+    }
+}
+
+ExceptionState interrupt_ALLOC(Mvm* mvm)
+{
+    if (mvm->stack_size < 1) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+
+    const uint64_t size = mvm->stack[mvm->stack_size - 1].as_u64;
+    MvmHeapBlock* block = size <= SIZE_MAX - sizeof(MvmHeapBlock) ? malloc(sizeof(MvmHeapBlock) + (size_t)size) : NULL;
+    mvm->stack[mvm->stack_size - 1] = word_ptr(block != NULL ? block + 1 : NULL);
+    if (block != NULL) {
+        Mvm* root = mvm->root != NULL ? mvm->root : mvm;
+        call_once(&mvm_heapOnce, mvm_initHeap);
+        mtx_lock(&mvm_heapLock);
+        block->prev = NULL;
+        block->next = root->heap;
+        if (root->heap != NULL) {
+            root->heap->prev = block;
+        }
+        root->heap = block;
+        mtx_unlock(&mvm_heapLock);
+        mvm->heap_allocated += size;
+        mvm->heap_blocks += 1;
+    }
+    return EXCEPTION_SATE_OK;
+}
+
+ExceptionState interrupt_FREE(Mvm* mvm)
+{
+    if (mvm->stack_size < 1) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+
+    MvmHeapBlock* block = mvm->stack[mvm->stack_size - 1].as_ptr;
+    if (block != NULL) {
+        Mvm* root = mvm->root != NULL ? mvm->root : mvm;
+        block -= 1;
+        call_once(&mvm_heapOnce, mvm_initHeap);
+        mtx_lock(&mvm_heapLock);
+        if (block->prev != NULL) {
+            block->prev->next = block->next;
+        } else {
+            root->heap = block->next;
+        }
+        if (block->next != NULL) {
+            block->next->prev = block->prev;
+        }
+        mtx_unlock(&mvm_heapLock);
+        free(block);
+        if (mvm->heap_blocks > 0) {
+            mvm->heap_blocks -= 1;
+        }
+    }
+    mvm->stack_size -= 1;
+    return  EXCEPTION_SATE_OK;
+}
+
+void mvm_freeHeap(Mvm* mvm)
+{
+    call_once(&mvm_heapOnce, mvm_initHeap);
+    mtx_lock(&mvm_heapLock);
+    while (mvm->heap != NULL) {
+        MvmHeapBlock* next = mvm->heap->next;
+        free(mvm->heap);
+        mvm->heap = next;
+    }
+    mtx_unlock(&mvm_heapLock);
+    mvm->heap_allocated = 0;
+    mvm->heap_blocks = 0;
+}
+
+ExceptionState interrupt_DUMPMEM (Mvm* mvm)
+{
+    if (mvm->stack_size < 2) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+
+    MemoryAddr addr = mvm->stack[mvm->stack_size - 2].as_u64;
+    uint64_t count = mvm->stack[mvm->stack_size - 1].as_u64;
+
+    if (addr >= MVM_MEMORY_CAPACITY) {
+        return EXCEPTION_ILLEGAL_INST_ACCESS;
+    }
+
+    if (addr + count < addr || addr + count >= MVM_MEMORY_CAPACITY) {
+        return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+    }
+
+    for (uint64_t i = addr; i < count; ++i) {
+        printf("%02X ", mvm->memory[addr + i]);
+    }
+    printf("\n");
+
+    mvm->stack_size -= 2;
+    return EXCEPTION_SATE_OK;
+}
+
+static ExceptionState mvm_write(Mvm* mvm, MvmSpan bytes)
+{
+    (void)mvm;
+    fwrite(bytes.data, sizeof(mvm->memory[0]), (size_t)bytes.size, stdout);
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND1(interrupt_WRITE, void, mvm_write, span)
+
+ExceptionState interrupt_READLINE (Mvm* mvm)
+{
+    char * line = malloc(100), * linep = line;
+    size_t lenmax = 100, len = lenmax;
+    int c;
+
+    if(line == NULL) {
+        return EXCEPTION_INTERRUPT_FAILED;
+    }    
+
+    for(;;) {
+        c = fgetc(stdin);
+        if(c == EOF)
+            break;
+
+        if(--len == 0) {
+            len = lenmax;
+            char * linen = realloc(linep, lenmax *= 2);
+
+            if(linen == NULL) {
+                free(linep);
+                return EXCEPTION_INTERRUPT_FAILED;
+            }
+            line = linen + (line - linep);
+            linep = linen;
+        }
+
+        if((*line++ = (char)c) == '\n')
+            break;
+    }
+    *line = '\0';
+    const char* cstr = linep;
+
+    StringView sv = cstr_as_sv(cstr);
+
+    if (mvm->stack_size + sv.count > MVM_STACK_CAPACITY) {
+        return EXCEPTION_STACK_OVERFLOW;
+    }
+
+    for (size_t i = 0; i <= sv.count; ++i) {
+        mvm->stack_size += 1;
+        mvm->stack[mvm->stack_size] = word_u64((uint64_t)sv.data[sv.count - 1 - i]);
+    }
+
+    return EXCEPTION_SATE_OK;
+}
+
+ExceptionState interrupt_CHANCREATE(Mvm* mvm)
+{
+    if (mvm->stack_size < 1) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+
+    const uint64_t handle = mvm_channelCreate(mvm, mvm->stack[mvm->stack_size - 1].as_u64);
+    if (handle == 0) {
+        return EXCEPTION_INTERRUPT_FAILED;
+    }
+    mvm->stack[mvm->stack_size - 1] = word_u64(handle);
+    return EXCEPTION_SATE_OK;
+}
+
+ExceptionState interrupt_CHANSEND(Mvm* mvm)
+{
+    if (mvm->stack_size < 2) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+
+    ExceptionState err = mvm_channelSend(mvm, mvm->stack[mvm->stack_size - 2].as_u64,
+                                         mvm->stack[mvm->stack_size - 1], word_u64(0));
+    if (err != EXCEPTION_SATE_OK) {
+        return err;
+    }
+    mvm->stack_size -= 2;
+    return EXCEPTION_SATE_OK;
+}
+
+ExceptionState interrupt_CHANRECV(Mvm* mvm)
+{
+    if (mvm->stack_size < 1) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+
+    Word value, size;
+    ExceptionState err = mvm_channelRecv(mvm, mvm->stack[mvm->stack_size - 1].as_u64, &value, &size);
+    if (err != EXCEPTION_SATE_OK) {
+        return err;
+    }
+    mvm->stack[mvm->stack_size - 1] = value;
+    return EXCEPTION_SATE_OK;
+}
+
+// Blocks are not copied when sending, the receiver gets their address. The sender must not
+// touch a block until the receiver hands it back.
+ExceptionState interrupt_CHANSENDBLK(Mvm* mvm)
+{
+    if (mvm->stack_size < 3) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+
+    MemoryAddr addr = mvm->stack[mvm->stack_size - 2].as_u64;
+    uint64_t count = mvm->stack[mvm->stack_size - 1].as_u64;
+
+    if (addr + count < addr || addr + count > MVM_MEMORY_CAPACITY) {
+        return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+    }
+
+    ExceptionState err = mvm_channelSend(mvm, mvm->stack[mvm->stack_size - 3].as_u64,
+                                         word_u64(addr), word_u64(count));
+    if (err != EXCEPTION_SATE_OK) {
+        return err;
+    }
+    mvm->stack_size -= 3;
+    return EXCEPTION_SATE_OK;
+}
+
+// Channels only connect threads of one program, which share their memory, so receiving a block is free.
+ExceptionState interrupt_CHANRECVBLK(Mvm* mvm)
+{
+    if (mvm->stack_size < 1) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+    if (mvm->stack_size + 1 > MVM_STACK_CAPACITY) {
+        return EXCEPTION_STACK_OVERFLOW;
+    }
+
+    Word addr, count;
+    ExceptionState err = mvm_channelRecv(mvm, mvm->stack[mvm->stack_size - 1].as_u64, &addr, &count);
+    if (err != EXCEPTION_SATE_OK) {
+        return err;
+    }
+    mvm->stack[mvm->stack_size - 1] = addr;
+    mvm->stack[mvm->stack_size++] = count;
+    return EXCEPTION_SATE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// String kernels over the VM memory. On x86-64 they scan 16 (SSE2) or 32 (AVX2) bytes at a time,
+// mvm_initStringKernels picks the widest version the CPU supports. Everything else is plain C.
+typedef struct _MVM_STRING_KERNELS_ {
+    size_t (*findByte)(const uint8_t* data, size_t size, uint8_t byte); // `size` if there is none.
+    size_t (*countByte)(const uint8_t* data, size_t size, uint8_t byte);
+    size_t (*find)(const uint8_t* data, size_t size, const uint8_t* needle, size_t needleSize); // SIZE_MAX if there is none.
+} MvmStringKernels;
+
+static size_t mvm_findByteScalar(const uint8_t* data, size_t size, uint8_t byte)
+{
+    const uint8_t* found = memchr(data, byte, size);
+    return found != NULL ? (size_t)(found - data) : size;
+}
+
+static size_t mvm_countByteScalar(const uint8_t* data, size_t size, uint8_t byte)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        count += data[i] == byte;
+    }
+    return count;
+}
+
+// Checks the candidates from `i` on one by one, used for the tail of the vectorized versions.
+static size_t mvm_findScalarFrom(const uint8_t* data, size_t size, const uint8_t* needle, size_t needleSize, size_t i)
+{
+    if (needleSize == 0) {
+        return 0;
+    }
+    for (; needleSize <= size && i <= size - needleSize; ++i) {
+        if (data[i] == needle[0] && memcmp(&data[i + 1], &needle[1], needleSize - 1) == 0) {
+            return i;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static size_t mvm_findScalar(const uint8_t* data, size_t size, const uint8_t* needle, size_t needleSize)
+{
+    return mvm_findScalarFrom(data, size, needle, needleSize, 0);
+}
+
+#ifdef MVM_X86_SIMD
+static size_t mvm_findByteSse2(const uint8_t* data, size_t size, uint8_t byte)
+{
+    const __m128i pattern = _mm_set1_epi8((char)byte);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&data[i]), pattern));
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+        }
+    }
+    return i + mvm_findByteScalar(&data[i], size - i, byte);
+}
+
+static size_t mvm_countByteSse2(const uint8_t* data, size_t size, uint8_t byte)
+{
+    const __m128i pattern = _mm_set1_epi8((char)byte);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&data[i]), pattern));
+        count += (size_t)__builtin_popcount((unsigned)mask);
+    }
+    return count + mvm_countByteScalar(&data[i], size - i, byte);
+}
+
+// Compares the first and the last byte of the needle at 16 positions at once, only the matches are compared in full.
+static size_t mvm_findSse2(const uint8_t* data, size_t size, const uint8_t* needle, size_t needleSize)
+{
+    if (needleSize == 0 || needleSize > size) {
+        return mvm_findScalar(data, size, needle, needleSize);
+    }
+    const __m128i first = _mm_set1_epi8((char)needle[0]);
+    const __m128i last = _mm_set1_epi8((char)needle[needleSize - 1]);
+    size_t i = 0;
+    for (; i + needleSize - 1 + 16 <= size; i += 16) {
+        const __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&data[i]), first);
+        const __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&data[i + needleSize - 1]), last);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(a, b));
+        while (mask != 0) {
+            const size_t at = i + (size_t)__builtin_ctz(mask);
+            if (needleSize <= 2 || memcmp(&data[at + 1], &needle[1], needleSize - 2) == 0) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return mvm_findScalarFrom(data, size, needle, needleSize, i);
+}
+
+__attribute__((target("avx2")))
+static size_t mvm_findByteAvx2(const uint8_t* data, size_t size, uint8_t byte)
+{
+    const __m256i pattern = _mm256_set1_epi8((char)byte);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&data[i]), pattern));
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + mvm_findByteSse2(&data[i], size - i, byte);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t mvm_countByteAvx2(const uint8_t* data, size_t size, uint8_t byte)
+{
+    const __m256i pattern = _mm256_set1_epi8((char)byte);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&data[i]), pattern));
+        count += (size_t)__builtin_popcount(mask);
+    }
+    return count + mvm_countByteSse2(&data[i], size - i, byte);
+}
+
+__attribute__((target("avx2")))
+static size_t mvm_findAvx2(const uint8_t* data, size_t size, const uint8_t* needle, size_t needleSize)
+{
+    if (needleSize == 0 || needleSize > size) {
+        return mvm_findScalar(data, size, needle, needleSize);
+    }
+    const __m256i first = _mm256_set1_epi8((char)needle[0]);
+    const __m256i last = _mm256_set1_epi8((char)needle[needleSize - 1]);
+    size_t i = 0;
+    for (; i + needleSize - 1 + 32 <= size; i += 32) {
+        const __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&data[i]), first);
+        const __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&data[i + needleSize - 1]), last);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+        while (mask != 0) {
+            const size_t at = i + (size_t)__builtin_ctz(mask);
+            if (needleSize <= 2 || memcmp(&data[at + 1], &needle[1], needleSize - 2) == 0) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return mvm_findScalarFrom(data, size, needle, needleSize, i);
+}
+#endif
+
+static MvmStringKernels mvm_stringKernels = {mvm_findByteScalar, mvm_countByteScalar, mvm_findScalar};
+static once_flag mvm_stringKernelsOnce = ONCE_FLAG_INIT;
+
+static void mvm_selectStringKernels(void)
+{
+#ifdef MVM_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mvm_stringKernels = (MvmStringKernels) {mvm_findByteAvx2, mvm_countByteAvx2, mvm_findAvx2};
+    } else {
+        mvm_stringKernels = (MvmStringKernels) {mvm_findByteSse2, mvm_countByteSse2, mvm_findSse2};
+    }
+#endif
+}
+
+void mvm_initStringKernels(void)
+{
+    call_once(&mvm_stringKernelsOnce, mvm_selectStringKernels);
+}
+
+static ExceptionState mvm_strLen(Mvm* mvm, uint8_t* str, uint64_t* length)
+{
+    const size_t size = (size_t)(&mvm->memory[MVM_MEMORY_CAPACITY] - str);
+    *length = mvm_stringKernels.findByte(str, size, 0);
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND1(interrupt_STRLEN, u64, mvm_strLen, mem)
+
+// Maps every byte through the 256 bytes at `table`, e.g. for case mapping or rot13.
+// A 256 entry byte table has no cheap SSE2/AVX2 form (no byte gather), the loop is one load per byte.
+static ExceptionState mvm_strTranslate(Mvm* mvm, MvmSpan bytes, uint8_t* table)
+{
+    if (&mvm->memory[MVM_MEMORY_CAPACITY] - table < 256) {
+        return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+    }
+    uint8_t map[256];
+    memcpy(map, table, sizeof(map));
+    for (uint64_t i = 0; i < bytes.size; ++i) {
+        bytes.data[i] = map[bytes.data[i]];
+    }
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND2(interrupt_STRTRANSLATE, void, mvm_strTranslate, span, mem)
+
+static ExceptionState mvm_strFind(Mvm* mvm, MvmSpan data, MvmSpan needle, uint64_t* index)
+{
+    (void)mvm;
+    const size_t found = mvm_stringKernels.find(data.data, (size_t)data.size, needle.data, (size_t)needle.size);
+    *index = found == SIZE_MAX ? UINT64_MAX : found;
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND2(interrupt_STRFIND, u64, mvm_strFind, span, span)
+
+static ExceptionState mvm_strCount(Mvm* mvm, MvmSpan data, uint64_t byte, uint64_t* count)
+{
+    (void)mvm;
+    *count = mvm_stringKernels.countByte(data.data, (size_t)data.size, (uint8_t)byte);
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND2(interrupt_STRCOUNT, u64, mvm_strCount, span, u64)
+
+// Writes the decimal digits of `value` to `str`.
+static ExceptionState mvm_u64ToStr(Mvm* mvm, uint64_t value, uint8_t* str, uint64_t* length)
+{
+    uint8_t digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = (uint8_t)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    if ((size_t)(&mvm->memory[MVM_MEMORY_CAPACITY] - str) < count) {
+        return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        str[i] = digits[count - 1 - i];
     }
+    *length = count;
     return EXCEPTION_SATE_OK;
 }
+MVM_BIND2(interrupt_U64TOSTR, u64, mvm_u64ToStr, u64, mem)
 
-ExceptionState mvm_execProgram(Mvm* mvm, int limit)
+// Parses the leading decimal digits, saturating at UINT64_MAX.
+static ExceptionState mvm_strToU64(Mvm* mvm, MvmSpan str, uint64_t* value)
 {
-    while (limit != 0 && !mvm->halt) {
-        ExceptionState err = mvm_execInst(mvm);
-        if (mvm->stack_size > MVM_STACK_CAPACITY) {
-            return EXCEPTION_STACK_OVERFLOW;
-        }
-        if (err != EXCEPTION_SATE_OK) {
-            return err;
-        }
-        if (limit > 0) {
-            --limit;
+    (void)mvm;
+    *value = 0;
+    for (uint64_t i = 0; i < str.size && isdigit(str.data[i]); ++i) {
+        const uint64_t digit = (uint64_t)(str.data[i] - '0');
+        if (*value > (UINT64_MAX - digit) / 10) {
+            *value = UINT64_MAX;
+            break;
         }
+        *value = *value * 10 + digit;
     }
     return EXCEPTION_SATE_OK;
 }
+MVM_BIND1(interrupt_STRTOU64, u64, mvm_strToU64, span)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 
-ExceptionState interrupt_PRINTchar(Mvm* mvm)
-{
-    if (mvm->stack_size < 1) {
-        return EXCEPTION_STACK_UNDERFLOW;
-    }
+// Files are shared by all threads of the process, like channels. Handles of files and of asynchronous
+// requests are their index in the table plus one. Failing system calls push -1, a handle that is not
+// open or a misaligned mapping fails the interrupt. Files can only be opened below the root directory
+// set with mvm_setFileRoot ('mvm -fs'), without one 'file_open' fails.
+#if defined(MVM_FILES_POSIX)
+typedef struct _MVM_FILE_ {
+    int fd;
+    bool used;
+    uint64_t pending; // Asynchronous requests that still use the file.
+} MvmFile;
+
+typedef struct _MVM_FILE_MAP_ {
+    uint8_t* data;
+    size_t size;
+} MvmFileMap;
+
+typedef enum _MVM_FILE_REQUEST_STATE_ {
+    MVM_FILE_REQUEST_FREE = 0,
+    MVM_FILE_REQUEST_QUEUED,
+    MVM_FILE_REQUEST_DONE,
+} MvmFileRequestState;
+
+typedef struct _MVM_FILE_REQUEST_ {
+    MvmFileRequestState state;
+    bool write;
+    int fd;
+    uint64_t file;
+    uint64_t offset;
+    uint8_t* data;
+    uint64_t size;
+    uint64_t done; // Bytes moved by the completed entries of the ring.
+    uint64_t result;
+} MvmFileRequest;
+
+#if defined(MVM_FILES_IO_URING)
+// The rings of io_uring, mapped from the kernel. Only the submitting thread writes entries and only the
+// completer thread consumes them, both hold mvm_filesLock.
+typedef struct _MVM_FILE_RING_ {
+    int fd;
+    uint8_t* sq;
+    size_t sq_size;
+    uint8_t* cq;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+} MvmFileRing;
+#endif
 
-    if (mvm->stack[mvm->stack_size - 1].as_u64 != 13) {
-        printf("%c", (int) mvm->stack[mvm->stack_size - 1].as_u64);
-    } else {
-        printf("\n");
+static int mvm_fileRoot = -1;
+static MvmFile mvm_files[MVM_FILES_CAPACITY];
+static MvmFileMap mvm_fileMaps[MVM_FILE_MAPS_CAPACITY];
+static MvmFileRequest mvm_fileRequests[MVM_FILE_REQUESTS_CAPACITY];
+// Indices of the queued requests in the order they were submitted.
+static size_t mvm_fileQueue[MVM_FILE_REQUESTS_CAPACITY];
+static size_t mvm_fileQueue_head;
+static size_t mvm_fileQueue_size;
+static bool mvm_fileBackendStarted;
+static _Atomic uint64_t mvm_fileRequestsPending;
+#if defined(MVM_FILES_IO_URING)
+static MvmFileRing mvm_fileRing = {.fd = -1};
+#endif
+static mtx_t mvm_filesLock;
+static cnd_t mvm_fileQueued;
+static cnd_t mvm_fileDone;
+static once_flag mvm_filesOnce = ONCE_FLAG_INIT;
+
+static void mvm_initFiles(void)
+{
+    if (mtx_init(&mvm_filesLock, mtx_plain) != thrd_success
+        || cnd_init(&mvm_fileQueued) != thrd_success || cnd_init(&mvm_fileDone) != thrd_success) {
+        fprintf(stderr, "ERROR: Could not initialize the file table!\n");
+        exit(1);
     }
-    mvm->stack_size -= 1;
-    return  EXCEPTION_SATE_OK;
 }
 
-ExceptionState interrupt_PRINTf64(Mvm* mvm)
+// Returns the open file of `handle`, NULL if there is none. Expects mvm_filesLock to be held.
+static MvmFile* mvm_findFile(uint64_t handle)
 {
-    if (mvm->stack_size < 1) {
-        return EXCEPTION_STACK_UNDERFLOW;
+    if (handle == 0 || handle > MVM_FILES_CAPACITY || !mvm_files[handle - 1].used) {
+        return NULL;
     }
+    return &mvm_files[handle - 1];
+}
 
-    printf("%lf", mvm->stack[mvm->stack_size - 1].as_f64);
-    mvm->stack_size -= 1;
-    return  EXCEPTION_SATE_OK;
+static int mvm_fileFd(uint64_t handle)
+{
+    call_once(&mvm_filesOnce, mvm_initFiles);
+    mtx_lock(&mvm_filesLock);
+    const MvmFile* file = mvm_findFile(handle);
+    const int fd = file != NULL ? file->fd : -1;
+    mtx_unlock(&mvm_filesLock);
+    return fd;
 }
 
-ExceptionState interrupt_PRINTi64(Mvm* mvm)
+// The memory of a server job is write protected until a page is written (see 'mvm -S'), but a system call
+// writing to such a page fails with EFAULT instead of faulting. Writing to every page first unprotects them.
+static void mvm_touchPages(uint8_t* data, uint64_t size)
 {
-    if (mvm->stack_size < 1) {
-        return EXCEPTION_STACK_UNDERFLOW;
+    for (uint64_t i = 0; i < size; i += MVM_MEMORY_ALIGNMENT) {
+        atomic_fetch_or_explicit((_Atomic uint8_t*)&data[i], 0, memory_order_relaxed);
+    }
+    if (size > 0) {
+        atomic_fetch_or_explicit((_Atomic uint8_t*)&data[size - 1], 0, memory_order_relaxed);
     }
-
-    printf("%" PRId64, mvm->stack[mvm->stack_size - 1].as_i64);
-    mvm->stack_size -= 1;
-    return  EXCEPTION_SATE_OK;
 }
 
-ExceptionState interrupt_PRINTu64(Mvm* mvm)
+// Moves `size` bytes at `offset`, or at the file position if it is NULL. Only stops early at the end of
+// the file, returns the number of bytes moved or UINT64_MAX if the first system call failed.
+static uint64_t mvm_fileTransfer(int fd, bool out, uint8_t* data, uint64_t size, const uint64_t* offset)
 {
-    if (mvm->stack_size < 1) {
-        return EXCEPTION_STACK_UNDERFLOW;
+    uint64_t done = 0;
+    while (done < size) {
+        const size_t chunk = (size_t)(size - done);
+        ssize_t n;
+        if (offset != NULL) {
+            const off_t at = (off_t)(*offset + done);
+            n = out ? pwrite(fd, data + done, chunk, at) : pread(fd, data + done, chunk, at);
+        } else {
+            n = out ? write(fd, data + done, chunk) : read(fd, data + done, chunk);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return done > 0 ? done : UINT64_MAX;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += (uint64_t)n;
     }
+    return done;
+}
 
-    printf("%" PRIu64, mvm->stack[mvm->stack_size - 1].as_u64);
-    mvm->stack_size -= 1;
-    return  EXCEPTION_SATE_OK;
+bool mvm_setFileRoot(const char* root)
+{
+    const int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    if (mvm_fileRoot >= 0) {
+        close(mvm_fileRoot);
+    }
+    mvm_fileRoot = fd;
+    return true;
 }
 
-ExceptionState interrupt_PRINTptr(Mvm* mvm)
+// Opens a relative path below the file root. Absolute paths and '..' components are refused. On Linux the
+// kernel also keeps symbolic links from leaving the root, elsewhere only a link as the last component is refused.
+static int mvm_openBeneathRoot(const char* path, int oflags)
 {
-    if (mvm->stack_size < 1) {
-        return EXCEPTION_STACK_UNDERFLOW;
+    if (*path == '/') {
+        errno = EACCES;
+        return -1;
+    }
+    for (const char* part = path; *part != '\0';) {
+        const size_t size = strcspn(part, "/");
+        if (size == 2 && part[0] == '.' && part[1] == '.') {
+            errno = EACCES;
+            return -1;
+        }
+        part += size;
+        part += strspn(part, "/");
+    }
+    const mode_t mode = (oflags & O_CREAT) ? 0644 : 0;
+#if defined(__linux__) && defined(SYS_openat2)
+    // struct open_how of openat2, RESOLVE_BENEATH.
+    const struct { uint64_t flags; uint64_t mode; uint64_t resolve; } how = {
+            .flags = (uint64_t)oflags, .mode = mode, .resolve = 0x08
+    };
+    const long fd = syscall(SYS_openat2, mvm_fileRoot, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) {
+        return (int)fd;
     }
+#endif
+    return openat(mvm_fileRoot, path, oflags | O_NOFOLLOW, mode);
+}
 
-    printf("0x%" PRIx64, (uint64_t)*(uintptr_t*) &mvm->stack[mvm->stack_size - 1].as_ptr);
-    mvm->stack_size -= 1;
-    return  EXCEPTION_SATE_OK;
+// Waits for a request to finish, at most MVM_FILE_WAIT_NS. Gives up when the run time limit of the VM expires.
+// Expects mvm_filesLock to be held.
+static ExceptionState mvm_fileWait(const Mvm* mvm)
+{
+    const Mvm* root = mvm->root != NULL ? mvm->root : mvm;
+    if (atomic_load_explicit(&root->deadline_expired, memory_order_relaxed)) {
+        return EXCEPTION_TIMEOUT;
+    }
+    struct timespec until;
+    timespec_get(&until, TIME_UTC);
+    until.tv_nsec += MVM_FILE_WAIT_NS;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec += 1;
+        until.tv_nsec -= 1000000000;
+    }
+    cnd_timedwait(&mvm_fileDone, &mvm_filesLock, &until);
+    return EXCEPTION_SATE_OK;
 }
 
-ExceptionState interrupt_ALLOC(Mvm* mvm)
+static ExceptionState mvm_fileOpen(Mvm* mvm, MvmSpan path, uint64_t flags, uint64_t* handle)
 {
-    if (mvm->stack_size < 1) {
-        return EXCEPTION_STACK_UNDERFLOW;
+    (void)mvm;
+    const uint64_t known = MVM_FILE_READ | MVM_FILE_WRITE | MVM_FILE_TRUNCATE | MVM_FILE_APPEND;
+    if ((flags & (MVM_FILE_READ | MVM_FILE_WRITE)) == 0 || (flags & ~known) != 0
+        || ((flags & (MVM_FILE_TRUNCATE | MVM_FILE_APPEND)) != 0 && (flags & MVM_FILE_WRITE) == 0)) {
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+    if (mvm_fileRoot < 0) {
+        return EXCEPTION_INTERRUPT_FAILED;
+    }
+    if (path.size >= MVM_FILE_PATH_CAPACITY) {
+        return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+    }
+    char cpath[MVM_FILE_PATH_CAPACITY];
+    memcpy(cpath, path.data, (size_t)path.size);
+    cpath[path.size] = '\0';
+
+    int oflags = (flags & MVM_FILE_READ) && (flags & MVM_FILE_WRITE) ? O_RDWR : (flags & MVM_FILE_WRITE) ? O_WRONLY : O_RDONLY;
+    oflags |= (flags & MVM_FILE_WRITE) ? O_CREAT : 0;
+    oflags |= (flags & MVM_FILE_TRUNCATE) ? O_TRUNC : 0;
+    oflags |= (flags & MVM_FILE_APPEND) ? O_APPEND : 0;
+    const int fd = mvm_openBeneathRoot(cpath, oflags | O_CLOEXEC);
+    *handle = UINT64_MAX;
+    if (fd < 0) {
+        return EXCEPTION_SATE_OK;
     }
 
-    mvm->stack[mvm->stack_size - 1] = word_ptr(malloc((size_t)mvm->stack[mvm->stack_size - 1].as_u64));
+    call_once(&mvm_filesOnce, mvm_initFiles);
+    mtx_lock(&mvm_filesLock);
+    for (size_t i = 0; i < MVM_FILES_CAPACITY; ++i) {
+        if (!mvm_files[i].used) {
+            mvm_files[i] = (MvmFile) {.fd = fd, .used = true, .pending = 0};
+            *handle = i + 1;
+            break;
+        }
+    }
+    mtx_unlock(&mvm_filesLock);
+    if (*handle == UINT64_MAX) {
+        close(fd);
+    }
     return EXCEPTION_SATE_OK;
 }
+MVM_BIND2(interrupt_FILEOPEN, u64, mvm_fileOpen, span, u64)
 
-ExceptionState interrupt_FREE(Mvm* mvm)
+// Waits for the asynchronous requests of the file before closing it.
+static ExceptionState mvm_fileClose(Mvm* mvm, uint64_t handle)
 {
-    if (mvm->stack_size < 1) {
-        return EXCEPTION_STACK_UNDERFLOW;
+    call_once(&mvm_filesOnce, mvm_initFiles);
+    mtx_lock(&mvm_filesLock);
+    MvmFile* file = mvm_findFile(handle);
+    if (file == NULL) {
+        mtx_unlock(&mvm_filesLock);
+        return EXCEPTION_ILLEGAL_OPERAND;
     }
-
-    free(mvm->stack[mvm->stack_size - 1].as_ptr);
-    mvm->stack_size -= 1;
-    return  EXCEPTION_SATE_OK;
+    while (file->pending > 0) {
+        const ExceptionState err = mvm_fileWait(mvm);
+        if (err != EXCEPTION_SATE_OK) {
+            mtx_unlock(&mvm_filesLock);
+            return err;
+        }
+    }
+    close(file->fd);
+    file->used = false;
+    mtx_unlock(&mvm_filesLock);
+    return EXCEPTION_SATE_OK;
 }
+MVM_BIND1(interrupt_FILECLOSE, void, mvm_fileClose, u64)
 
-ExceptionState interrupt_DUMPMEM (Mvm* mvm)
+static ExceptionState mvm_fileRead(Mvm* mvm, uint64_t handle, MvmSpan bytes, uint64_t* count)
 {
-    if (mvm->stack_size < 2) {
-        return EXCEPTION_STACK_UNDERFLOW;
+    (void)mvm;
+    const int fd = mvm_fileFd(handle);
+    if (fd < 0) {
+        return EXCEPTION_ILLEGAL_OPERAND;
     }
+    mvm_touchPages(bytes.data, bytes.size);
+    *count = mvm_fileTransfer(fd, false, bytes.data, bytes.size, NULL);
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND2(interrupt_FILEREAD, u64, mvm_fileRead, u64, span)
 
-    MemoryAddr addr = mvm->stack[mvm->stack_size - 2].as_u64;
-    uint64_t count = mvm->stack[mvm->stack_size - 1].as_u64;
+static ExceptionState mvm_fileWrite(Mvm* mvm, uint64_t handle, MvmSpan bytes, uint64_t* count)
+{
+    (void)mvm;
+    const int fd = mvm_fileFd(handle);
+    if (fd < 0) {
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+    *count = mvm_fileTransfer(fd, true, bytes.data, bytes.size, NULL);
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND2(interrupt_FILEWRITE, u64, mvm_fileWrite, u64, span)
 
-    if (addr >= MVM_MEMORY_CAPACITY) {
-        return EXCEPTION_ILLEGAL_INST_ACCESS;
+static ExceptionState mvm_fileSize(Mvm* mvm, uint64_t handle, uint64_t* size)
+{
+    (void)mvm;
+    const int fd = mvm_fileFd(handle);
+    if (fd < 0) {
+        return EXCEPTION_ILLEGAL_OPERAND;
     }
+    struct stat st;
+    *size = fstat(fd, &st) == 0 ? (uint64_t)st.st_size : UINT64_MAX;
+    return EXCEPTION_SATE_OK;
+}
+MVM_BIND1(interrupt_FILESIZE, u64, mvm_fileSize, u64)
 
-    if (addr + count < addr || addr + count >= MVM_MEMORY_CAPACITY) {
+// Maps the file from `offset` on over the range, copy on write, so writes never reach the file. Pages past
+// the end of the file are left alone and the rest of the last page reads as zero. Pushes the number of bytes
+// of the file that were mapped. The range and `offset` have to start at a page boundary.
+static ExceptionState mvm_fileMap(Mvm* mvm, uint64_t handle, uint64_t offset, MvmSpan bytes, uint64_t* mapped)
+{
+    const int fd = mvm_fileFd(handle);
+    const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    if (fd < 0 || (uintptr_t)bytes.data % page != 0 || offset % page != 0) {
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+    struct stat st;
+    *mapped = UINT64_MAX;
+    if (fstat(fd, &st) != 0) {
+        return EXCEPTION_SATE_OK;
+    }
+    const uint64_t fileSize = (uint64_t)st.st_size;
+    const uint64_t size = offset < fileSize ? (fileSize - offset < bytes.size ? fileSize - offset : bytes.size) : 0;
+    const size_t length = (size_t)((size + page - 1) / page * page);
+    if (size == 0) {
+        *mapped = 0;
+        return EXCEPTION_SATE_OK;
+    }
+    if (bytes.data + length > mvm->memory + MVM_MEMORY_ALLOC_SIZE) {
         return EXCEPTION_MEMORY_ACCESS_VIOLATION;
     }
 
-    for (uint64_t i = addr; i < count; ++i) {
-        printf("%02X ", mvm->memory[addr + i]);
+    mtx_lock(&mvm_filesLock);
+    MvmFileMap* map = NULL;
+    for (size_t i = 0; i < MVM_FILE_MAPS_CAPACITY; ++i) {
+        const MvmFileMap* other = &mvm_fileMaps[i];
+        if (other->data != NULL && other->data < bytes.data + length && bytes.data < other->data + other->size) {
+            mtx_unlock(&mvm_filesLock);
+            return EXCEPTION_ILLEGAL_OPERAND;
+        }
+        if (other->data == NULL && map == NULL) {
+            map = &mvm_fileMaps[i];
+        }
     }
-    printf("\n");
-
-    mvm->stack_size -= 2;
+    if (map != NULL) {
+        mvm_touchPages(bytes.data, length);
+        if (mmap(bytes.data, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t)offset) != MAP_FAILED) {
+            *map = (MvmFileMap) {.data = bytes.data, .size = length};
+            *mapped = size;
+        }
+    }
+    mtx_unlock(&mvm_filesLock);
     return EXCEPTION_SATE_OK;
 }
+MVM_BIND3(interrupt_FILEMAP, u64, mvm_fileMap, u64, u64, span)
 
-ExceptionState interrupt_WRITE (Mvm* mvm)
+// Replaces the pages of a mapping with zeroed memory. Expects mvm_filesLock to be held.
+static bool mvm_unmapFile(MvmFileMap* map)
 {
-    if (mvm->stack_size < 2) {
-        return EXCEPTION_STACK_UNDERFLOW;
+    if (mmap(map->data, map->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+        return false;
     }
+    map->data = NULL;
+    map->size = 0;
+    return true;
+}
 
-    MemoryAddr addr = mvm->stack[mvm->stack_size - 2].as_u64;
-    uint64_t count = mvm->stack[mvm->stack_size - 1].as_u64;
+// Unmaps the file mapped at `addr`, the pages read as zero afterwards.
+static ExceptionState mvm_fileUnmap(Mvm* mvm, uint8_t* addr)
+{
+    (void)mvm;
+    call_once(&mvm_filesOnce, mvm_initFiles);
+    mtx_lock(&mvm_filesLock);
+    for (size_t i = 0; i < MVM_FILE_MAPS_CAPACITY; ++i) {
+        if (mvm_fileMaps[i].data == addr) {
+            const bool unmapped = mvm_unmapFile(&mvm_fileMaps[i]);
+            mtx_unlock(&mvm_filesLock);
+            return unmapped ? EXCEPTION_SATE_OK : EXCEPTION_INTERRUPT_FAILED;
+        }
+    }
+    mtx_unlock(&mvm_filesLock);
+    return EXCEPTION_ILLEGAL_OPERAND;
+}
+MVM_BIND1(interrupt_FILEUNMAP, void, mvm_fileUnmap, mem)
 
-    if (addr >= MVM_MEMORY_CAPACITY) {
-        return EXCEPTION_ILLEGAL_INST_ACCESS;
+// Finishes a request and wakes its waiters. Expects mvm_filesLock to be held.
+static void mvm_fileComplete(MvmFileRequest* request, uint64_t result)
+{
+    request->result = result;
+    request->state = MVM_FILE_REQUEST_DONE;
+    mvm_files[request->file - 1].pending -= 1;
+    atomic_fetch_sub(&mvm_fileRequestsPending, 1);
+    cnd_broadcast(&mvm_fileDone);
+}
+
+// Serves the queued requests one at a time.
+static int mvm_fileWorker(void* arg)
+{
+    (void)arg;
+    mtx_lock(&mvm_filesLock);
+    for (;;) {
+        while (mvm_fileQueue_size == 0) {
+            cnd_wait(&mvm_fileQueued, &mvm_filesLock);
+        }
+        MvmFileRequest* request = &mvm_fileRequests[mvm_fileQueue[mvm_fileQueue_head]];
+        mvm_fileQueue_head = (mvm_fileQueue_head + 1) % MVM_FILE_REQUESTS_CAPACITY;
+        mvm_fileQueue_size -= 1;
+        mtx_unlock(&mvm_filesLock);
+
+        const uint64_t result = mvm_fileTransfer(request->fd, request->write, request->data, request->size, &request->offset);
+
+        mtx_lock(&mvm_filesLock);
+        mvm_fileComplete(request, result);
     }
+    return 0;
+}
 
-    if (addr + count < addr || addr + count >= MVM_MEMORY_CAPACITY) {
-        return EXCEPTION_MEMORY_ACCESS_VIOLATION;
+#if defined(MVM_FILES_IO_URING)
+static void mvm_fileRingClose(void)
+{
+    if (mvm_fileRing.sq != NULL && mvm_fileRing.sq != MAP_FAILED) {
+        munmap(mvm_fileRing.sq, mvm_fileRing.sq_size);
+    }
+    if (mvm_fileRing.cq != NULL && mvm_fileRing.cq != MAP_FAILED) {
+        munmap(mvm_fileRing.cq, mvm_fileRing.cq_size);
     }
+    if (mvm_fileRing.sqes != NULL && mvm_fileRing.sqes != MAP_FAILED) {
+        munmap(mvm_fileRing.sqes, mvm_fileRing.sqes_size);
+    }
+    close(mvm_fileRing.fd);
+    mvm_fileRing = (MvmFileRing) {.fd = -1};
+}
 
-    fwrite(&mvm->memory[addr], sizeof(mvm->memory[0]), (size_t)count, stdout);
+// Sets up a ring with an entry for every request, so the submission queue can't run full. Fails if the kernel
+// has no io_uring, it's disabled or it's older than IORING_OP_READ and IORING_OP_WRITE (Linux 5.6).
+static bool mvm_fileRingOpen(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const long fd = syscall(SYS_io_uring_setup, MVM_FILE_REQUESTS_CAPACITY, &params);
+    if (fd < 0) {
+        return false;
+    }
+    mvm_fileRing.fd = (int)fd;
+    if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+        mvm_fileRingClose();
+        return false;
+    }
+    mvm_fileRing.sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    mvm_fileRing.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    mvm_fileRing.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    mvm_fileRing.sq = mmap(NULL, mvm_fileRing.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, (int)fd, IORING_OFF_SQ_RING);
+    mvm_fileRing.cq = mmap(NULL, mvm_fileRing.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED, (int)fd, IORING_OFF_CQ_RING);
+    mvm_fileRing.sqes = mmap(NULL, mvm_fileRing.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, (int)fd, IORING_OFF_SQES);
+    if (mvm_fileRing.sq == MAP_FAILED || mvm_fileRing.cq == MAP_FAILED || mvm_fileRing.sqes == MAP_FAILED) {
+        mvm_fileRingClose();
+        return false;
+    }
+    mvm_fileRing.sq_tail = (uint32_t*)(mvm_fileRing.sq + params.sq_off.tail);
+    mvm_fileRing.sq_array = (uint32_t*)(mvm_fileRing.sq + params.sq_off.array);
+    mvm_fileRing.sq_mask = *(uint32_t*)(mvm_fileRing.sq + params.sq_off.ring_mask);
+    mvm_fileRing.cq_head = (uint32_t*)(mvm_fileRing.cq + params.cq_off.head);
+    mvm_fileRing.cq_tail = (uint32_t*)(mvm_fileRing.cq + params.cq_off.tail);
+    mvm_fileRing.cq_mask = *(uint32_t*)(mvm_fileRing.cq + params.cq_off.ring_mask);
+    mvm_fileRing.cqes = (struct io_uring_cqe*)(mvm_fileRing.cq + params.cq_off.cqes);
+    return true;
+}
 
-    mvm->stack_size -= 2;
+// Submits the rest of the transfer of a request. A transfer is split into entries of MVM_FILE_RING_CHUNK bytes
+// and continued after a short one, so it only stops early at the end of the file like mvm_fileTransfer.
+// Expects mvm_filesLock to be held.
+static void mvm_fileRingSubmit(size_t index)
+{
+    MvmFileRequest* request = &mvm_fileRequests[index];
+    const uint64_t rest = request->size - request->done;
+    // An offset of -1 would move the file position instead of failing like pread.
+    if (rest == 0 || request->offset > (uint64_t)INT64_MAX - request->done) {
+        mvm_fileComplete(request, rest == 0 || request->done > 0 ? request->done : UINT64_MAX);
+        return;
+    }
+    const uint32_t tail = *mvm_fileRing.sq_tail;
+    const uint32_t slot = tail & mvm_fileRing.sq_mask;
+    struct io_uring_sqe* sqe = &mvm_fileRing.sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->off = request->offset + request->done;
+    sqe->addr = (uint64_t)(uintptr_t)(request->data + request->done);
+    sqe->len = (uint32_t)(rest < MVM_FILE_RING_CHUNK ? rest : MVM_FILE_RING_CHUNK);
+    sqe->user_data = index;
+    mvm_fileRing.sq_array[slot] = slot;
+    atomic_store_explicit((_Atomic uint32_t*)mvm_fileRing.sq_tail, tail + 1, memory_order_release);
+    while (syscall(SYS_io_uring_enter, mvm_fileRing.fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fprintf(stderr, "ERROR: Could not submit a file request! : %s\n", strerror(errno));
+            exit(1);
+        }
+        thrd_yield();
+    }
+}
 
-    return EXCEPTION_SATE_OK;
+// Waits for completed entries of the ring and finishes their requests or continues short transfers.
+static int mvm_fileRingCompleter(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        if (syscall(SYS_io_uring_enter, mvm_fileRing.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            fprintf(stderr, "ERROR: Could not wait for a file request! : %s\n", strerror(errno));
+            exit(1);
+        }
+        mtx_lock(&mvm_filesLock);
+        uint32_t head = *mvm_fileRing.cq_head;
+        const uint32_t tail = atomic_load_explicit((_Atomic uint32_t*)mvm_fileRing.cq_tail, memory_order_acquire);
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe cqe = mvm_fileRing.cqes[head & mvm_fileRing.cq_mask];
+            MvmFileRequest* request = &mvm_fileRequests[cqe.user_data];
+            if (cqe.res > 0) {
+                request->done += (uint64_t)cqe.res;
+            }
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN || (cqe.res > 0 && request->done < request->size)) {
+                mvm_fileRingSubmit((size_t)cqe.user_data);
+            } else {
+                mvm_fileComplete(request, cqe.res < 0 && request->done == 0 ? UINT64_MAX : request->done);
+            }
+        }
+        atomic_store_explicit((_Atomic uint32_t*)mvm_fileRing.cq_head, head, memory_order_release);
+        mtx_unlock(&mvm_filesLock);
+    }
+    return 0;
 }
+#endif
 
-ExceptionState interrupt_READLINE (Mvm* mvm)
+// Starts serving requests with io_uring where the kernel has it, with the pool of MVM_FILE_WORKERS threads
+// otherwise. Expects mvm_filesLock to be held.
+static bool mvm_startFileBackend(void)
 {
-    char * line = malloc(100), * linep = line;
-    size_t lenmax = 100, len = lenmax;
-    int c;
+#if defined(MVM_FILES_IO_URING)
+    if (mvm_fileRingOpen()) {
+        thrd_t completer;
+        if (thrd_create(&completer, mvm_fileRingCompleter, NULL) == thrd_success) {
+            thrd_detach(completer);
+            return true;
+        }
+        mvm_fileRingClose();
+    }
+#endif
+    bool started = false;
+    for (size_t i = 0; i < MVM_FILE_WORKERS; ++i) {
+        thrd_t worker;
+        if (thrd_create(&worker, mvm_fileWorker, NULL) == thrd_success) {
+            thrd_detach(worker);
+            started = true;
+        }
+    }
+    return started;
+}
 
-    if(line == NULL) {
+// Queues a read or write at `offset` and pushes the handle of the request. The requests are served by io_uring
+// or by a pool of threads (see mvm_startFileBackend), which is started with the first one.
+static ExceptionState mvm_fileSubmit(uint64_t handle, uint64_t offset, MvmSpan bytes, bool write, uint64_t* request)
+{
+    call_once(&mvm_filesOnce, mvm_initFiles);
+    if (!write) {
+        mvm_touchPages(bytes.data, bytes.size);
+    }
+    mtx_lock(&mvm_filesLock);
+    MvmFile* file = mvm_findFile(handle);
+    if (file == NULL) {
+        mtx_unlock(&mvm_filesLock);
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+
+    if (!mvm_fileBackendStarted) {
+        mvm_fileBackendStarted = mvm_startFileBackend();
+    }
+    size_t index = MVM_FILE_REQUESTS_CAPACITY;
+    for (size_t i = 0; i < MVM_FILE_REQUESTS_CAPACITY && index == MVM_FILE_REQUESTS_CAPACITY; ++i) {
+        if (mvm_fileRequests[i].state == MVM_FILE_REQUEST_FREE) {
+            index = i;
+        }
+    }
+    if (!mvm_fileBackendStarted || index == MVM_FILE_REQUESTS_CAPACITY) {
+        mtx_unlock(&mvm_filesLock);
         return EXCEPTION_INTERRUPT_FAILED;
-    }    
+    }
 
-    for(;;) {
-        c = fgetc(stdin);
-        if(c == EOF)
-            break;
+    mvm_fileRequests[index] = (MvmFileRequest) {
+            .state = MVM_FILE_REQUEST_QUEUED,
+            .write = write,
+            .fd = file->fd,
+            .file = handle,
+            .offset = offset,
+            .data = bytes.data,
+            .size = bytes.size,
+    };
+    file->pending += 1;
+    atomic_fetch_add(&mvm_fileRequestsPending, 1);
+#if defined(MVM_FILES_IO_URING)
+    if (mvm_fileRing.fd >= 0) {
+        mvm_fileRingSubmit(index);
+        mtx_unlock(&mvm_filesLock);
+        *request = index + 1;
+        return EXCEPTION_SATE_OK;
+    }
+#endif
+    mvm_fileQueue[(mvm_fileQueue_head + mvm_fileQueue_size) % MVM_FILE_REQUESTS_CAPACITY] = index;
+    mvm_fileQueue_size += 1;
+    cnd_signal(&mvm_fileQueued);
+    mtx_unlock(&mvm_filesLock);
+    *request = index + 1;
+    return EXCEPTION_SATE_OK;
+}
 
-        if(--len == 0) {
-            len = lenmax;
-            char * linen = realloc(linep, lenmax *= 2);
+static ExceptionState mvm_aioRead(Mvm* mvm, uint64_t handle, uint64_t offset, MvmSpan bytes, uint64_t* request)
+{
+    (void)mvm;
+    return mvm_fileSubmit(handle, offset, bytes, false, request);
+}
+MVM_BIND3(interrupt_AIOREAD, u64, mvm_aioRead, u64, u64, span)
 
-            if(linen == NULL) {
-                free(linep);
-                return EXCEPTION_INTERRUPT_FAILED;
-            }
-            line = linen + (line - linep);
-            linep = linen;
-        }
+static ExceptionState mvm_aioWrite(Mvm* mvm, uint64_t handle, uint64_t offset, MvmSpan bytes, uint64_t* request)
+{
+    (void)mvm;
+    return mvm_fileSubmit(handle, offset, bytes, true, request);
+}
+MVM_BIND3(interrupt_AIOWRITE, u64, mvm_aioWrite, u64, u64, span)
 
-        if((*line++ = (char)c) == '\n')
-            break;
+// Returns the request of `handle` if it was submitted and not collected yet. Expects mvm_filesLock to be held.
+static MvmFileRequest* mvm_findFileRequest(uint64_t handle)
+{
+    if (handle == 0 || handle > MVM_FILE_REQUESTS_CAPACITY || mvm_fileRequests[handle - 1].state == MVM_FILE_REQUEST_FREE) {
+        return NULL;
     }
-    *line = '\0';
-    const char* cstr = linep;
-
-    StringView sv = cstr_as_sv(cstr);
+    return &mvm_fileRequests[handle - 1];
+}
 
-    if (mvm->stack_size + sv.count > MVM_STACK_CAPACITY) {
+// Replaces the request with its result and 1 if it is done, which frees the request, or with 0 and 0.
+ExceptionState interrupt_AIOPOLL(Mvm* mvm)
+{
+    if (mvm->stack_size < 1) {
+        return EXCEPTION_STACK_UNDERFLOW;
+    }
+    if (mvm->stack_size + 1 > MVM_STACK_CAPACITY) {
         return EXCEPTION_STACK_OVERFLOW;
     }
-
-    for (size_t i = 0; i <= sv.count; ++i) {
-        mvm->stack_size += 1;
-        mvm->stack[mvm->stack_size] = word_u64((uint64_t)sv.data[sv.count - 1 - i]);
+    call_once(&mvm_filesOnce, mvm_initFiles);
+    mtx_lock(&mvm_filesLock);
+    MvmFileRequest* request = mvm_findFileRequest(mvm->stack[mvm->stack_size - 1].as_u64);
+    if (request == NULL) {
+        mtx_unlock(&mvm_filesLock);
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+    const bool done = request->state == MVM_FILE_REQUEST_DONE;
+    mvm->stack[mvm->stack_size - 1] = word_u64(done ? request->result : 0);
+    mvm->stack[mvm->stack_size++] = word_u64(done);
+    if (done) {
+        request->state = MVM_FILE_REQUEST_FREE;
     }
+    mtx_unlock(&mvm_filesLock);
+    return EXCEPTION_SATE_OK;
+}
 
+// Waits for the request and pushes its result. The request stays submitted if the run time limit expires.
+static ExceptionState mvm_aioWait(Mvm* mvm, uint64_t handle, uint64_t* result)
+{
+    call_once(&mvm_filesOnce, mvm_initFiles);
+    mtx_lock(&mvm_filesLock);
+    MvmFileRequest* request = mvm_findFileRequest(handle);
+    if (request == NULL) {
+        mtx_unlock(&mvm_filesLock);
+        return EXCEPTION_ILLEGAL_OPERAND;
+    }
+    while (request->state != MVM_FILE_REQUEST_DONE) {
+        const ExceptionState err = mvm_fileWait(mvm);
+        if (err != EXCEPTION_SATE_OK) {
+            mtx_unlock(&mvm_filesLock);
+            return err;
+        }
+    }
+    *result = request->result;
+    request->state = MVM_FILE_REQUEST_FREE;
+    mtx_unlock(&mvm_filesLock);
     return EXCEPTION_SATE_OK;
 }
+MVM_BIND1(interrupt_AIOWAIT, u64, mvm_aioWait, u64)
+
+bool mvm_filesPending(void)
+{
+    return atomic_load(&mvm_fileRequestsPending) > 0;
+}
+
+void mvm_closeFiles(void)
+{
+    call_once(&mvm_filesOnce, mvm_initFiles);
+    mtx_lock(&mvm_filesLock);
+    for (size_t i = 0; i < MVM_FILE_REQUESTS_CAPACITY; ++i) {
+        while (mvm_fileRequests[i].state == MVM_FILE_REQUEST_QUEUED) {
+            cnd_wait(&mvm_fileDone, &mvm_filesLock);
+        }
+        mvm_fileRequests[i].state = MVM_FILE_REQUEST_FREE;
+    }
+    for (size_t i = 0; i < MVM_FILES_CAPACITY; ++i) {
+        if (mvm_files[i].used) {
+            close(mvm_files[i].fd);
+            mvm_files[i].used = false;
+        }
+    }
+    for (size_t i = 0; i < MVM_FILE_MAPS_CAPACITY; ++i) {
+        if (mvm_fileMaps[i].data != NULL && !mvm_unmapFile(&mvm_fileMaps[i])) {
+            fprintf(stderr, "ERROR: Could not unmap a file! : %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    mtx_unlock(&mvm_filesLock);
+}
+#else
+// Without POSIX file descriptors and mmap the file interrupts are not available.
+ExceptionState interrupt_FILEOPEN(Mvm* mvm)  { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_FILECLOSE(Mvm* mvm) { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_FILEREAD(Mvm* mvm)  { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_FILEWRITE(Mvm* mvm) { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_FILESIZE(Mvm* mvm)  { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_FILEMAP(Mvm* mvm)   { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_FILEUNMAP(Mvm* mvm) { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_AIOREAD(Mvm* mvm)   { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_AIOWRITE(Mvm* mvm)  { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_AIOPOLL(Mvm* mvm)   { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+ExceptionState interrupt_AIOWAIT(Mvm* mvm)   { (void)mvm; return EXCEPTION_INTERRUPT_FAILED; }
+void mvm_closeFiles(void) {}
+bool mvm_setFileRoot(const char* root) { (void)root; return false; }
+bool mvm_filesPending(void) { return false; }
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 